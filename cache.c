@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+
+typedef struct __Cache_Entry_t {
+    int key;            // block pointer value, -1 if unused
+    unsigned long used; // tick of last access, for LRU
+    char data[CACHE_BLOCK_SIZE];
+} Cache_Entry_t;
+
+static Cache_Entry_t entries[CACHE_SETS][CACHE_WAYS];
+static unsigned long tick = 0;
+static int ready = 0;
+
+static void
+cache_init(void)
+{
+    for (int s = 0; s < CACHE_SETS; s++) {
+	for (int w = 0; w < CACHE_WAYS; w++) {
+	    entries[s][w].key = -1;
+	    entries[s][w].used = 0;
+	}
+    }
+    ready = 1;
+}
+
+static Cache_Entry_t *
+cache_find(int key)
+{
+    if (!ready) {
+	cache_init();
+    }
+    Cache_Entry_t *set = entries[(unsigned int) key % CACHE_SETS];
+    for (int w = 0; w < CACHE_WAYS; w++) {
+	if (set[w].key == key) {
+	    return &set[w];
+	}
+    }
+    return NULL;
+}
+
+int
+Cache_Get(int key, char *buffer)
+{
+    Cache_Entry_t *e = cache_find(key);
+    if (e == NULL) {
+	return -1;
+    }
+    e->used = ++tick;
+    memcpy(buffer, e->data, CACHE_BLOCK_SIZE);
+    return 0;
+}
+
+void
+Cache_Put(int key, char *buffer)
+{
+    Cache_Entry_t *e = cache_find(key);
+    if (e == NULL) {
+	// take the least recently used way of the set
+	Cache_Entry_t *set = entries[(unsigned int) key % CACHE_SETS];
+	e = &set[0];
+	for (int w = 1; w < CACHE_WAYS; w++) {
+	    if (set[w].used < e->used) {
+		e = &set[w];
+	    }
+	}
+	e->key = key;
+    }
+    e->used = ++tick;
+    memcpy(e->data, buffer, CACHE_BLOCK_SIZE);
+}
+
+void
+Cache_Drop(int key)
+{
+    Cache_Entry_t *e = cache_find(key);
+    if (e != NULL) {
+	e->key = -1;
+	e->used = 0;
+    }
+}
+
+static int
+cmp_recent(const void *a, const void *b)
+{
+    const Cache_Entry_t *x = *(const Cache_Entry_t * const *) a;
+    const Cache_Entry_t *y = *(const Cache_Entry_t * const *) b;
+    return (x->used < y->used) - (x->used > y->used);
+}
+
+int
+Cache_Keys(int *keys, int max)
+{
+    Cache_Entry_t *live[CACHE_SETS * CACHE_WAYS];
+    int n = 0;
+    if (!ready) {
+	cache_init();
+    }
+    for (int s = 0; s < CACHE_SETS; s++) {
+	for (int w = 0; w < CACHE_WAYS; w++) {
+	    if (entries[s][w].key != -1) {
+		live[n++] = &entries[s][w];
+	    }
+	}
+    }
+    qsort(live, n, sizeof(Cache_Entry_t *), cmp_recent);
+    if (n > max) {
+	n = max;
+    }
+    for (int i = 0; i < n; i++) {
+	keys[i] = live[i]->key;
+    }
+    return n;
+}
@@ -0,0 +1,29 @@
+#ifndef __CACHE_h__
+#define __CACHE_h__
+
+#define CACHE_BLOCK_SIZE (4096)
+#define CACHE_SETS (64)
+#define CACHE_WAYS (4)
+
+//
+// prototypes
+// 
+
+// In-memory cache of decoded data blocks keyed by block pointer value
+// (CACHE_SETS * CACHE_WAYS blocks, least recently used way evicted per set)
+
+// Copies cached block key into buffer
+// Returns 0 on hit, -1 on miss
+int Cache_Get(int key, char *buffer);
+
+// Inserts or replaces block key with CACHE_BLOCK_SIZE bytes of buffer
+void Cache_Put(int key, char *buffer);
+
+// Drops block key if cached (call when the block is freed or rewritten)
+void Cache_Drop(int key);
+
+// Fills keys with up to max cached block keys, most recently used first
+// Returns number of keys
+int Cache_Keys(int *keys, int max);
+
+#endif // __CACHE_h__
@@ -0,0 +1,187 @@
+#include <stdint.h>
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// reflected Castagnoli polynomial
+#define POLY (0x82f63b78)
+
+// bytes per lane when the hardware path runs three crc32 streams side by side
+#define LANE (1360)
+
+// slicing-by-8 tables for the software path
+static uint32_t table[8][256];
+
+// tables that advance a crc state over LANE and 2 * LANE zero bytes
+static uint32_t shift1[4][256];
+static uint32_t shift2[4][256];
+
+static uint32_t (*crc_fn)(uint32_t, const unsigned char *, size_t) = NULL;
+
+// software fallback, 8 bytes per step
+static uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *p, size_t n)
+{
+    while (n > 0 && ((uintptr_t) p & 7) != 0) {
+	crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	n--;
+    }
+    while (n >= 8) {
+	uint64_t word;
+	memcpy(&word, p, 8);
+	word ^= crc;
+	crc = table[7][word & 0xff] ^
+	      table[6][(word >> 8) & 0xff] ^
+	      table[5][(word >> 16) & 0xff] ^
+	      table[4][(word >> 24) & 0xff] ^
+	      table[3][(word >> 32) & 0xff] ^
+	      table[2][(word >> 40) & 0xff] ^
+	      table[1][(word >> 48) & 0xff] ^
+	      table[0][word >> 56];
+	p += 8;
+	n -= 8;
+    }
+    while (n > 0) {
+	crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	n--;
+    }
+    return crc;
+}
+
+// advance crc state over n zero bytes, bit at a time (only used to build tables)
+static uint32_t
+crc32c_zeros(uint32_t crc, size_t n)
+{
+    while (n > 0) {
+	crc = table[0][crc & 0xff] ^ (crc >> 8);
+	n--;
+    }
+    return crc;
+}
+
+// fill a 4 x 256 lookup for the linear map "advance over n zero bytes"
+static void
+crc32c_shift_table(uint32_t shift[4][256], size_t n)
+{
+    uint32_t basis[32];
+    for (int b = 0; b < 32; b++) {
+	basis[b] = crc32c_zeros(1u << b, n);
+    }
+    for (int k = 0; k < 4; k++) {
+	for (int v = 0; v < 256; v++) {
+	    uint32_t crc = 0;
+	    for (int b = 0; b < 8; b++) {
+		if (v & (1 << b)) {
+		    crc ^= basis[k * 8 + b];
+		}
+	    }
+	    shift[k][v] = crc;
+	}
+    }
+}
+
+static uint32_t
+crc32c_shift(uint32_t shift[4][256], uint32_t crc)
+{
+    return shift[0][crc & 0xff] ^ shift[1][(crc >> 8) & 0xff] ^
+	   shift[2][(crc >> 16) & 0xff] ^ shift[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+// hardware path, 8 bytes per crc32 instruction
+// the instruction has 3 cycles of latency, so long buffers run three
+// independent lanes and stitch them together with the shift tables
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hw(uint32_t crc, const unsigned char *p, size_t n)
+{
+    uint64_t crc64 = crc;
+    while (n >= 3 * LANE) {
+	uint64_t crcb = 0;
+	uint64_t crcc = 0;
+	for (int i = 0; i < LANE; i += 8) {
+	    uint64_t a, b, c;
+	    memcpy(&a, p + i, 8);
+	    memcpy(&b, p + LANE + i, 8);
+	    memcpy(&c, p + 2 * LANE + i, 8);
+	    crc64 = _mm_crc32_u64(crc64, a);
+	    crcb = _mm_crc32_u64(crcb, b);
+	    crcc = _mm_crc32_u64(crcc, c);
+	}
+	crc64 = crc32c_shift(shift2, (uint32_t) crc64) ^
+		crc32c_shift(shift1, (uint32_t) crcb) ^ (uint32_t) crcc;
+	p += 3 * LANE;
+	n -= 3 * LANE;
+    }
+    while (n > 0 && ((uintptr_t) p & 7) != 0) {
+	crc64 = _mm_crc32_u8((uint32_t) crc64, *p++);
+	n--;
+    }
+    while (n >= 8) {
+	uint64_t word;
+	memcpy(&word, p, 8);
+	crc64 = _mm_crc32_u64(crc64, word);
+	p += 8;
+	n -= 8;
+    }
+    while (n > 0) {
+	crc64 = _mm_crc32_u8((uint32_t) crc64, *p++);
+	n--;
+    }
+    return (uint32_t) crc64;
+}
+#endif
+
+// build tables and pick the implementation once
+static void
+crc32c_init(void)
+{
+    for (int i = 0; i < 256; i++) {
+	uint32_t crc = i;
+	for (int j = 0; j < 8; j++) {
+	    crc = (crc & 1) ? (crc >> 1) ^ POLY : crc >> 1;
+	}
+	table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+	for (int k = 1; k < 8; k++) {
+	    table[k][i] = table[0][table[k - 1][i] & 0xff] ^ (table[k - 1][i] >> 8);
+	}
+    }
+
+    crc32c_shift_table(shift1, LANE);
+    crc32c_shift_table(shift2, 2 * LANE);
+
+    crc_fn = crc32c_sw;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+	crc_fn = crc32c_hw;
+    }
+#endif
+}
+
+unsigned int
+CRC32C(unsigned int crc, const void *buffer, size_t n)
+{
+    if (crc_fn == NULL) {
+	crc32c_init();
+    }
+    return ~crc_fn(~crc, (const unsigned char *) buffer, n);
+}
+
+int
+CRC32C_Hardware(void)
+{
+    if (crc_fn == NULL) {
+	crc32c_init();
+    }
+#if defined(__x86_64__)
+    return crc_fn == crc32c_hw;
+#else
+    return 0;
+#endif
+}
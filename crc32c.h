@@ -0,0 +1,17 @@
+#ifndef __CRC32C_h__
+#define __CRC32C_h__
+
+#include <stddef.h>
+
+//
+// prototypes
+// 
+
+// CRC32C (Castagnoli) of n bytes of buffer, continuing from crc (start with 0)
+// Uses the SSE4.2 crc32 instruction when the CPU has it, else a table-driven fallback
+unsigned int CRC32C(unsigned int crc, const void *buffer, size_t n);
+
+// Returns 1 if the hardware path is in use, 0 if the software fallback is
+int CRC32C_Hardware(void);
+
+#endif // __CRC32C_h__
@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "layout.h"
+#include "lfs.h"
+#include "mfs.h"
+#include "crc32c.h"
+
+// Checks a classic image offline. The image is mapped, the bitmaps and inodes are
+// verified against their checksums, and a pool of threads walks the directory tree
+// from inode 0 (and, on a shard, from the directories whose parent is on another
+// shard), verifying block checksums on the way and building the inode bitmap, block
+// bitmap and packed slot maps the tree implies. Those are then compared with the ones
+// on disk, and a block with several pointers is reported unless it is file data in an
+// image served with -d. With -y the differences are repaired: entries that name free inodes and
+// bad block pointers are removed, sizes and block counts are corrected, the bitmaps
+// and slot maps are rewritten, so leaked blocks and unreachable inodes are freed, and
+// the metadata checksums are recorded again. Exit status follows e2fsck: 0 clean,
+// 1 errors repaired, 4 errors left, 8 image could not be checked.
+
+#define MAX_THREADS (64)
+
+static char *image;                             // the mapped image
+static int shard;                               // shard the image serves
+static unsigned char reached[NUM_INODES];       // inode found in the tree
+static unsigned short block_refs[NUM_BLOCKS];   // pointers to each block
+static unsigned short file_refs[NUM_BLOCKS];    // of them, raw file data pointers
+static unsigned char dir_refs[NUM_BLOCKS];      // pointed to as a directory entry block
+static unsigned char slot_refs[NUM_BLOCKS];     // packed slots in use
+static unsigned char cleared[NUM_INODES];       // bit i: pointer i is removed
+static int expect_size[NUM_INODES];
+static int expect_blocks[NUM_INODES];
+static int errors;
+static int unfixable;                           // errors -y can't repair
+static int shared;                              // raw blocks with several pointers (dedup)
+
+// directories and files waiting to be checked, each inode is queued once
+static int queue[NUM_INODES];
+static int head, tail, busy;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t more = PTHREAD_COND_INITIALIZER;
+
+static int *
+inode_at(int inum)
+{
+    return (int *) (image + INODE_START + (inum * INODE_SIZE));
+}
+
+static int
+bit(int start, int i)
+{
+    return (image[start + (i / 8)] >> (i % 8)) & 1;
+}
+
+static void
+problem(int fixable, const char *format, ...)
+{
+    va_list args;
+    char line[512];
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    printf("%s\n", line);
+    __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+    if (fixable == 0) {
+	__atomic_fetch_add(&unfixable, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void
+push(int inum)
+{
+    pthread_mutex_lock(&lock);
+    queue[tail++] = inum;
+    pthread_cond_signal(&more);
+    pthread_mutex_unlock(&lock);
+}
+
+// counts a pointer to block b and verifies its checksum the first time
+// returns the number of pointers to it found before
+static int
+mark_block(int inum, int b)
+{
+    int before = __atomic_fetch_add(&block_refs[b], 1, __ATOMIC_RELAXED);
+    if (before > 0) {
+	return before;
+    }
+    unsigned int crc = ((unsigned int *) (image + CSUM_START))[b];
+    if ((crc != 0) && (crc != CRC32C(0, image + BLOCK_START + ((size_t) b * BLOCK_SIZE), BLOCK_SIZE))) {
+	problem(0, "inode %d: block %d fails its checksum", inum, b);
+    }
+    return 0;
+}
+
+static void
+check_file(int inum)
+{
+    int *ptrs = inode_at(inum) + (INODE_OFFSET_PTR / sizeof(int));
+    int n = 0;
+    int end = 0;
+    for (int i = 0; i < 10; i++) {
+	int ptr = ptrs[i];
+	if (ptr == -1) {
+	    continue;
+	}
+	end = (i + 1) * BLOCK_SIZE;
+	if ((i == 0) && (ptr == INODE_PTR_INLINE)) {
+	    n++;
+	    continue;
+	}
+	if ((ptr >= 0) && (ptr < NUM_BLOCKS)) {
+	    mark_block(inum, ptr);
+	    __atomic_fetch_add(&file_refs[ptr], 1, __ATOMIC_RELAXED);
+	    n++;
+	    continue;
+	}
+	if ((ptr >= PTR_PACKED) && (ptr < PTR_PACKED + NUM_KEYS)) {
+	    int b = (ptr - PTR_PACKED) / SLOTS_PER_BLOCK;
+	    int slot = (ptr - PTR_PACKED) % SLOTS_PER_BLOCK;
+	    int clen;
+	    memcpy(&clen, image + BLOCK_START + ((size_t) b * BLOCK_SIZE) + (slot * SLOT_SIZE), sizeof(int));
+	    int nslots = (clen + sizeof(int) + SLOT_SIZE - 1) / SLOT_SIZE;
+	    if ((clen > 0) && (slot + nslots <= SLOTS_PER_BLOCK)) {
+		mark_block(inum, b);
+		__atomic_fetch_or(&slot_refs[b], ((1 << nslots) - 1) << slot, __ATOMIC_RELAXED);
+		n++;
+		continue;
+	    }
+	}
+	problem(1, "inode %d: bad block pointer %d (block %d)", inum, ptr, i);
+	cleared[inum] |= 1 << i;
+    }
+    // size reaches at least past the last block (earlier ones may be holes), at most 10 blocks
+    int size = inode_at(inum)[INODE_OFFSET_SIZE / sizeof(int)];
+    expect_blocks[inum] = n;
+    expect_size[inum] = (size < end) ? end : (size > 10 * BLOCK_SIZE) ? 10 * BLOCK_SIZE : size;
+}
+
+static void
+check_dir(int inum)
+{
+    int *ptrs = inode_at(inum) + (INODE_OFFSET_PTR / sizeof(int));
+    int n = 0;
+    for (int i = 0; i < 10; i++) {
+	int ptr = ptrs[i];
+	if (ptr == -1) {
+	    continue;
+	}
+	if ((ptr < 0) || (ptr >= NUM_BLOCKS)) {
+	    problem(1, "directory %d: bad entry block pointer %d (entry %d)", inum, ptr, i);
+	    cleared[inum] |= 1 << i;
+	    continue;
+	}
+	char *entry = image + BLOCK_START + ((size_t) ptr * BLOCK_SIZE);
+	char name[252];
+	int child;
+	memcpy(&child, entry, sizeof(int));
+	memcpy(name, entry + sizeof(int), sizeof(name));
+	name[sizeof(name) - 1] = '\0';
+
+	// Entries name global inums; those of other shards are checked there
+	int local = MFS_LOCAL(child);
+	if ((MFS_SHARD(child) == shard) && ((child < 0) || (local >= NUM_INODES) || (bit(INODE_BITMAP_START, local) == 0))) {
+	    if (i < 2) {
+		problem(0, "directory %d: \"%s\" names free inode %d", inum, name, child);
+	    }
+	    else {
+		problem(1, "directory %d: entry \"%s\" names free inode %d", inum, name, child);
+		cleared[inum] |= 1 << i;
+		continue;
+	    }
+	}
+	mark_block(inum, ptr);
+	dir_refs[ptr] = 1;
+	n++;
+	if ((i >= 2) && (MFS_SHARD(child) == shard) && (__atomic_exchange_n(&reached[local], 1, __ATOMIC_RELAXED) == 0)) {
+	    push(local);
+	}
+    }
+    expect_blocks[inum] = inode_at(inum)[INODE_OFFSET_NUM_B / sizeof(int)];
+    expect_size[inum] = n * 256;
+}
+
+static void *
+worker(void *arg)
+{
+    while (1) {
+	pthread_mutex_lock(&lock);
+	while ((head == tail) && (busy > 0)) {
+	    pthread_cond_wait(&more, &lock);
+	}
+	if (head == tail) {
+	    pthread_cond_broadcast(&more);
+	    pthread_mutex_unlock(&lock);
+	    return NULL;
+	}
+	int inum = queue[head++];
+	busy++;
+	pthread_mutex_unlock(&lock);
+
+	int type = inode_at(inum)[INODE_OFFSET_TYPE / sizeof(int)];
+	if (type == MFS_DIRECTORY) {
+	    check_dir(inum);
+	}
+	else if (type == MFS_REGULAR_FILE) {
+	    check_file(inum);
+	}
+	else {
+	    problem(0, "inode %d: bad type %d", inum, type);
+	}
+
+	pthread_mutex_lock(&lock);
+	busy--;
+	if ((head == tail) && (busy == 0)) {
+	    pthread_cond_broadcast(&more);
+	}
+	pthread_mutex_unlock(&lock);
+    }
+}
+
+// compares (and with repair set, rewrites) bitmap at start with want (one byte per bit)
+static void
+check_bitmap(int start, int n, unsigned char *want, char *what, int repair)
+{
+    for (int i = 0; i < n; i++) {
+	int have = bit(start, i);
+	if (have == want[i]) {
+	    continue;
+	}
+	problem(1, (have == 1) ? "%s %d is marked in use but nothing refers to it" :
+		"%s %d is in use but marked free", what, i);
+	if (repair == 1) {
+	    image[start + (i / 8)] ^= 1 << (i % 8);
+	}
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    int repair = 0;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int usage = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "yj:")) != -1) {
+	if (opt == 'y') {
+	    repair = 1;
+	}
+	else if (opt == 'j') {
+	    threads = atoi(optarg);
+	}
+	else {
+	    usage = 1;
+	}
+    }
+    if ((usage == 1) || (optind != argc - 1)) {
+	printf("Usage: mfs-fsck [-y] [-j threads] image\n");
+	printf("  -y  repair what is found (default: only report)\n");
+	printf("  -j  threads walking the tree (default: one per CPU)\n");
+	exit(8);
+    }
+    threads = (threads < 1) ? 1 : (threads > MAX_THREADS) ? MAX_THREADS : threads;
+
+    char *path = argv[optind];
+    int fd = open(path, (repair == 1) ? O_RDWR : O_RDONLY);
+    struct stat st;
+    if ((fd < 0) || (fstat(fd, &st) < 0)) {
+	perror(path);
+	exit(8);
+    }
+    if ((st.st_size >= LFS_BLOCK_SIZE * 2) && (st.st_size < FS_SIZE)) {
+	char magic[2][8];
+	if ((pread(fd, magic[0], 8, 0) == 8) && (pread(fd, magic[1], 8, LFS_BLOCK_SIZE) == 8) &&
+	    ((memcmp(magic[0], LFS_MAGIC, 8) == 0) || (memcmp(magic[1], LFS_MAGIC, 8) == 0))) {
+	    printf("%s is log-structured; its checkpoint is verified when the server loads it\n", path);
+	    exit(8);
+	}
+    }
+    if (st.st_size < META_CSUM_START) {
+	printf("%s is not an image (%lld bytes, expected %d)\n", path, (long long) st.st_size, FS_SIZE);
+	exit(8);
+    }
+    // Images made before metadata checksums end where they start; -y makes room for them
+    if ((st.st_size < FS_SIZE) && (repair == 1) && (ftruncate(fd, FS_SIZE) == 0)) {
+	st.st_size = FS_SIZE;
+    }
+    size_t size = (st.st_size < FS_SIZE) ? META_CSUM_START : FS_SIZE;
+    image = mmap(NULL, size, PROT_READ | ((repair == 1) ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED) {
+	perror("mmap");
+	exit(8);
+    }
+    madvise(image, size, MADV_WILLNEED);
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    // A crashed rename is completed by the server at load, repairs before that would undo it
+    int intent;
+    memcpy(&intent, image + INTENT_START, sizeof(int));
+    if (intent == INTENT_MAGIC) {
+	printf("A rename was cut short; start the server once to complete it\n");
+	if (repair == 1) {
+	    printf("Not repairing\n");
+	    repair = 0;
+	}
+    }
+
+    // Bitmaps and inodes against their checksums; the walk below checks what they hold
+    unsigned int *meta_csum = (size == FS_SIZE) ? (unsigned int *) (image + META_CSUM_START) : NULL;
+    for (int i = 0; (meta_csum != NULL) && (i < META_CHUNKS); i++) {
+	if ((meta_csum[i] != 0) && (meta_csum[i] != CRC32C(0, image + (i * BLOCK_SIZE), META_CHUNK_LEN(i)))) {
+	    problem(1, "bitmaps and inodes: bytes %d-%d fail their checksum", i * BLOCK_SIZE, (i * BLOCK_SIZE) + META_CHUNK_LEN(i) - 1);
+	}
+    }
+
+    if ((bit(INODE_BITMAP_START, 0) == 0) || (inode_at(0)[INODE_OFFSET_TYPE / sizeof(int)] != MFS_DIRECTORY)) {
+	printf("Root inode 0 is not a directory\n");
+	exit(8);
+    }
+    // The root's "." entry holds its global inum, which gives the shard
+    int dot = inode_at(0)[INODE_OFFSET_PTR / sizeof(int)];
+    if ((dot >= 0) && (dot < NUM_BLOCKS)) {
+	int root;
+	memcpy(&root, image + BLOCK_START + ((size_t) dot * BLOCK_SIZE), sizeof(int));
+	shard = MFS_SHARD(root);
+    }
+
+    reached[0] = 1;
+    queue[tail++] = 0;
+    // A directory placed on this shard is named only in its parent on another shard; its
+    // ".." entry says so, and the walk starts from it too (its parent's entry is checked there)
+    int remote = 0;
+    for (int inum = 1; inum < NUM_INODES; inum++) {
+	int *inode = inode_at(inum);
+	int dotdot = inode[(INODE_OFFSET_PTR / sizeof(int)) + 1];
+	if ((bit(INODE_BITMAP_START, inum) == 0) || (inode[INODE_OFFSET_TYPE / sizeof(int)] != MFS_DIRECTORY) ||
+	    (dotdot < 0) || (dotdot >= NUM_BLOCKS)) {
+	    continue;
+	}
+	int parent;
+	memcpy(&parent, image + BLOCK_START + ((size_t) dotdot * BLOCK_SIZE), sizeof(int));
+	if (MFS_SHARD(parent) != shard) {
+	    reached[inum] = 1;
+	    queue[tail++] = inum;
+	    remote++;
+	}
+    }
+    pthread_t pool[MAX_THREADS];
+    for (int i = 0; i < threads; i++) {
+	pthread_create(&pool[i], NULL, worker, NULL);
+    }
+    for (int i = 0; i < threads; i++) {
+	pthread_join(pool[i], NULL);
+    }
+
+    // Only file data may be shared, and only in an image served with -d (see Feature Flags
+    // in layout.h); a block also named by a directory or holding packed slots is not
+    int features = 0;
+    if (size == FS_SIZE) {
+	memcpy(&features, image + FEATURES_START, sizeof(int));
+    }
+    for (int b = 0; b < NUM_BLOCKS; b++) {
+	if (block_refs[b] < 2) {
+	    continue;
+	}
+	if (dir_refs[b] == 1) {
+	    problem(0, "block %d: directory entry block has %d pointers", b, block_refs[b]);
+	}
+	else if ((file_refs[b] > 0) && (slot_refs[b] != 0)) {
+	    problem(0, "block %d: file data block also holds packed slots", b);
+	}
+	else if (file_refs[b] > 1) {
+	    shared++;
+	    if ((features & FEATURE_DEDUP) == 0) {
+		problem(0, "block %d: shared by %d file blocks in an image not served with -d", b, file_refs[b]);
+	    }
+	}
+    }
+
+    // Inodes the walk reached with wrong pointers, sizes or block counts
+    int inodes = 0;
+    for (int inum = 0; inum < NUM_INODES; inum++) {
+	if (reached[inum] == 0) {
+	    continue;
+	}
+	inodes++;
+	int *inode = inode_at(inum);
+	if (inode[INODE_OFFSET_SIZE / sizeof(int)] != expect_size[inum]) {
+	    problem(1, "inode %d: size %d, expected %d", inum, inode[INODE_OFFSET_SIZE / sizeof(int)], expect_size[inum]);
+	}
+	if (inode[INODE_OFFSET_NUM_B / sizeof(int)] != expect_blocks[inum]) {
+	    problem(1, "inode %d: %d blocks, expected %d", inum, inode[INODE_OFFSET_NUM_B / sizeof(int)], expect_blocks[inum]);
+	}
+	if (repair == 1) {
+	    for (int i = 0; i < 10; i++) {
+		if ((cleared[inum] >> i) & 1) {
+		    inode[(INODE_OFFSET_PTR / sizeof(int)) + i] = -1;
+		}
+	    }
+	    inode[INODE_OFFSET_SIZE / sizeof(int)] = expect_size[inum];
+	    inode[INODE_OFFSET_NUM_B / sizeof(int)] = expect_blocks[inum];
+	}
+    }
+
+    // What the tree implies against what is on disk
+    unsigned char want[NUM_BLOCKS];
+    int blocks = 0;
+    check_bitmap(INODE_BITMAP_START, NUM_INODES, reached, "inode", repair);
+    for (int b = 0; b < NUM_BLOCKS; b++) {
+	want[b] = (block_refs[b] > 0);
+	blocks += want[b];
+    }
+    check_bitmap(BLOCK_BITMAP_START, NUM_BLOCKS, want, "block", repair);
+    for (int b = 0; b < NUM_BLOCKS; b++) {
+	unsigned char *have = (unsigned char *) image + SLOTMAP_START + b;
+	if (*have != slot_refs[b]) {
+	    problem(1, "block %d: slot map %02x, expected %02x", b, *have, slot_refs[b]);
+	    if (repair == 1) {
+		*have = slot_refs[b];
+	    }
+	}
+    }
+
+    if (repair == 1) {
+	for (int i = 0; (meta_csum != NULL) && (i < META_CHUNKS); i++) {
+	    meta_csum[i] = CRC32C(0, image + (i * BLOCK_SIZE), META_CHUNK_LEN(i));
+	}
+	msync(image, size, MS_SYNC);
+	fsync(fd);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = ((end.tv_sec - begin.tv_sec) * 1e3) + ((end.tv_nsec - begin.tv_nsec) / 1e6);
+    printf("%s: shard %d (%d directories under other shards), %d inodes, %d blocks in use, %d shared, %d errors (%d %s) in %.1f ms with %d threads\n",
+	   path, shard, remote, inodes, blocks, shared, errors, errors - unfixable, (repair == 1) ? "repaired" : "repairable",
+	   ms, threads);
+    munmap(image, size);
+    close(fd);
+    if (errors == 0) {
+	return 0;
+    }
+    return ((repair == 1) && (unfixable == 0)) ? 1 : 4;
+}
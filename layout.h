@@ -0,0 +1,176 @@
+#ifndef __LAYOUT_h__
+#define __LAYOUT_h__
+
+//
+// On-disk layout of classic images, shared by the server and mfs-fsck
+//
+
+#define NUM_INODES (4096)
+#define NUM_BLOCKS (4096)
+#define INODE_SIZE (52)
+#define BLOCK_SIZE (4096)
+
+
+#define FIRST_INODE (1024)
+#define INODE_BITMAP_START (0)
+#define BLOCK_BITMAP_START (512)
+#define INODE_START (1024)
+#define BLOCK_START (214016)
+
+#define INODE_OFFSET_TYPE (0)
+#define INODE_OFFSET_SIZE (4)
+#define INODE_OFFSET_NUM_B (8)
+#define INODE_OFFSET_PTR (12)
+
+#define INLINE_SIZE (256)
+#define INLINE_START (16991232)
+#define INODE_PTR_INLINE (-2)
+
+#define CSUM_START (18039808)
+
+#define SLOTMAP_START (18056192)
+#define SLOT_SIZE (512)
+#define SLOTS_PER_BLOCK (8)
+#define PTR_PACKED (0x10000000)
+#define NUM_KEYS (NUM_BLOCKS * SLOTS_PER_BLOCK)
+
+#define SNAP_START (18060288)
+#define MAX_SNAPSHOTS (4)
+#define SNAP_META_SIZE (1266688)
+#define SNAP_INUM_SHIFT (12)
+
+#define INTENT_START (23131136)
+#define INTENT_MAGIC (0x524e4d45)
+
+#define META_CSUM_START (23135232)
+#define META_CHUNKS ((BLOCK_START + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define META_CHUNK_LEN(i) (((i) < META_CHUNKS - 1) ? BLOCK_SIZE : BLOCK_START - ((META_CHUNKS - 1) * BLOCK_SIZE))
+#define FEATURES_START (23139324)
+#define FEATURE_DEDUP (0x1)
+
+#define FS_SIZE (23139328)
+// #define MFS_DIRECTORY    (0) // defined in mfs.h
+// #define MFS_REGULAR_FILE (1)
+
+/***************
+Filesystem Structure:
+Bytes 0-511: Inode bitmap
+Bytes 512-1023: Data block bitmap
+Bytes 1024-214015: Inodes (212992 bytes)
+Bytes 214016-16991231: Data blocks
+Bytes 16991232-18039807: Inline data records (256 bytes per inode)
+Bytes 18039808-18056191: Data block checksums (4 bytes per block)
+Bytes 18056192-18060287: Packed block slot maps (1 byte per block)
+Bytes 18060288-18064383: Snapshot table (4 byte state per snapshot)
+Bytes 18064384-23131135: Snapshot metadata copies (4 x 1266688 bytes)
+Bytes 23131136-23135231: Rename intent record
+Bytes 23135232-23139323: Metadata checksums (4 bytes per 4 KiB of bitmaps and inodes)
+Bytes 23139324-23139327: Feature flags (type int)
+Total size (max): 23.1 MB
+The image file is sparse: it is sized with ftruncate, and free data blocks are
+punched out of it (fallocate), so it only takes the host space in use
+***************/
+
+/***************
+Log-structured images (formatted with -L) use a different layout, see lfs.h.
+They are recognized by the magic in their checkpoint region and served by LFS_* calls.
+***************/
+
+/***************
+Bitmap Structure:
+char's of 1 byte each - bits accessed via bit manipulation
+***************/
+
+/***************
+Inode Structure (File):
+Byte 0-3: type (type int, 0 = dir, 1 = file)
+Byte 4-7: size in bytes (type int)
+Byte 8-11: num of blocks (type int)
+Byte 12-51: 	If type 1, pointer to up to 10 blocks (type int, indicates byte number of block)
+			If type 0, pointer to up to 10 blocks pointing to other inodes (type int, indicates block number)
+NOTE: inode name is stored in blocks linked to directory inodes - 4 byte inode number + 252 bytes of char
+NOTE: if block pointer is -1, it is unusued; in a file, unused blocks before size are holes and read as zeros
+NOTE: if block pointer 0 is -2, block 0 of the file is stored inline (see below)
+NOTE: blocks are numbered 0-9
+Total size: 52 bytes
+***************/
+
+/***************
+Inline Data Structure:
+Extended record of INLINE_SIZE bytes per inode, at INLINE_START + (inum * INLINE_SIZE)
+Holds block 0 of a regular file whose data is all zero past INLINE_SIZE bytes,
+as long as the file has no other blocks. Moved out to a data block when the file grows.
+Inline blocks still count as 1 block / BLOCK_SIZE bytes in stat.
+NOTE: the records are not next to the inodes: the inode table stays packed at INODE_SIZE,
+so older images and the inode offsets every tool computes are unchanged. Reading an inline
+block thus costs an inode read and a record read, the same as a block read; what it saves
+is the data block, its bitmap bit and checksum, and 3840 bytes of every read and write.
+The region (NUM_INODES * INLINE_SIZE = 1 MiB) is a hole in the image file until records
+are written, so only the apparent size grows.
+***************/
+
+/***************
+Checksum Structure:
+CRC32C of each data block (file data and directory entry blocks), 4 bytes per block
+Updated on every block write, verified on every block read
+NOTE: checksum 0 means none recorded (images made before checksums existed)
+CRC32C of each 4 KiB chunk of bytes 0-214015 (bitmaps and inodes, 53 chunks, the last
+one 1024 bytes), 4 bytes per chunk at META_CSUM_START
+Computed from the server's own copy of the bytes it wrote (not read back from disk), for
+the chunks written by a mutating request, once its metadata writes are done; verified at
+load and by mfs-fsck
+NOTE: a chunk that fails at load is reported and keeps failing (the server does not
+record its checksum again) until mfs-fsck -y has checked the structure behind it.
+A crash in the middle of a request can leave a chunk's checksum stale this way
+NOTE: the rename intent record carries a CRC32C of its own. The other regions have none:
+- inline records: a checksum per 4 KiB of records would make each inline write read and
+  hash 16 records, the cost inline data exists to avoid; the inode naming one is covered
+- slot maps: derived from the inodes, which are covered, and rebuilt by mfs-fsck
+- snapshot table and copies: written once when a snapshot is taken, and the copies fill
+  their SNAP_META_SIZE exactly, so there is no room for the chunk checksums beside them
+***************/
+
+/***************
+Feature Flags:
+Bit FEATURE_DEDUP: data blocks may be shared by several files (set the first time the
+image is served with -d). Freeing such a block needs the refcounts only a dedup server
+keeps, so the server refuses to serve the image without -d
+NOTE: 0 in older images, which read as zeros there
+***************/
+
+/***************
+Packed Block Structure (compression mode):
+A compressed file block is stored in a run of SLOT_SIZE byte slots inside one data block
+Byte 0-3 of the run: compressed length (type int), followed by the compressed data
+Inode pointer to it is PTR_PACKED + (block number * SLOTS_PER_BLOCK) + first slot
+Slot map byte of a block has bit n set if slot n is in use (0 = not a packed block)
+Blocks that need more than SLOTS_PER_BLOCK - 1 slots are stored raw, with no decode on read
+***************/
+
+/***************
+Rename Intent Structure:
+A rename touches up to three directory inodes and several entry blocks, so its
+final state is written to the intent record (Rename_Intent_t) and synced before
+any of it is applied, and the record is cleared after. Every field holds a final
+value, so applying a record twice is harmless: one left behind by a crash is
+applied again at load, which completes the rename. A record that fails its CRC32C was
+torn while it was written, before any of it was applied, and is dropped.
+Entry blocks are never rewritten (snapshots share them): the renamed entry, and the
+".." entry of a directory moved to a new parent, go to new blocks and the old ones are freed
+***************/
+
+/***************
+Snapshot Structure:
+Snapshot table: state of each of MAX_SNAPSHOTS snapshots (type int, 0 = free, 1 = valid)
+Snapshot s copies the metadata of the image at creation time into its own area:
+	Bytes 0-214015: bitmaps and inodes (same layout as the live image)
+	Bytes 214016-1262591: inline data records (only records in use are copied)
+	Bytes 1262592-1266687: packed block slot maps
+Data blocks are shared with the live image, never copied: file data, packed slots and
+directory entry blocks are only written once, and while a snapshot holds a block or
+slot it is not handed out again even if the live image frees it
+Inode i of snapshot s is exposed read-only as inum ((s + 1) << SNAP_INUM_SHIFT) | i,
+so the root of snapshot s is (s + 1) << SNAP_INUM_SHIFT
+***************/
+
+#endif // __LAYOUT_h__
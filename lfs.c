@@ -0,0 +1,906 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "lfs.h"
+#include "mfs.h"
+#include "crc32c.h"
+
+#define LFS_BATCH (16)
+#define LFS_DIRENTS (LFS_BLOCK_SIZE / sizeof(MFS_DirEnt_t))
+
+// summary entry index values other than a block number within a file
+#define SUM_INODE (-1)
+#define SUM_IMAP (-2)
+#define SUM_EMPTY (-3)
+
+#define SEG_FREE (0)
+#define SEG_USED (1)
+
+typedef struct __LFS_CR_t {
+    char magic[8];
+    unsigned int seq;                      // higher wins between the two copies
+    unsigned int crc;                      // CRC32C of the struct with crc = 0
+    int cur_seg;                           // segment being appended to
+    int tail;                              // next free block within cur_seg
+    int imap_pieces[LFS_IMAP_PIECES];      // block address of each piece, -1 if all free
+    unsigned char seg_state[LFS_NUM_SEGS];
+} LFS_CR_t;
+
+typedef struct __LFS_Inode_t {
+    int type;
+    int size;
+    int blocks;
+    int ptr[LFS_NUM_PTRS];                 // block addresses, -1 if unused
+} LFS_Inode_t;
+
+// what a log block holds: block index of inum, its inode, or imap piece inum
+typedef struct __LFS_Summary_t {
+    int inum;
+    int index;
+} LFS_Summary_t;
+
+static int fd = -1;
+static LFS_CR_t cr;
+static int imap[LFS_NUM_INODES];
+static int live_inodes = 0;                // imap entries in use, for LFS_StatFS
+static int cleaning = 0;
+static int shard = 0;                      // directory entries hold MFS_INUM(shard, inum)
+
+// blocks waiting for the next append
+static char stage_data[LFS_BATCH][LFS_BLOCK_SIZE];
+static LFS_Summary_t stage_sum[LFS_BATCH];
+static int nstaged = 0;
+
+static int
+seg_start(int seg)
+{
+    return LFS_CR_BLOCKS + (seg * LFS_SEG_BLOCKS);
+}
+
+static int
+read_addr(int addr, void *buffer, int n)
+{
+    if (pread(fd, buffer, n, (off_t) addr * LFS_BLOCK_SIZE) != n) {
+	return -1;
+    }
+    return 0;
+}
+
+static int
+read_inode(int inum, LFS_Inode_t *inode)
+{
+    if (inum < 0 || inum > LFS_NUM_INODES - 1 || imap[inum] == -1) {
+	return -1;
+    }
+    return read_addr(imap[inum], inode, sizeof(LFS_Inode_t));
+}
+
+static int
+free_segments(void)
+{
+    int n = 0;
+    for (int i = 0; i < LFS_NUM_SEGS; i++) {
+	if (cr.seg_state[i] == SEG_FREE) {
+	    n++;
+	}
+    }
+    return n;
+}
+
+// write the CR to the copy not holding the current one
+static int
+write_cr(void)
+{
+    cr.seq++;
+    cr.crc = 0;
+    cr.crc = CRC32C(0, &cr, sizeof(cr));
+    char block[LFS_BLOCK_SIZE];
+    memset(block, 0, LFS_BLOCK_SIZE);
+    memcpy(block, &cr, sizeof(cr));
+    if (pwrite(fd, block, LFS_BLOCK_SIZE, (off_t) (cr.seq % 2) * LFS_BLOCK_SIZE) != LFS_BLOCK_SIZE) {
+	return -1;
+    }
+    return fdatasync(fd);
+}
+
+// start appending to a free segment, with an empty summary
+static int
+open_segment(void)
+{
+    int seg;
+    for (seg = 0; seg < LFS_NUM_SEGS; seg++) {
+	if (cr.seg_state[seg] == SEG_FREE) {
+	    break;
+	}
+    }
+    if (seg == LFS_NUM_SEGS) {
+	return -1;
+    }
+
+    LFS_Summary_t summary[LFS_SEG_BLOCKS];
+    for (int i = 0; i < LFS_SEG_BLOCKS; i++) {
+	summary[i].inum = -1;
+	summary[i].index = SUM_EMPTY;
+    }
+    if (pwrite(fd, summary, sizeof(summary), (off_t) seg_start(seg) * LFS_BLOCK_SIZE) != sizeof(summary)) {
+	return -1;
+    }
+    cr.seg_state[seg] = SEG_USED;
+    cr.cur_seg = seg;
+    cr.tail = 1;
+    return 0;
+}
+
+// make room for n more blocks in the current segment
+// normal updates leave the last free segment to the cleaner
+static int
+reserve(int n)
+{
+    if (cr.tail + nstaged + n <= LFS_SEG_BLOCKS) {
+	return 0;
+    }
+    if (nstaged > 0) {
+	return -1;
+    }
+    if (!cleaning) {
+	while (free_segments() < 2 && LFS_Clean(1) == 1) {
+	}
+	if (free_segments() < 2) {
+	    return -1;
+	}
+    }
+    return open_segment();
+}
+
+// queue a block for the next append, return the address it will land at
+static int
+stage(void *buffer, int n, int inum, int index)
+{
+    memset(stage_data[nstaged], 0, LFS_BLOCK_SIZE);
+    memcpy(stage_data[nstaged], buffer, n);
+    stage_sum[nstaged].inum = inum;
+    stage_sum[nstaged].index = index;
+    nstaged++;
+    return seg_start(cr.cur_seg) + cr.tail + nstaged - 1;
+}
+
+static int
+stage_inode(int inum, LFS_Inode_t *inode)
+{
+    if (imap[inum] == -1) {
+	live_inodes++;
+    }
+    imap[inum] = stage(inode, sizeof(LFS_Inode_t), inum, SUM_INODE);
+    return imap[inum];
+}
+
+static void
+stage_imap_piece(int piece)
+{
+    cr.imap_pieces[piece] = stage(&imap[piece * LFS_IMAP_PER_BLOCK], LFS_IMAP_PER_BLOCK * sizeof(int), piece, SUM_IMAP);
+}
+
+// one sequential write of the staged blocks and their summary entries, then the CR
+static int
+commit(void)
+{
+    int addr = seg_start(cr.cur_seg) + cr.tail;
+    int n = nstaged;
+    nstaged = 0;
+    if (pwrite(fd, stage_data, n * LFS_BLOCK_SIZE, (off_t) addr * LFS_BLOCK_SIZE) != n * LFS_BLOCK_SIZE) {
+	return -1;
+    }
+    off_t sumoff = ((off_t) seg_start(cr.cur_seg) * LFS_BLOCK_SIZE) + (cr.tail * sizeof(LFS_Summary_t));
+    if (pwrite(fd, stage_sum, n * sizeof(LFS_Summary_t), sumoff) != (ssize_t) (n * sizeof(LFS_Summary_t))) {
+	return -1;
+    }
+    // log blocks must be durable before the CR points at them
+    if (fdatasync(fd) < 0) {
+	return -1;
+    }
+    cr.tail += n;
+    return write_cr();
+}
+
+static void
+init_dir_block(MFS_DirEnt_t *entries, int inum, int pinum)
+{
+    for (int i = 0; i < (int) LFS_DIRENTS; i++) {
+	entries[i].inum = -1;
+	memset(entries[i].name, 0, sizeof(entries[i].name));
+    }
+    entries[0].inum = inum;
+    strcpy(entries[0].name, ".");
+    entries[1].inum = pinum;
+    strcpy(entries[1].name, "..");
+}
+
+// find entry name in directory inode, return its block index and entry slot
+static int
+find_dirent(LFS_Inode_t *dir, char *name, MFS_DirEnt_t *entries, int *slot)
+{
+    for (int i = 0; i < LFS_NUM_PTRS; i++) {
+	if (dir->ptr[i] == -1 || read_addr(dir->ptr[i], entries, LFS_BLOCK_SIZE) < 0) {
+	    continue;
+	}
+	for (int j = 0; j < (int) LFS_DIRENTS; j++) {
+	    if (entries[j].inum != -1 && strncmp(entries[j].name, name, sizeof(entries[j].name)) == 0) {
+		*slot = j;
+		return i;
+	    }
+	}
+    }
+    return -1;
+}
+
+// find a free entry in parent, or an unused block index for a new directory block
+// (then entries is cleared and parent->blocks counts it), return the block index and entry slot
+static int
+alloc_dirent(LFS_Inode_t *parent, MFS_DirEnt_t *entries, int *slot)
+{
+    for (int i = 0; i < LFS_NUM_PTRS; i++) {
+	if (parent->ptr[i] == -1 || read_addr(parent->ptr[i], entries, LFS_BLOCK_SIZE) < 0) {
+	    continue;
+	}
+	for (int j = 0; j < (int) LFS_DIRENTS; j++) {
+	    if (entries[j].inum == -1) {
+		*slot = j;
+		return i;
+	    }
+	}
+    }
+    for (int i = 0; i < LFS_NUM_PTRS; i++) {
+	if (parent->ptr[i] == -1) {
+	    for (int j = 0; j < (int) LFS_DIRENTS; j++) {
+		entries[j].inum = -1;
+		memset(entries[j].name, 0, sizeof(entries[j].name));
+	    }
+	    *slot = 0;
+	    parent->blocks++;
+	    return i;
+	}
+    }
+    return -1;
+}
+
+// stage a fresh inode of type as newinum, with "." and ".." entries if a directory
+static void
+stage_new_inode(int newinum, int type, int parent)
+{
+    LFS_Inode_t inode;
+    inode.type = type;
+    inode.size = 0;
+    inode.blocks = 0;
+    for (int i = 0; i < LFS_NUM_PTRS; i++) {
+	inode.ptr[i] = -1;
+    }
+    if (type == MFS_DIRECTORY) {
+	MFS_DirEnt_t own[LFS_DIRENTS];
+	init_dir_block(own, MFS_INUM(shard, newinum), parent);
+	inode.ptr[0] = stage(own, LFS_BLOCK_SIZE, newinum, 0);
+	inode.size = 2 * sizeof(MFS_DirEnt_t);
+	inode.blocks = 1;
+    }
+    stage_inode(newinum, &inode);
+}
+
+static int
+find_free_inum(void)
+{
+    for (int i = 0; i < LFS_NUM_INODES; i++) {
+	if (imap[i] == -1) {
+	    return i;
+	}
+    }
+    return -1;
+}
+
+void
+LFS_SetShard(int id)
+{
+    shard = id;
+}
+
+int
+LFS_Format(int newfd)
+{
+    fd = newfd;
+    if (ftruncate(fd, LFS_IMAGE_SIZE) < 0) {
+	return -1;
+    }
+
+    memset(&cr, 0, sizeof(cr));
+    memcpy(cr.magic, LFS_MAGIC, sizeof(cr.magic));
+    for (int i = 0; i < LFS_IMAP_PIECES; i++) {
+	cr.imap_pieces[i] = -1;
+    }
+    for (int i = 0; i < LFS_NUM_INODES; i++) {
+	imap[i] = -1;
+    }
+    live_inodes = 0;
+    if (open_segment() < 0) {
+	return -1;
+    }
+
+    // root directory is inode 0, its own parent
+    MFS_DirEnt_t entries[LFS_DIRENTS];
+    init_dir_block(entries, MFS_INUM(shard, 0), MFS_INUM(shard, 0));
+    LFS_Inode_t root;
+    root.type = MFS_DIRECTORY;
+    root.size = 2 * sizeof(MFS_DirEnt_t);
+    root.blocks = 1;
+    for (int i = 0; i < LFS_NUM_PTRS; i++) {
+	root.ptr[i] = -1;
+    }
+    root.ptr[0] = stage(entries, LFS_BLOCK_SIZE, 0, 0);
+    stage_inode(0, &root);
+    stage_imap_piece(0);
+    return commit();
+}
+
+int
+LFS_Load(int newfd)
+{
+    LFS_CR_t copy[2];
+    int best = -1;
+    for (int i = 0; i < 2; i++) {
+	if (pread(newfd, &copy[i], sizeof(LFS_CR_t), (off_t) i * LFS_BLOCK_SIZE) != sizeof(LFS_CR_t)) {
+	    continue;
+	}
+	unsigned int crc = copy[i].crc;
+	copy[i].crc = 0;
+	if (memcmp(copy[i].magic, LFS_MAGIC, sizeof(copy[i].magic)) != 0 || CRC32C(0, &copy[i], sizeof(LFS_CR_t)) != crc) {
+	    continue;
+	}
+	copy[i].crc = crc;
+	if (best == -1 || copy[i].seq > copy[best].seq) {
+	    best = i;
+	}
+    }
+    if (best == -1) {
+	return -1;
+    }
+
+    fd = newfd;
+    cr = copy[best];
+    for (int i = 0; i < LFS_IMAP_PIECES; i++) {
+	int *piece = &imap[i * LFS_IMAP_PER_BLOCK];
+	if (cr.imap_pieces[i] == -1 || read_addr(cr.imap_pieces[i], piece, LFS_IMAP_PER_BLOCK * sizeof(int)) < 0) {
+	    for (int j = 0; j < LFS_IMAP_PER_BLOCK; j++) {
+		piece[j] = -1;
+	    }
+	}
+    }
+    live_inodes = 0;
+    for (int i = 0; i < LFS_NUM_INODES; i++) {
+	live_inodes += imap[i] != -1;
+    }
+    return 0;
+}
+
+int
+LFS_Lookup(int pinum, char *name)
+{
+    LFS_Inode_t dir;
+    MFS_DirEnt_t entries[LFS_DIRENTS];
+    int slot;
+    if (read_inode(pinum, &dir) < 0 || dir.type != MFS_DIRECTORY) {
+	return -1;
+    }
+    if (find_dirent(&dir, name, entries, &slot) < 0) {
+	return -1;
+    }
+    return entries[slot].inum;
+}
+
+int
+LFS_Stat(int inum, int *type, int *size, int *blocks)
+{
+    LFS_Inode_t inode;
+    if (read_inode(inum, &inode) < 0) {
+	return -1;
+    }
+    *type = inode.type;
+    *size = inode.size;
+    *blocks = inode.blocks;
+    return 0;
+}
+
+int
+LFS_Write(int inum, char *buffer, int block)
+{
+    // room first: making it may run the cleaner, which moves blocks and inodes
+    LFS_Inode_t inode;
+    if (reserve(3) < 0 || read_inode(inum, &inode) < 0 || inode.type != MFS_REGULAR_FILE) {
+	return -1;
+    }
+    if (block < 0 || block > LFS_NUM_PTRS - 1 || buffer == NULL || inode.ptr[block] != -1) {
+	return -1;
+    }
+
+    // data arrives as a string, pad the rest of the block with 0
+    char data[LFS_BLOCK_SIZE];
+    strncpy(data, buffer, LFS_BLOCK_SIZE);
+    inode.ptr[block] = stage(data, LFS_BLOCK_SIZE, inum, block);
+    inode.blocks++;
+    // size runs to the end of the last block, blocks before it never written are holes
+    if (inode.size < (block + 1) * LFS_BLOCK_SIZE) {
+	inode.size = (block + 1) * LFS_BLOCK_SIZE;
+    }
+    stage_inode(inum, &inode);
+    stage_imap_piece(inum / LFS_IMAP_PER_BLOCK);
+    return commit();
+}
+
+int
+LFS_Read(int inum, char *buffer, int block)
+{
+    LFS_Inode_t inode;
+    if (read_inode(inum, &inode) < 0 || block < 0 || block > LFS_NUM_PTRS - 1) {
+	return -1;
+    }
+    if (inode.ptr[block] == -1) {
+	// a hole before the end of a file reads as zeros
+	if (inode.type != MFS_REGULAR_FILE || inode.size < (block + 1) * LFS_BLOCK_SIZE) {
+	    return -1;
+	}
+	memset(buffer, 0, LFS_BLOCK_SIZE);
+	return 0;
+    }
+    return read_addr(inode.ptr[block], buffer, LFS_BLOCK_SIZE);
+}
+
+int
+LFS_Punch(int inum, int block, int count)
+{
+    // count > LFS_NUM_PTRS - block rather than block + count, which can overflow
+    LFS_Inode_t inode;
+    if (block < 0 || count < 1 || count > LFS_NUM_PTRS - block) {
+	return -1;
+    }
+    if (reserve(2) < 0 || read_inode(inum, &inode) < 0 || inode.type != MFS_REGULAR_FILE) {
+	return -1;
+    }
+    // the blocks are now dead, the cleaner takes them back
+    for (int i = block; i < block + count; i++) {
+	if (inode.ptr[i] != -1) {
+	    inode.ptr[i] = -1;
+	    inode.blocks--;
+	}
+    }
+    stage_inode(inum, &inode);
+    stage_imap_piece(inum / LFS_IMAP_PER_BLOCK);
+    return commit();
+}
+
+int
+LFS_Creat(int pinum, int type, char *name)
+{
+    LFS_Inode_t parent;
+    MFS_DirEnt_t entries[LFS_DIRENTS];
+    int slot;
+    if (reserve(6) < 0 || read_inode(pinum, &parent) < 0 || parent.type != MFS_DIRECTORY || name == NULL) {
+	return -1;
+    }
+    if (type != MFS_DIRECTORY && type != MFS_REGULAR_FILE) {
+	return -1;
+    }
+    // creating a name that exists is a success (idempotent)
+    if (find_dirent(&parent, name, entries, &slot) >= 0) {
+	return 0;
+    }
+
+    int newinum = find_free_inum();
+    if (newinum == -1) {
+	return -1;
+    }
+    int index = alloc_dirent(&parent, entries, &slot);
+    if (index == -1) {
+	return -1;
+    }
+    stage_new_inode(newinum, type, MFS_INUM(shard, pinum));
+
+    entries[slot].inum = MFS_INUM(shard, newinum);
+    strncpy(entries[slot].name, name, sizeof(entries[slot].name) - 1);
+    parent.ptr[index] = stage(entries, LFS_BLOCK_SIZE, pinum, index);
+    parent.size += sizeof(MFS_DirEnt_t);
+    stage_inode(pinum, &parent);
+
+    stage_imap_piece(pinum / LFS_IMAP_PER_BLOCK);
+    if (newinum / LFS_IMAP_PER_BLOCK != pinum / LFS_IMAP_PER_BLOCK) {
+	stage_imap_piece(newinum / LFS_IMAP_PER_BLOCK);
+    }
+    return commit();
+}
+
+int
+LFS_Mknod(int type, int parent)
+{
+    if (reserve(3) < 0 || (type != MFS_DIRECTORY && type != MFS_REGULAR_FILE)) {
+	return -1;
+    }
+    int newinum = find_free_inum();
+    if (newinum == -1) {
+	return -1;
+    }
+    stage_new_inode(newinum, type, parent);
+    stage_imap_piece(newinum / LFS_IMAP_PER_BLOCK);
+    if (commit() < 0) {
+	return -1;
+    }
+    return newinum;
+}
+
+int
+LFS_Link(int pinum, int inum, char *name)
+{
+    LFS_Inode_t parent;
+    MFS_DirEnt_t entries[LFS_DIRENTS];
+    int slot;
+    if (reserve(3) < 0 || read_inode(pinum, &parent) < 0 || parent.type != MFS_DIRECTORY || name == NULL) {
+	return -1;
+    }
+    int index = alloc_dirent(&parent, entries, &slot);
+    if (index == -1) {
+	return -1;
+    }
+    entries[slot].inum = inum;
+    strncpy(entries[slot].name, name, sizeof(entries[slot].name) - 1);
+    parent.ptr[index] = stage(entries, LFS_BLOCK_SIZE, pinum, index);
+    parent.size += sizeof(MFS_DirEnt_t);
+    stage_inode(pinum, &parent);
+    stage_imap_piece(pinum / LFS_IMAP_PER_BLOCK);
+    return commit();
+}
+
+int
+LFS_Drop(int inum)
+{
+    LFS_Inode_t inode;
+    if (reserve(1) < 0 || inum < 1 || read_inode(inum, &inode) < 0) {
+	return -1;
+    }
+    if (inode.type == MFS_DIRECTORY && inode.size > (int) (2 * sizeof(MFS_DirEnt_t))) {
+	return -1;
+    }
+    // its blocks are now dead, the cleaner takes them back
+    imap[inum] = -1;
+    live_inodes--;
+    stage_imap_piece(inum / LFS_IMAP_PER_BLOCK);
+    return commit();
+}
+
+int
+LFS_Unlink(int pinum, char *name)
+{
+    LFS_Inode_t parent;
+    LFS_Inode_t child;
+    MFS_DirEnt_t entries[LFS_DIRENTS];
+    int slot;
+    if (reserve(4) < 0 || read_inode(pinum, &parent) < 0 || parent.type != MFS_DIRECTORY) {
+	return -1;
+    }
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+	return -1;
+    }
+    // removing a name that is not there is a success
+    int index = find_dirent(&parent, name, entries, &slot);
+    if (index == -1) {
+	return 0;
+    }
+    // an inode on another shard is dropped there by the client, only the entry goes
+    int inum = entries[slot].inum;
+    int local = MFS_SHARD(inum) == shard;
+    inum = MFS_LOCAL(inum);
+    if (local && read_inode(inum, &child) == 0 && child.type == MFS_DIRECTORY && child.size > (int) (2 * sizeof(MFS_DirEnt_t))) {
+	return -1;
+    }
+
+    entries[slot].inum = -1;
+    memset(entries[slot].name, 0, sizeof(entries[slot].name));
+    parent.ptr[index] = stage(entries, LFS_BLOCK_SIZE, pinum, index);
+    parent.size -= sizeof(MFS_DirEnt_t);
+    stage_inode(pinum, &parent);
+
+    // the child's blocks are now dead, the cleaner takes them back
+    if (local && imap[inum] != -1) {
+	imap[inum] = -1;
+	live_inodes--;
+    }
+    stage_imap_piece(pinum / LFS_IMAP_PER_BLOCK);
+    if (local && inum / LFS_IMAP_PER_BLOCK != pinum / LFS_IMAP_PER_BLOCK) {
+	stage_imap_piece(inum / LFS_IMAP_PER_BLOCK);
+    }
+    return commit();
+}
+
+// is the block at addr, described by summary entry e, still referenced
+static int
+is_live(int addr, LFS_Summary_t *e)
+{
+    if (e->index == SUM_EMPTY) {
+	return 0;
+    }
+    if (e->index == SUM_IMAP) {
+	return e->inum >= 0 && e->inum < LFS_IMAP_PIECES && cr.imap_pieces[e->inum] == addr;
+    }
+    if (e->inum < 0 || e->inum > LFS_NUM_INODES - 1 || imap[e->inum] == -1) {
+	return 0;
+    }
+    if (e->index == SUM_INODE) {
+	return imap[e->inum] == addr;
+    }
+    LFS_Inode_t inode;
+    if (e->index > LFS_NUM_PTRS - 1 || read_inode(e->inum, &inode) < 0) {
+	return 0;
+    }
+    return inode.ptr[e->index] == addr;
+}
+
+// move the live data blocks of inum found in a victim segment, plus its inode
+static int
+clean_inode(int inum, int base, LFS_Summary_t *summary)
+{
+    LFS_Inode_t inode;
+    char data[LFS_BLOCK_SIZE];
+    if (read_inode(inum, &inode) < 0 || reserve(LFS_NUM_PTRS + 2) < 0) {
+	return -1;
+    }
+    for (int i = 1; i < LFS_SEG_BLOCKS; i++) {
+	LFS_Summary_t *e = &summary[i];
+	if (e->inum != inum || e->index < 0 || !is_live(base + i, e)) {
+	    continue;
+	}
+	if (read_addr(base + i, data, LFS_BLOCK_SIZE) < 0) {
+	    return -1;
+	}
+	inode.ptr[e->index] = stage(data, LFS_BLOCK_SIZE, inum, e->index);
+    }
+    stage_inode(inum, &inode);
+    stage_imap_piece(inum / LFS_IMAP_PER_BLOCK);
+    return commit();
+}
+
+// the local inum of the parent named by the ".." entry of directory inum, -1 if on another shard
+static int
+parent_of(int inum)
+{
+    LFS_Inode_t dir;
+    MFS_DirEnt_t entries[LFS_DIRENTS];
+    if (read_inode(inum, &dir) < 0 || dir.ptr[0] == -1 || read_addr(dir.ptr[0], entries, LFS_BLOCK_SIZE) < 0) {
+	return -1;
+    }
+    if (MFS_SHARD(entries[1].inum) != shard) {
+	return -1;
+    }
+    return MFS_LOCAL(entries[1].inum);
+}
+
+int
+LFS_Rename(int srcp, char *srcname, int dstp, char *dstname)
+{
+    LFS_Inode_t sp, dp, child, old;
+    MFS_DirEnt_t sentries[LFS_DIRENTS];
+    MFS_DirEnt_t dentries[LFS_DIRENTS];
+    int sslot, dslot;
+    if (reserve(10) < 0 || read_inode(srcp, &sp) < 0 || sp.type != MFS_DIRECTORY) {
+	return -1;
+    }
+    if (read_inode(dstp, &dp) < 0 || dp.type != MFS_DIRECTORY) {
+	return -1;
+    }
+    if (strcmp(srcname, ".") == 0 || strcmp(srcname, "..") == 0 || strcmp(dstname, ".") == 0 || strcmp(dstname, "..") == 0) {
+	return -1;
+    }
+    if (strlen(dstname) > sizeof(sentries[0].name) - 1) {
+	return -1;
+    }
+    int sindex = find_dirent(&sp, srcname, sentries, &sslot);
+    if (sindex == -1) {
+	return -1;
+    }
+    if (srcp == dstp && strcmp(srcname, dstname) == 0) {
+	return 0;
+    }
+    int inum = sentries[sslot].inum;
+    int local = MFS_SHARD(inum) == shard;
+    int cinum = MFS_LOCAL(inum);
+    if (local && read_inode(cinum, &child) < 0) {
+	return -1;
+    }
+    // a directory on another shard keeps its ".." there, so it is only renamed in place
+    int moved = srcp != dstp;
+    if (!local && moved) {
+	return -1;
+    }
+    int is_dir = !local || child.type == MFS_DIRECTORY;
+    // a directory can't move into itself
+    if (local && is_dir && moved) {
+	for (int cur = dstp, i = 0; cur != -1 && i < LFS_NUM_INODES; i++) {
+	    if (cur == cinum) {
+		return -1;
+	    }
+	    if (cur == 0) {
+		break;
+	    }
+	    cur = parent_of(cur);
+	}
+    }
+
+    int dindex = find_dirent(&dp, dstname, dentries, &dslot);
+    int dropped = -1;
+    if (dindex != -1) {
+	if (dentries[dslot].inum == inum) {
+	    return 0;
+	}
+	// the replaced inode is freed here, so it must live on this shard
+	if (!local || MFS_SHARD(dentries[dslot].inum) != shard) {
+	    return -1;
+	}
+	dropped = MFS_LOCAL(dentries[dslot].inum);
+	if (read_inode(dropped, &old) < 0 || (old.type == MFS_DIRECTORY) != is_dir) {
+	    return -1;
+	}
+	if (old.type == MFS_DIRECTORY && old.size > (int) (2 * sizeof(MFS_DirEnt_t))) {
+	    return -1;
+	}
+    }
+
+    MFS_DirEnt_t own[LFS_DIRENTS];
+    if (local && is_dir && moved && (child.ptr[0] == -1 || read_addr(child.ptr[0], own, LFS_BLOCK_SIZE) < 0)) {
+	return -1;
+    }
+
+    // everything below lands in one commit, so the rename happens entirely or not at all
+    if (!moved) {
+	if (dindex == -1) {
+	    memset(sentries[sslot].name, 0, sizeof(sentries[sslot].name));
+	    strcpy(sentries[sslot].name, dstname);
+	}
+	else {
+	    // both entries may sit in the same block
+	    MFS_DirEnt_t *target = (dindex == sindex) ? sentries : dentries;
+	    target[dslot].inum = inum;
+	    if (dindex != sindex) {
+		sp.ptr[dindex] = stage(dentries, LFS_BLOCK_SIZE, srcp, dindex);
+	    }
+	    sentries[sslot].inum = -1;
+	    memset(sentries[sslot].name, 0, sizeof(sentries[sslot].name));
+	    sp.size -= sizeof(MFS_DirEnt_t);
+	}
+	sp.ptr[sindex] = stage(sentries, LFS_BLOCK_SIZE, srcp, sindex);
+	stage_inode(srcp, &sp);
+    }
+    else {
+	if (dindex == -1) {
+	    dindex = alloc_dirent(&dp, dentries, &dslot);
+	    if (dindex == -1) {
+		return -1;
+	    }
+	    strcpy(dentries[dslot].name, dstname);
+	    dp.size += sizeof(MFS_DirEnt_t);
+	}
+	dentries[dslot].inum = inum;
+	dp.ptr[dindex] = stage(dentries, LFS_BLOCK_SIZE, dstp, dindex);
+	stage_inode(dstp, &dp);
+	sentries[sslot].inum = -1;
+	memset(sentries[sslot].name, 0, sizeof(sentries[sslot].name));
+	sp.ptr[sindex] = stage(sentries, LFS_BLOCK_SIZE, srcp, sindex);
+	sp.size -= sizeof(MFS_DirEnt_t);
+	stage_inode(srcp, &sp);
+	// a moved directory's ".." names its new parent
+	if (is_dir) {
+	    own[1].inum = MFS_INUM(shard, dstp);
+	    child.ptr[0] = stage(own, LFS_BLOCK_SIZE, cinum, 0);
+	    stage_inode(cinum, &child);
+	}
+    }
+    if (dropped != -1) {
+	imap[dropped] = -1;
+	live_inodes--;
+    }
+
+    int pieces[LFS_IMAP_PIECES];
+    memset(pieces, 0, sizeof(pieces));
+    pieces[srcp / LFS_IMAP_PER_BLOCK] = 1;
+    pieces[dstp / LFS_IMAP_PER_BLOCK] = 1;
+    if (local && is_dir && moved) {
+	pieces[cinum / LFS_IMAP_PER_BLOCK] = 1;
+    }
+    if (dropped != -1) {
+	pieces[dropped / LFS_IMAP_PER_BLOCK] = 1;
+    }
+    for (int i = 0; i < LFS_IMAP_PIECES; i++) {
+	if (pieces[i]) {
+	    stage_imap_piece(i);
+	}
+    }
+    return commit();
+}
+
+int
+LFS_StatFS(int *inodes, int *inodes_free, int *blocks, int *blocks_free)
+{
+    // block 0 of every segment is its summary
+    *inodes = LFS_NUM_INODES;
+    *inodes_free = LFS_NUM_INODES - live_inodes;
+    *blocks = LFS_NUM_SEGS * (LFS_SEG_BLOCKS - 1);
+    *blocks_free = (free_segments() * (LFS_SEG_BLOCKS - 1)) + (LFS_SEG_BLOCKS - cr.tail - nstaged);
+    return 0;
+}
+
+int
+LFS_Clean(int force)
+{
+    if (fd == -1 || cleaning) {
+	return 0;
+    }
+
+    // victim is the used segment with the fewest live blocks
+    LFS_Summary_t summary[LFS_SEG_BLOCKS];
+    int victim = -1;
+    int victim_live = LFS_SEG_BLOCKS;
+    for (int seg = 0; seg < LFS_NUM_SEGS; seg++) {
+	if (cr.seg_state[seg] != SEG_USED || seg == cr.cur_seg) {
+	    continue;
+	}
+	if (pread(fd, summary, sizeof(summary), (off_t) seg_start(seg) * LFS_BLOCK_SIZE) != sizeof(summary)) {
+	    continue;
+	}
+	int live = 0;
+	for (int i = 1; i < LFS_SEG_BLOCKS; i++) {
+	    live += is_live(seg_start(seg) + i, &summary[i]);
+	}
+	if (live < victim_live) {
+	    victim = seg;
+	    victim_live = live;
+	}
+    }
+    if (victim == -1) {
+	return 0;
+    }
+    // not worth it unless space is short and most of the segment is dead
+    if (!force && (free_segments() > LFS_NUM_SEGS / 4 || victim_live > (LFS_SEG_BLOCKS * 3) / 4)) {
+	return 0;
+    }
+    // a segment that is nearly all live frees nothing once copied
+    if (victim_live > LFS_SEG_BLOCKS - (2 * LFS_BATCH)) {
+	return 0;
+    }
+
+    cleaning = 1;
+    int base = seg_start(victim);
+    pread(fd, summary, sizeof(summary), (off_t) base * LFS_BLOCK_SIZE);
+    int status = 0;
+    for (int i = 1; i < LFS_SEG_BLOCKS && status == 0; i++) {
+	LFS_Summary_t *e = &summary[i];
+	if (!is_live(base + i, e)) {
+	    continue;
+	}
+	if (e->index == SUM_IMAP) {
+	    if ((status = reserve(1)) == 0) {
+		stage_imap_piece(e->inum);
+		status = commit();
+	    }
+	}
+	else {
+	    // data blocks and the inode of a file move together
+	    status = clean_inode(e->inum, base, summary);
+	}
+    }
+    if (status == 0) {
+	cr.seg_state[victim] = SEG_FREE;
+	status = write_cr();
+    }
+    // the host gets the segment's storage back until it is reused
+    if (status == 0) {
+	fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) base * LFS_BLOCK_SIZE,
+		  (off_t) LFS_SEG_BLOCKS * LFS_BLOCK_SIZE);
+    }
+    cleaning = 0;
+    printf("LFS cleaner: segment %d had %d live blocks%s\n", victim, victim_live, status == 0 ? "" : " (failed)");
+    return status == 0;
+}
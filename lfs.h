@@ -0,0 +1,65 @@
+#ifndef __LFS_h__
+#define __LFS_h__
+
+//
+// Log-structured storage engine
+//
+// Every change (data blocks, inodes, inode map pieces) is appended to the
+// current segment in one sequential write, then a checkpoint region (CR)
+// is rewritten to point at the newest inode map pieces. Two CR copies are
+// kept and the valid one with the highest sequence number wins at load,
+// so an update is atomic: it happened iff its CR write made it to disk.
+//
+
+#define LFS_BLOCK_SIZE (4096)
+#define LFS_NUM_INODES (4096)
+#define LFS_NUM_PTRS (10)
+
+#define LFS_CR_BLOCKS (2)          // blocks 0 and 1 hold the two CR copies
+#define LFS_MAGIC "MFSLFS01"       // first 8 bytes of a CR copy
+#define LFS_SEG_BLOCKS (256)       // 1 MiB segments, block 0 of each is its summary
+#define LFS_NUM_SEGS (16)
+#define LFS_IMAP_PER_BLOCK (1024)
+#define LFS_IMAP_PIECES (LFS_NUM_INODES / LFS_IMAP_PER_BLOCK)
+#define LFS_IMAGE_SIZE ((LFS_CR_BLOCKS + (LFS_SEG_BLOCKS * LFS_NUM_SEGS)) * LFS_BLOCK_SIZE)
+
+//
+// prototypes
+//
+
+// Writes an empty LFS image (root directory only) to fd
+// Returns 0 if success, -1 if failure
+int LFS_Format(int fd);
+
+// Loads the LFS image in fd, if it is one
+// Returns 0 if success, -1 if fd does not hold an LFS image
+int LFS_Load(int fd);
+
+// Sets the shard whose global inums (MFS_INUM) go into directory entries
+void LFS_SetShard(int shard);
+
+// Same contracts as the fs_* calls of the server
+int LFS_Lookup(int pinum, char *name);
+int LFS_Stat(int inum, int *type, int *size, int *blocks);
+int LFS_Write(int inum, char *buffer, int block);
+int LFS_Read(int inum, char *buffer, int block);
+int LFS_Punch(int inum, int block, int count);
+int LFS_Creat(int pinum, int type, char *name);
+int LFS_Unlink(int pinum, char *name);
+int LFS_Mknod(int type, int parent);
+int LFS_Link(int pinum, int inum, char *name);
+int LFS_Drop(int inum);
+int LFS_Rename(int srcp, char *srcname, int dstp, char *dstname);
+
+// Total and free inodes and log blocks; free blocks are those of free segments
+// and the rest of the current one (dead blocks count once the cleaner frees them)
+// Returns 0
+int LFS_StatFS(int *inodes, int *inodes_free, int *blocks, int *blocks_free);
+
+// Runs the segment cleaner once: copies the live blocks of the emptiest
+// segment to the log tail and frees it. Without force, only cleans when
+// free segments are running low and a segment is mostly dead.
+// Returns 1 if a segment was freed, 0 if not
+int LFS_Clean(int force);
+
+#endif // __LFS_h__
@@ -0,0 +1,195 @@
+#include <stdint.h>
+#include <string.h>
+#include "lz.h"
+
+//
+// Each sequence is: token, [extra literal length], literals, offset, [extra match length]
+// token high 4 bits = literal length, low 4 bits = match length - MIN_MATCH
+// a nibble of 15 means more length follows as bytes of 255 ending with one < 255
+// the last sequence has literals only and ends the input
+//
+
+#define MIN_MATCH (4)
+#define HASH_BITS (12)
+#define MAX_OFFSET (65535)
+
+static uint32_t
+read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static int
+hash32(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// write length past the nibble as 255-byte runs, return new op or NULL if out of room
+static unsigned char *
+put_length(unsigned char *op, unsigned char *oend, int len)
+{
+    while (len >= 255) {
+	if (op >= oend) {
+	    return NULL;
+	}
+	*op++ = 255;
+	len -= 255;
+    }
+    if (op >= oend) {
+	return NULL;
+    }
+    *op++ = (unsigned char) len;
+    return op;
+}
+
+// emit one sequence, match == 0 means literals only
+static unsigned char *
+put_sequence(unsigned char *op, unsigned char *oend, const unsigned char *lit, int litlen, int offset, int match)
+{
+    if (op >= oend) {
+	return NULL;
+    }
+    unsigned char *token = op++;
+    int mlen = (match > 0) ? match - MIN_MATCH : 0;
+    *token = (unsigned char) (((litlen < 15) ? litlen : 15) << 4);
+    *token |= (unsigned char) ((mlen < 15) ? mlen : 15);
+
+    if (litlen >= 15 && (op = put_length(op, oend, litlen - 15)) == NULL) {
+	return NULL;
+    }
+    if (oend - op < litlen) {
+	return NULL;
+    }
+    memcpy(op, lit, litlen);
+    op += litlen;
+
+    if (match == 0) {
+	return op;
+    }
+    if (oend - op < 2) {
+	return NULL;
+    }
+    *op++ = offset & 0xff;
+    *op++ = (offset >> 8) & 0xff;
+    if (mlen >= 15 && (op = put_length(op, oend, mlen - 15)) == NULL) {
+	return NULL;
+    }
+    return op;
+}
+
+int
+LZ_Compress(const char *src, int n, char *dst, int cap)
+{
+    const unsigned char *in = (const unsigned char *) src;
+    unsigned char *op = (unsigned char *) dst;
+    unsigned char *oend = op + cap;
+    int table[1 << HASH_BITS];
+    for (int i = 0; i < (1 << HASH_BITS); i++) {
+	table[i] = -1;
+    }
+
+    int ip = 0;
+    int anchor = 0;
+    while (ip + MIN_MATCH <= n) {
+	uint32_t v = read32(in + ip);
+	int h = hash32(v);
+	int ref = table[h];
+	table[h] = ip;
+	if (ref < 0 || ip - ref > MAX_OFFSET || read32(in + ref) != v) {
+	    ip++;
+	    continue;
+	}
+
+	int match = MIN_MATCH;
+	while (ip + match < n && in[ref + match] == in[ip + match]) {
+	    match++;
+	}
+	op = put_sequence(op, oend, in + anchor, ip - anchor, ip - ref, match);
+	if (op == NULL) {
+	    return -1;
+	}
+	ip += match;
+	anchor = ip;
+    }
+
+    op = put_sequence(op, oend, in + anchor, n - anchor, 0, 0);
+    if (op == NULL) {
+	return -1;
+    }
+    return (int) (op - (unsigned char *) dst);
+}
+
+// read length past the nibble, return -1 if input runs out
+static int
+get_length(const unsigned char **ip, const unsigned char *iend)
+{
+    int len = 0;
+    unsigned char b;
+    do {
+	if (*ip >= iend) {
+	    return -1;
+	}
+	b = *(*ip)++;
+	len += b;
+    } while (b == 255);
+    return len;
+}
+
+int
+LZ_Decompress(const char *src, int n, char *dst, int cap)
+{
+    const unsigned char *ip = (const unsigned char *) src;
+    const unsigned char *iend = ip + n;
+    unsigned char *out = (unsigned char *) dst;
+    int op = 0;
+
+    while (ip < iend) {
+	int token = *ip++;
+	int litlen = token >> 4;
+	if (litlen == 15) {
+	    int extra = get_length(&ip, iend);
+	    if (extra < 0) {
+		return -1;
+	    }
+	    litlen += extra;
+	}
+	if (iend - ip < litlen || cap - op < litlen) {
+	    return -1;
+	}
+	memcpy(out + op, ip, litlen);
+	ip += litlen;
+	op += litlen;
+
+	// last sequence carries literals only
+	if (ip == iend) {
+	    break;
+	}
+
+	if (iend - ip < 2) {
+	    return -1;
+	}
+	int offset = ip[0] | (ip[1] << 8);
+	ip += 2;
+	int match = (token & 15);
+	if (match == 15) {
+	    int extra = get_length(&ip, iend);
+	    if (extra < 0) {
+		return -1;
+	    }
+	    match += extra;
+	}
+	match += MIN_MATCH;
+	if (offset == 0 || offset > op || cap - op < match) {
+	    return -1;
+	}
+	// byte at a time, matches may overlap their own output
+	for (int i = 0; i < match; i++) {
+	    out[op + i] = out[op - offset + i];
+	}
+	op += match;
+    }
+    return op;
+}
@@ -0,0 +1,16 @@
+#ifndef __LZ_h__
+#define __LZ_h__
+
+//
+// prototypes
+// 
+
+// Compresses n bytes of src into dst (at most cap bytes), LZ4-style sequences
+// Returns compressed length, -1 if the output does not fit in cap
+int LZ_Compress(const char *src, int n, char *dst, int cap);
+
+// Decompresses n bytes of src into dst (at most cap bytes)
+// Returns decompressed length, -1 if src is malformed or does not fit in cap
+int LZ_Decompress(const char *src, int n, char *dst, int cap);
+
+#endif // __LZ_h__
@@ -1,37 +1,487 @@
+#include <pthread.h>
 #include "udp.h"
+#include "stream.h"
+#include "shm.h"
 #include "mfs.h"
 
-// Global variable for connection information
-int myport;
-int connection;
-struct sockaddr_in addr, addr2;
+// How to reach one server: UDP datagrams, a TCP / Unix-domain stream connection,
+// or a shared-memory ring pair with a server on the same host
+#define TRANSPORT_UDP (0)
+#define TRANSPORT_STREAM (1)
+#define TRANSPORT_SHM (2)
+#define SPEC_SIZE (256)
+typedef struct __Endpoint_t {
+	int open;                // set up for this thread yet
+	int transport;
+	struct sockaddr_in addr; // UDP server address
+	int fd;                  // stream connection
+	Shm_Region_t *shm;       // shared-memory rings and slots
+	int slot;                // next slot to try
+	char busy[SHM_SLOTS];    // slot pushed, its completion not popped yet
+} Endpoint_t;
+
+// One thread's connections to the servers of a context: its own UDP socket on an
+// ephemeral port, stream connections and shared-memory regions, opened on first use
+typedef struct __MFS_Conn_t {
+	MFS_Ctx_t *ctx;
+	int udp;
+	unsigned int next_id;    // tag of the next request
+	unsigned int next_replica;
+	Endpoint_t shard_ep[MFS_MAX_SHARDS];
+	Endpoint_t replica_ep[MFS_MAX_SHARDS][MFS_MAX_REPLICAS];
+	struct __MFS_Conn_t *next;
+} MFS_Conn_t;
+
+// Servers of a file system: one per shard plus read-only replicas, as given to
+// MFS_Ctx_Open / MFS_Ctx_AddReplica. Each thread using it gets its own MFS_Conn_t.
+struct __MFS_Ctx_t {
+	int port;
+	int num_shards;
+	char shard_spec[MFS_MAX_SHARDS][SPEC_SIZE];
+	int num_replicas[MFS_MAX_SHARDS];
+	char replica_spec[MFS_MAX_SHARDS][MFS_MAX_REPLICAS][SPEC_SIZE];
+	int replica_port[MFS_MAX_SHARDS][MFS_MAX_REPLICAS];
+	pthread_key_t key;
+	pthread_mutex_t lock;    // guards replica lists and conns
+	MFS_Conn_t *conns;
+};
+
+// Context behind the calls without one (MFS_Init)
+MFS_Ctx_t *default_ctx = NULL;
+
+
+// Takes a free slot of shared-memory endpoint ep. A slot whose request timed out stays
+// busy until the server completes it, so it is never reused while the server may still
+// write its reply; completions of such requests are drained here when no slot is free.
+// Returns slot, -1 if all are still in flight
+static int shm_take_slot(Endpoint_t *ep) {
+	while (1) {
+		for (int i = 0; i < SHM_SLOTS; i++) {
+			int slot = (ep->slot + i) % SHM_SLOTS;
+			if (ep->busy[slot] == 0) {
+				ep->slot = (slot + 1) % SHM_SLOTS;
+				return slot;
+			}
+		}
+		int done = Shm_Pop(&ep->shm->cq, 0);
+		if ((done < 0) || (done > SHM_SLOTS - 1)) {
+			return -1;
+		}
+		ep->busy[done] = 0;
+	}
+}
+
+
+// Sends message to endpoint ep over conn and reads the reply. The request is tagged
+// "#id " and the server echoes the tag, so a late reply to an earlier request that
+// timed out is told apart and dropped.
+// Returns number of bytes read into reply (tag removed), -1 if failure
+static int transport_call(MFS_Conn_t *conn, Endpoint_t *ep, char *message, char *reply, int replylen) {
+	char tagged[MFS_BLOCK_SIZE * 2 + 32];
+	char received[MFS_BLOCK_SIZE * 2 + 64];
+	unsigned int id = conn->next_id++;
+	int len = snprintf(tagged, sizeof(tagged), "#%u %s", id, message) + 1;
+	int sent = 0;
+	int rc;
+	if (len > (int) sizeof(tagged)) {
+		return -1;
+	}
+	while (1) {
+		char *in = received;
+		if (ep->transport == TRANSPORT_SHM) {
+			// Request goes into a free shared slot, the reply comes back in it and is read there
+			if (sent == 0) {
+				int free = shm_take_slot(ep);
+				if ((free == -1) || (len > SHM_MSG_SIZE)) {
+					return -1;
+				}
+				memcpy(ep->shm->slots[free].msg, tagged, len);
+				ep->shm->slots[free].len = len;
+				ep->busy[free] = 1;
+				if (Shm_Push(&ep->shm->sq, free) == -1) {
+					ep->busy[free] = 0;
+					return -1;
+				}
+			}
+			int done = Shm_Pop(&ep->shm->cq, 5000);
+			if ((done < 0) || (done > SHM_SLOTS - 1)) {
+				return -1;
+			}
+			ep->busy[done] = 0;
+			in = ep->shm->slots[done].reply;
+			rc = ep->shm->slots[done].reply_len;
+			if (rc > SHM_REPLY_SIZE - 1) {
+				return -1;
+			}
+		}
+		else if (ep->transport == TRANSPORT_STREAM) {
+			if (sent == 0) {
+				rc = Stream_Write(ep->fd, tagged, len);
+				if (rc <= 0) {
+					return -1;
+				}
+			}
+			rc = Stream_Read(ep->fd, received, sizeof(received) - 1);
+		}
+		else {
+			if (sent == 0) {
+				rc = UDP_Write(conn->udp, &ep->addr, tagged, len); //write message to server@specified-port
+				printf("CLIENT:: sent message (%d)\n", rc);
+				if (rc <= 0) {
+					return -1;
+				}
+			}
+			struct sockaddr_in from;
+			rc = UDP_Read(conn->udp, &from, received, sizeof(received) - 1); //read message from ...
+		}
+		if (rc <= 0) {
+			return -1;
+		}
+		sent = 1;
+		in[rc] = '\0';
+
+		// Match the tag, a reply to an older request is dropped
+		char *body;
+		if ((in[0] != '#') || ((unsigned int) strtoul(in + 1, &body, 10) != id) || (*body != ' ')) {
+			continue;
+		}
+		body++;
+		rc = strlen(body);
+		if (rc > replylen - 1) {
+			rc = replylen - 1;
+		}
+		memcpy(reply, body, rc);
+		reply[rc] = '\0';
+		return rc;
+	}
+}
+
+
+// Sets up endpoint ep for server spec, one of "unix:/path" (Unix-domain stream),
+// "tcp:host[:port]" (TCP stream), "shm:host[:port]" (shared memory, set up over UDP)
+// or "host[:port]" (UDP); port is the default port
+// Returns 0 if success, -1 if failure
+static int endpoint_open(MFS_Conn_t *conn, Endpoint_t *ep, char *spec, int port) {
+	char host[SPEC_SIZE];
+	strncpy(host, spec, sizeof(host) - 1);
+	host[sizeof(host) - 1] = '\0';
+	if (strncmp(host, "unix:", 5) == 0) {
+		ep->transport = TRANSPORT_STREAM;
+		ep->fd = Stream_ConnectUnix(host + 5);
+		printf("Server: unix socket: %s\n", host + 5);
+		ep->open = (ep->fd > -1);
+		return (ep->fd > -1) ? 0 : -1;
+	}
+	int stream = 0;
+	int shm = 0;
+	char *name = host;
+	if (strncmp(host, "tcp:", 4) == 0) {
+		stream = 1;
+		name = host + 4;
+	}
+	if (strncmp(host, "shm:", 4) == 0) {
+		shm = 1;
+		name = host + 4;
+	}
+	char *colon = strchr(name, ':');
+	if (colon != NULL) {
+		*colon = '\0';
+		port = atoi(colon + 1);
+	}
+	printf("Server: hostname: %s || port: %d || %s\n", name, port, (stream == 1) ? "tcp" : ((shm == 1) ? "shm" : "udp"));
+	if (stream == 1) {
+		ep->transport = TRANSPORT_STREAM;
+		ep->fd = Stream_ConnectTCP(name, port);
+		ep->open = (ep->fd > -1);
+		return (ep->fd > -1) ? 0 : -1;
+	}
+	ep->transport = TRANSPORT_UDP;
+	ep->fd = -1;
+	if (UDP_FillSockAddr(&ep->addr, name, port) != 0) { //contact server at specified port
+		return -1;
+	}
+	ep->open = 1;
+	if (shm == 0) {
+		return 0;
+	}
+
+	// Shared memory: make the region, have the server map it (over UDP), then drop its name
+	static unsigned int regions = 0;
+	char region_name[64];
+	char message[128];
+	char reply[64];
+	sprintf(region_name, "/mfs.%d.%u", (int) getpid(), __atomic_fetch_add(&regions, 1, __ATOMIC_RELAXED));
+	ep->shm = Shm_Create(region_name);
+	if (ep->shm == NULL) {
+		ep->open = 0;
+		return -1;
+	}
+	sprintf(message, "shmattach %s", region_name);
+	int rc = transport_call(conn, ep, message, reply, sizeof(reply));
+	Shm_Unlink(region_name);
+	if ((rc <= 0) || (atoi(reply) != 0)) {
+		Shm_Detach(ep->shm);
+		ep->shm = NULL;
+		ep->open = 0;
+		return -1;
+	}
+	ep->transport = TRANSPORT_SHM;
+	ep->slot = 0;
+	memset(ep->busy, 0, sizeof(ep->busy));
+	return 0;
+}
+
+
+// Closes endpoint ep if this thread opened it
+static void endpoint_close(Endpoint_t *ep) {
+	if (ep->open == 0) {
+		return;
+	}
+	if (ep->transport == TRANSPORT_STREAM) {
+		Stream_Close(ep->fd);
+	}
+	else if (ep->transport == TRANSPORT_SHM) {
+		Shm_Detach(ep->shm);
+	}
+	ep->open = 0;
+}
+
+
+// Closes all connections of conn and frees it
+static void conn_free(MFS_Conn_t *conn) {
+	for (int i = 0; i < MFS_MAX_SHARDS; i++) {
+		endpoint_close(&conn->shard_ep[i]);
+		for (int j = 0; j < MFS_MAX_REPLICAS; j++) {
+			endpoint_close(&conn->replica_ep[i][j]);
+		}
+	}
+	UDP_Close(conn->udp);
+	free(conn);
+}
+
+
+// Thread exit: unhooks the thread's conn from its context and frees it
+static void conn_exit(void *arg) {
+	MFS_Conn_t *conn = (MFS_Conn_t *) arg;
+	MFS_Ctx_t *ctx = conn->ctx;
+	pthread_mutex_lock(&ctx->lock);
+	for (MFS_Conn_t **p = &ctx->conns; *p != NULL; p = &(*p)->next) {
+		if (*p == conn) {
+			*p = conn->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	conn_free(conn);
+}
+
+
+// Returns the calling thread's conn for ctx, made on first use, NULL if failure
+static MFS_Conn_t *conn_get(MFS_Ctx_t *ctx) {
+	if (ctx == NULL) {
+		return NULL;
+	}
+	MFS_Conn_t *conn = pthread_getspecific(ctx->key);
+	if (conn != NULL) {
+		return conn;
+	}
+	conn = calloc(1, sizeof(MFS_Conn_t));
+	if (conn == NULL) {
+		return NULL;
+	}
+	conn->ctx = ctx;
+	conn->udp = UDP_Open(0);
+	if (conn->udp < 0) {
+		free(conn);
+		return NULL;
+	}
+	pthread_mutex_lock(&ctx->lock);
+	conn->next = ctx->conns;
+	ctx->conns = conn;
+	pthread_mutex_unlock(&ctx->lock);
+	pthread_setspecific(ctx->key, conn);
+	return conn;
+}
+
+
+// Opens a context for the servers in hostname (see MFS_Init). Calls on a context are
+// safe from any number of threads: each thread talks over its own sockets.
+// Returns the context, NULL if failure
+MFS_Ctx_t *MFS_Ctx_Open(char *hostname, int port) {
+	MFS_Ctx_t *ctx = calloc(1, sizeof(MFS_Ctx_t));
+	if (ctx == NULL) {
+		return NULL;
+	}
+	ctx->port = port;
+	pthread_mutex_init(&ctx->lock, NULL);
+	if (pthread_key_create(&ctx->key, conn_exit) != 0) {
+		free(ctx);
+		return NULL;
+	}
+	char list[4096];
+	char *save;
+	strncpy(list, hostname, sizeof(list) - 1);
+	list[sizeof(list) - 1] = '\0';
+	for (char *host = strtok_r(list, ",", &save); host != NULL; host = strtok_r(NULL, ",", &save)) {
+		if ((ctx->num_shards == MFS_MAX_SHARDS) || (strlen(host) > SPEC_SIZE - 1)) {
+			MFS_Ctx_Close(ctx);
+			return NULL;
+		}
+		strcpy(ctx->shard_spec[ctx->num_shards], host);
+		ctx->num_shards++;
+	}
+
+	// Reach every shard from this thread once to report bad servers now
+	MFS_Conn_t *conn = conn_get(ctx);
+	for (int i = 0; (conn != NULL) && (i < ctx->num_shards); i++) {
+		if (endpoint_open(conn, &conn->shard_ep[i], ctx->shard_spec[i], port) != 0) {
+			conn = NULL;
+		}
+	}
+	if ((conn == NULL) || (ctx->num_shards == 0)) {
+		MFS_Ctx_Close(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+
+// Closes ctx and every thread's connections to its servers; no thread may still be using it
+void MFS_Ctx_Close(MFS_Ctx_t *ctx) {
+	if (ctx == NULL) {
+		return;
+	}
+	pthread_setspecific(ctx->key, NULL);
+	pthread_key_delete(ctx->key);
+	while (ctx->conns != NULL) {
+		MFS_Conn_t *conn = ctx->conns;
+		ctx->conns = conn->next;
+		conn_free(conn);
+	}
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx);
+}
+
+
+// Returns endpoint of the server owning inum's shard (shard 0 for invalid inums), NULL if it can't be reached
+static Endpoint_t *route(MFS_Conn_t *conn, int inum) {
+	MFS_Ctx_t *ctx = conn->ctx;
+	int shard = MFS_SHARD(inum);
+	if ((inum < 0) || (shard >= ctx->num_shards)) {
+		shard = 0;
+	}
+	Endpoint_t *ep = &conn->shard_ep[shard];
+	if ((ep->open == 0) && (endpoint_open(conn, ep, ctx->shard_spec[shard], ctx->port) != 0)) {
+		return NULL;
+	}
+	return ep;
+}
+
+
+// Returns endpoint to send a read of inum to: a replica of its shard if there is one
+static Endpoint_t *route_read(MFS_Conn_t *conn, int inum) {
+	MFS_Ctx_t *ctx = conn->ctx;
+	int shard = MFS_SHARD(inum);
+	if ((inum < 0) || (shard >= ctx->num_shards)) {
+		return route(conn, inum);
+	}
+	pthread_mutex_lock(&ctx->lock);
+	int count = ctx->num_replicas[shard];
+	pthread_mutex_unlock(&ctx->lock);
+	if (count == 0) {
+		return route(conn, inum);
+	}
+	int r = conn->next_replica++ % count;
+	Endpoint_t *ep = &conn->replica_ep[shard][r];
+	if ((ep->open == 0) && (endpoint_open(conn, ep, ctx->replica_spec[shard][r], ctx->replica_port[shard][r]) != 0)) {
+		return route(conn, inum);
+	}
+	return ep;
+}
+
+
+// Sends message to endpoint ep (NULL if unreachable) over conn
+// Returns number of bytes read into reply, -1 if failure
+static int call(MFS_Conn_t *conn, Endpoint_t *ep, char *message, char *reply, int replylen) {
+	if (ep == NULL) {
+		return -1;
+	}
+	return transport_call(conn, ep, message, reply, replylen);
+}
+
+
+// Sends read-only message about inum to a replica of its shard, or to the primary
+// if there is none or the replica is too far behind (it replies -2)
+// Returns number of bytes read into reply, -1 if failure
+static int read_call(MFS_Conn_t *conn, int inum, char *message, char *reply, int replylen) {
+	Endpoint_t *server = route_read(conn, inum);
+	int rc = call(conn, server, message, reply, replylen);
+	if ((rc > 0) && (atoi(reply) == -2) && (server != route(conn, inum))) {
+		rc = call(conn, route(conn, inum), message, reply, replylen);
+	}
+	return rc;
+}
+
+
+// Picks the shard for new directory name in pinum: FNV-1a hash of (pinum, name)
+// so placement is deterministic and spreads the tree over all shards
+static int place(MFS_Ctx_t *ctx, int pinum, char *name) {
+	unsigned int hash = 2166136261u;
+	for (int i = 0; i < (int) sizeof(int); i++) {
+		hash = (hash ^ ((pinum >> (i * 8)) & 0xff)) * 16777619u;
+	}
+	for (char *c = name; *c != '\0'; c++) {
+		hash = (hash ^ (unsigned char) *c) * 16777619u;
+	}
+	return hash % ctx->num_shards;
+}
+
+
+// Sends message to the server owning inum's shard
+// Returns integer reply, -1 if failure
+static int shard_call(MFS_Conn_t *conn, int inum, char *message) {
+	char reply[4096];
+	int connection = call(conn, route(conn, inum), message, reply, 4096);
+    if (connection > 0) {
+		printf("CLIENT:: read %d bytes (message: '%s')\n", connection, reply);
+		return atoi(reply);
+    }
+	return -1;
+}
 
 
 // Takes hostname/port and finds server exporting file system. 
+// hostname may be a comma separated list of servers, one per shard, each
+// "host[:port]" (UDP), "tcp:host[:port]", "unix:/path" or "shm:host[:port]"
+// The calls without a context use the one made here.
 // Return 0 if success, -1 if failure
 int MFS_Init(char *hostname, int port) {
-	myport = UDP_Open(9009);
-	assert(myport > -1);
-	connection = UDP_FillSockAddr(&addr, hostname, port); //contact server at specified port
-	printf("Hostname: %s || port: %d\n", hostname, port);
-    assert(connection == 0);
+	MFS_Ctx_t *ctx = MFS_Ctx_Open(hostname, port);
+	if (ctx == NULL) {
+		return -1;
+	}
+	MFS_Ctx_Close(default_ctx);
+	default_ctx = ctx;
 	return 0;
 }
 
 
 // Looks at inode at pinum for entry name, 
 // Returns inode number of entry or -1 if not found
-int MFS_Lookup(int pinum, char *name) {
+int MFS_Ctx_Lookup(MFS_Ctx_t *ctx, int pinum, char *name) {
+	MFS_Conn_t *conn = conn_get(ctx);
+	if (conn == NULL) {
+		return -1;
+	}
+	int connection;
 	// lookup pinum name
 	char message[4096];
 	char reply[4096];
 
 	printf("LOOKUP\n");
 	sprintf(message, "lookup %d %s", pinum, name);
-    connection = UDP_Write(myport, &addr, message, 4096); //write message to server@specified-port
-    printf("CLIENT:: sent message (%d)\n", connection);
+    connection = read_call(conn, pinum, message, reply, 4096);
     if (connection > 0) {
-		connection = UDP_Read(myport, &addr2, reply, 4096); //read message from ...
 		printf("CLIENT:: read %d bytes (message: '%s')\n", connection, reply);
 		int replyint = atoi(reply);
 		return replyint;
@@ -42,27 +492,31 @@ int MFS_Lookup(int pinum, char *name) {
 
 // Returns MFS_Stat_t linked to by inum. 
 // Returns 0 if success, -1 if failure (inum does not exist).
-int MFS_Stat(int inum, MFS_Stat_t *m) {
+int MFS_Ctx_Stat(MFS_Ctx_t *ctx, int inum, MFS_Stat_t *m) {
+	MFS_Conn_t *conn = conn_get(ctx);
+	if (conn == NULL) {
+		return -1;
+	}
+	int connection;
 	// stat inum
 	// RETURNS BUFFER
 	char message[4096];
 	char reply[4096];
+	char *save;
 	printf("STAT\n");
 	sprintf(message, "stat %d", inum);
-    connection = UDP_Write(myport, &addr, message, 4096); //write message to server@specified-port
-    printf("CLIENT:: sent message (%d)\n", connection);
+    connection = read_call(conn, inum, message, reply, 4096);
     if (connection > 0) {
-		connection = UDP_Read(myport, &addr2, reply, 4096); //read message from ...
 		printf("CLIENT:: read %d bytes (message: '%s')\n", connection, reply);
-		char *chunk1 = strtok(reply, " ");
+		char *chunk1 = strtok_r(reply, " ", &save);
 		printf("chunk1: %s\n", chunk1);
 		int replyint = atoi(chunk1);
 		if (replyint > -1) {
-			char *chunk2 = strtok(NULL, " ");
+			char *chunk2 = strtok_r(NULL, " ", &save);
 			printf("chunk2: %s\n", chunk2);
-			char *chunk3 = strtok(NULL, " ");
+			char *chunk3 = strtok_r(NULL, " ", &save);
 			printf("chunk3: %s\n", chunk3);
-			char *chunk4 = strtok(NULL, " ");
+			char *chunk4 = strtok_r(NULL, " ", &save);
 			printf("chunk4: %s\n", chunk4);
 	 		int replyint = atoi(chunk1);
 			m->type = atoi(chunk2);
@@ -77,17 +531,20 @@ int MFS_Stat(int inum, MFS_Stat_t *m) {
 
 // Writes block of 4096 bytes at block# block in inode inum. 
 // Returns 0 if success, -1 if failure (invalid inum, invalid block, directory inum)
-int MFS_Write(int inum, char *buffer, int block) {
+int MFS_Ctx_Write(MFS_Ctx_t *ctx, int inum, char *buffer, int block) {
+	MFS_Conn_t *conn = conn_get(ctx);
+	if (conn == NULL) {
+		return -1;
+	}
+	int connection;
 	// write inum block [data]
 	char message[4096 * 2];
 	char reply[4096];
 	printf("WRITE\n");
 	sprintf(message, "write %d %d %s", inum, block, buffer);
 	printf("SENDING...\n");
-    connection = UDP_Write(myport, &addr, message, 4096 * 2); //write message to server@specified-port
-    printf("CLIENT:: sent message (%d)\n", connection);
+    connection = call(conn, route(conn, inum), message, reply, 4096);
     if (connection > 0) {
-		connection = UDP_Read(myport, &addr2, reply, 4096); //read message from ...
 		printf("CLIENT:: read %d bytes (message: '%s')\n", connection, reply);
 		int replyint = atoi(reply);
 		return replyint;
@@ -96,26 +553,60 @@ int MFS_Write(int inum, char *buffer, int block) {
 }
 
 
+// Deallocates count blocks of file inum from block# block on; they read back as zeros
+// and the file keeps its size. Blocks never written before the end of a file are holes too.
+// Returns 0 if success, -1 if failure (invalid inum, directory inum, invalid range)
+int MFS_Ctx_Punch(MFS_Ctx_t *ctx, int inum, int block, int count) {
+	MFS_Conn_t *conn = conn_get(ctx);
+	if (conn == NULL) {
+		return -1;
+	}
+	int connection;
+	// punch inum block count
+	char message[4096];
+	char reply[4096];
+	printf("PUNCH\n");
+	sprintf(message, "punch %d %d %d", inum, block, count);
+	connection = call(conn, route(conn, inum), message, reply, 4096);
+	if (connection > 0) {
+		printf("CLIENT:: read %d bytes (message: '%s')\n", connection, reply);
+		int replyint = atoi(reply);
+		return replyint;
+	}
+	return -1;
+}
+
+
 // Reads block# block into buffer at inode inum. 
 // Returns 0 if success, -1 if failure (invalid inum, invalid block)
-int MFS_Read(int inum, char *buffer, int block) {
+int MFS_Ctx_Read(MFS_Ctx_t *ctx, int inum, char *buffer, int block) {
+	MFS_Conn_t *conn = conn_get(ctx);
+	if (conn == NULL) {
+		return -1;
+	}
+	int connection;
 	// read inum block
 	// RETURNS BUFFER
 	char message[4096];
 	char reply[4096 * 2];
+	char *save;
 	printf("READ\n");
 	sprintf(message, "read %d %d", inum, block);
-    connection = UDP_Write(myport, &addr, message, 4096); //write message to server@specified-port
-    printf("CLIENT:: sent message (%d)\n", connection);
+    connection = read_call(conn, inum, message, reply, 4096 * 2);
     if (connection > 0) {
-		connection = UDP_Read(myport, &addr2, reply, 4096 * 2); //read message from ...
 		printf("CLIENT:: read %d bytes (message: '%s')\n", connection, reply);
-		char *chunk1 = strtok(reply, " ");
+		char *chunk1 = strtok_r(reply, " ", &save);
 		int replyint = atoi(chunk1);
-		if (replyint != -1) {
-			char *chunk2 = strtok(NULL, " ");
+		if (replyint > -1) {
+			char *chunk2 = strtok_r(NULL, " ", &save);
 			printf("chunk2: %s\n", chunk2);
-			memcpy(buffer, chunk2, MFS_BLOCK_SIZE);
+			// An all-zero block (a hole) comes back as an empty string
+			if (chunk2 == NULL) {
+				memset(buffer, 0, MFS_BLOCK_SIZE);
+			}
+			else {
+				memcpy(buffer, chunk2, MFS_BLOCK_SIZE);
+			}
 		}
 		return replyint;
     }
@@ -125,16 +616,42 @@ int MFS_Read(int inum, char *buffer, int block) {
 
 // Creates new file/directory in inode pinum with name name. 
 // Returns 0 if success, -1 if failure (pinum does not exist)
-int MFS_Creat(int pinum, int type, char *name) {
+// Directories are placed on the shard picked by place(); one placed on another
+// shard than pinum is made there with mknod and named in pinum with link.
+int MFS_Ctx_Creat(MFS_Ctx_t *ctx, int pinum, int type, char *name) {
+	MFS_Conn_t *conn = conn_get(ctx);
+	if (conn == NULL) {
+		return -1;
+	}
+	int connection;
 	// creat pinum type [name]
 	char message[4096];
 	char reply[4096];
 	printf("CREAT\n");
+	if ((type == MFS_DIRECTORY) && (ctx->num_shards > 1) && (pinum >= 0)) {
+		int shard = place(ctx, pinum, name);
+		if (shard != MFS_SHARD(pinum)) {
+			// Creating a name that exists is a success
+			if (MFS_Ctx_Lookup(ctx, pinum, name) >= 0) {
+				return 0;
+			}
+			sprintf(message, "mknod %d %d", type, pinum);
+			int inum = shard_call(conn, MFS_INUM(shard, 0), message);
+			if (inum < 0) {
+				return -1;
+			}
+			sprintf(message, "link %d %d %s", pinum, inum, name);
+			if (shard_call(conn, pinum, message) == 0) {
+				return 0;
+			}
+			sprintf(message, "drop %d", inum);
+			shard_call(conn, inum, message);
+			return -1;
+		}
+	}
 	sprintf(message, "creat %d %d %s", pinum, type, name);
-    connection = UDP_Write(myport, &addr, message, 4096); //write message to server@specified-port
-    printf("CLIENT:: sent message (%d)\n", connection);
+    connection = call(conn, route(conn, pinum), message, reply, 4096);
     if (connection > 0) {
-		connection = UDP_Read(myport, &addr2, reply, 4096); //read message from ...
 		printf("CLIENT:: read %d bytes (message: '%s')\n", connection, reply);
 		int replyint = atoi(reply);
 		return replyint;
@@ -145,16 +662,124 @@ int MFS_Creat(int pinum, int type, char *name) {
 
 // Removes file/directory name from directory at pinum. 
 // Returns 0 if success, -1 if failure (invalid pinum, pinum is not directory, removed directory is not empty)
-int MFS_Unlink(int pinum, char *name) {
+// An entry naming an inode on another shard is removed first, then the inode is dropped there.
+// The two steps are not atomic: if the client dies between them, or the drop gets no answer,
+// the inode is left unnamed on its shard, where mfs-fsck can't tell it from a live directory.
+int MFS_Ctx_Unlink(MFS_Ctx_t *ctx, int pinum, char *name) {
+	MFS_Conn_t *conn = conn_get(ctx);
+	if (conn == NULL) {
+		return -1;
+	}
+	int connection;
 	// unlink pinum [name]
 	char message[4096];
 	char reply[4096];
 	printf("UNLINK\n");
+	int inum = -1;
+	if ((ctx->num_shards > 1) && (strcmp(name, ".") != 0) && (strcmp(name, "..") != 0)) {
+		inum = MFS_Ctx_Lookup(ctx, pinum, name);
+		if ((inum >= 0) && (MFS_SHARD(inum) != MFS_SHARD(pinum))) {
+			MFS_Stat_t m;
+			if ((MFS_Ctx_Stat(ctx, inum, &m) == 0) && (m.type == MFS_DIRECTORY) && (m.size > 2 * (int) sizeof(MFS_DirEnt_t))) {
+				return -1;
+			}
+		}
+		else {
+			inum = -1;
+		}
+	}
 	sprintf(message, "unlink %d %s", pinum, name);
-    connection = UDP_Write(myport, &addr, message, 4096); //write message to server@specified-port
-    printf("CLIENT:: sent message (%d)\n", connection);
+    connection = call(conn, route(conn, pinum), message, reply, 4096);
+    if (connection > 0) {
+		printf("CLIENT:: read %d bytes (message: '%s')\n", connection, reply);
+		int replyint = atoi(reply);
+		if ((replyint == 0) && (inum >= 0)) {
+			// A directory that gained entries since the check is refused: put the entry
+			// back so the unlink fails as a whole. Without an answer the drop may have
+			// happened, so the entry stays removed
+			sprintf(message, "drop %d", inum);
+			connection = call(conn, route(conn, inum), message, reply, 4096);
+			if ((connection > 0) && (atoi(reply) != 0)) {
+				sprintf(message, "link %d %d %s", pinum, inum, name);
+				shard_call(conn, pinum, message);
+			}
+			replyint = ((connection > 0) && (atoi(reply) == 0)) ? 0 : -1;
+		}
+		return replyint;
+    }
+	return -1;
+}
+
+// Moves entry srcname in directory srcpinum to dstname in directory dstpinum as one
+// metadata change on the server: no data is copied, and an entry named dstname is replaced.
+// Returns 0 if success, -1 if failure (no such entry, the directories are on different
+// shards, dstname names a non-empty directory or one of another type)
+int MFS_Ctx_Rename(MFS_Ctx_t *ctx, int srcpinum, char *srcname, int dstpinum, char *dstname) {
+	MFS_Conn_t *conn = conn_get(ctx);
+	if (conn == NULL) {
+		return -1;
+	}
+	int connection;
+	// rename srcpinum dstpinum [srcname] [dstname]
+	char message[4096];
+	char reply[4096];
+	printf("RENAME\n");
+	if (MFS_SHARD(srcpinum) != MFS_SHARD(dstpinum)) {
+		return -1;
+	}
+	if ((strchr(srcname, ' ') != NULL) || (strchr(dstname, ' ') != NULL)) {
+		return -1;
+	}
+	snprintf(message, sizeof(message), "rename %d %d %s %s", srcpinum, dstpinum, srcname, dstname);
+	connection = call(conn, route(conn, srcpinum), message, reply, 4096);
+	if (connection > 0) {
+		printf("CLIENT:: read %d bytes (message: '%s')\n", connection, reply);
+		int replyint = atoi(reply);
+		return replyint;
+	}
+	return -1;
+}
+
+
+// Takes a read-only point-in-time snapshot of the file system. 
+// Returns inum of the snapshot's root directory, -1 if failure (no free snapshot, or
+// the file system is sharded: a snapshot covers one server's image only)
+int MFS_Ctx_Snapshot(MFS_Ctx_t *ctx) {
+	MFS_Conn_t *conn = conn_get(ctx);
+	if ((conn == NULL) || (ctx->num_shards > 1)) {
+		return -1;
+	}
+	int connection;
+	// snapshot
+	char message[4096];
+	char reply[4096];
+	printf("SNAPSHOT\n");
+	sprintf(message, "snapshot");
+    connection = call(conn, route(conn, 0), message, reply, 4096);
+    if (connection > 0) {
+		printf("CLIENT:: read %d bytes (message: '%s')\n", connection, reply);
+		int replyint = atoi(reply);
+		return replyint;
+    }
+	return -1;
+}
+
+
+// Deletes the snapshot whose root directory is inum. 
+// Returns 0 if success, -1 if failure (inum is not a snapshot root)
+int MFS_Ctx_SnapshotDelete(MFS_Ctx_t *ctx, int inum) {
+	MFS_Conn_t *conn = conn_get(ctx);
+	if (conn == NULL) {
+		return -1;
+	}
+	int connection;
+	// snapdel inum
+	char message[4096];
+	char reply[4096];
+	printf("SNAPDEL\n");
+	sprintf(message, "snapdel %d", inum);
+    connection = call(conn, route(conn, inum), message, reply, 4096);
     if (connection > 0) {
-		connection = UDP_Read(myport, &addr2, reply, 4096); //read message from ...
 		printf("CLIENT:: read %d bytes (message: '%s')\n", connection, reply);
 		int replyint = atoi(reply);
 		return replyint;
@@ -162,3 +787,136 @@ int MFS_Unlink(int pinum, char *name) {
 	return -1;
 }
 
+
+// Returns MFS_StatFS_t of the file system (shard) holding inum: total and free
+// inodes and blocks. Served from counters, so it is cheap to poll.
+// Returns 0 if success, -1 if failure
+int MFS_Ctx_StatFS(MFS_Ctx_t *ctx, int inum, MFS_StatFS_t *m) {
+	MFS_Conn_t *conn = conn_get(ctx);
+	if (conn == NULL) {
+		return -1;
+	}
+	int connection;
+	// statfs inum
+	// RETURNS BUFFER
+	char message[4096];
+	char reply[4096];
+	printf("STATFS\n");
+	sprintf(message, "statfs %d", inum);
+	connection = read_call(conn, inum, message, reply, 4096);
+	if (connection > 0) {
+		printf("CLIENT:: read %d bytes (message: '%s')\n", connection, reply);
+		int replyint = -1;
+		MFS_StatFS_t fs;
+		if ((sscanf(reply, "%d %d %d %d %d", &replyint, &fs.inodes, &fs.inodes_free, &fs.blocks, &fs.blocks_free) == 5) && (replyint == 0)) {
+			*m = fs;
+		}
+		return replyint;
+	}
+	return -1;
+}
+
+
+// Copies the request scheduler's statistics of the server holding inum into buffer
+// (n bytes, 0-terminated): queue depth, requests served and average / max wait per
+// class, then depth and requests served per busy client. Needs a server run with -W.
+// Returns 0 if success, -1 if failure
+int MFS_Ctx_SchedStats(MFS_Ctx_t *ctx, int inum, char *buffer, int n) {
+	MFS_Conn_t *conn = conn_get(ctx);
+	if ((conn == NULL) || (n < 1)) {
+		return -1;
+	}
+	int connection;
+	// schedstats
+	// RETURNS BUFFER
+	char reply[4096];
+	printf("SCHEDSTATS\n");
+	connection = call(conn, route(conn, inum), "schedstats", reply, 4096);
+	if (connection > 0) {
+		printf("CLIENT:: read %d bytes (message: '%s')\n", connection, reply);
+		int replyint = atoi(reply);
+		char *text = strchr(reply, ' ');
+		if ((replyint == 0) && (text != NULL)) {
+			strncpy(buffer, text + 1, n - 1);
+			buffer[n - 1] = '\0';
+		}
+		return replyint;
+	}
+	return -1;
+}
+
+
+// Adds a read-only replica of shard at hostname/port (same forms as MFS_Init); lookup,
+// stat and read then go to the shard's replicas in turn, falling back to its primary
+// Returns 0 if success, -1 if failure
+int MFS_Ctx_AddReplica(MFS_Ctx_t *ctx, int shard, char *hostname, int port) {
+	if ((ctx == NULL) || (shard < 0) || (shard >= MFS_MAX_SHARDS) || (strlen(hostname) > SPEC_SIZE - 1)) {
+		return -1;
+	}
+	pthread_mutex_lock(&ctx->lock);
+	int r = ctx->num_replicas[shard];
+	if (r == MFS_MAX_REPLICAS) {
+		pthread_mutex_unlock(&ctx->lock);
+		return -1;
+	}
+	printf("Replica of shard %d: %s || port: %d\n", shard, hostname, port);
+	strcpy(ctx->replica_spec[shard][r], hostname);
+	ctx->replica_port[shard][r] = port;
+	ctx->num_replicas[shard]++;
+	pthread_mutex_unlock(&ctx->lock);
+	return 0;
+}
+
+
+// Calls on the context made by MFS_Init
+int MFS_Lookup(int pinum, char *name) {
+	return MFS_Ctx_Lookup(default_ctx, pinum, name);
+}
+
+int MFS_Stat(int inum, MFS_Stat_t *m) {
+	return MFS_Ctx_Stat(default_ctx, inum, m);
+}
+
+int MFS_Write(int inum, char *buffer, int block) {
+	return MFS_Ctx_Write(default_ctx, inum, buffer, block);
+}
+
+int MFS_Read(int inum, char *buffer, int block) {
+	return MFS_Ctx_Read(default_ctx, inum, buffer, block);
+}
+
+int MFS_Creat(int pinum, int type, char *name) {
+	return MFS_Ctx_Creat(default_ctx, pinum, type, name);
+}
+
+int MFS_Unlink(int pinum, char *name) {
+	return MFS_Ctx_Unlink(default_ctx, pinum, name);
+}
+
+int MFS_Punch(int inum, int block, int count) {
+	return MFS_Ctx_Punch(default_ctx, inum, block, count);
+}
+
+int MFS_Rename(int srcpinum, char *srcname, int dstpinum, char *dstname) {
+	return MFS_Ctx_Rename(default_ctx, srcpinum, srcname, dstpinum, dstname);
+}
+
+int MFS_Snapshot() {
+	return MFS_Ctx_Snapshot(default_ctx);
+}
+
+int MFS_SnapshotDelete(int inum) {
+	return MFS_Ctx_SnapshotDelete(default_ctx, inum);
+}
+
+int MFS_StatFS(int inum, MFS_StatFS_t *m) {
+	return MFS_Ctx_StatFS(default_ctx, inum, m);
+}
+
+int MFS_SchedStats(int inum, char *buffer, int n) {
+	return MFS_Ctx_SchedStats(default_ctx, inum, buffer, n);
+}
+
+int MFS_AddReplica(int shard, char *hostname, int port) {
+	return MFS_Ctx_AddReplica(default_ctx, shard, hostname, port);
+}
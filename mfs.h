@@ -6,6 +6,16 @@
 
 #define MFS_BLOCK_SIZE   (4096)
 
+// Inode numbers carry the shard that owns the inode in their high bits, so a
+// directory entry on one shard can name an inode on another. Shard 0 inums
+// are plain local inode numbers.
+#define MFS_SHARD_SHIFT  (16)
+#define MFS_MAX_SHARDS   (64)
+#define MFS_MAX_REPLICAS (8)
+#define MFS_INUM(shard, local) (((shard) << MFS_SHARD_SHIFT) | (local))
+#define MFS_SHARD(inum)  ((inum) >> MFS_SHARD_SHIFT)
+#define MFS_LOCAL(inum)  ((inum) & ((1 << MFS_SHARD_SHIFT) - 1))
+
 
 typedef struct __MFS_Stat_t {
     int type;   // MFS_DIRECTORY or MFS_REGULAR
@@ -14,18 +24,58 @@ typedef struct __MFS_Stat_t {
     // note: no permissions, access times, etc.
 } MFS_Stat_t;
 
+typedef struct __MFS_StatFS_t {
+    int inodes;      // total inodes
+    int inodes_free;
+    int blocks;      // total data blocks
+    int blocks_free;
+} MFS_StatFS_t;
+
 typedef struct __MFS_DirEnt_t {
     int  inum;      // inode number of entry (-1 means entry not used)
     char name[252]; // up to 252 bytes of name in directory (including \0)
 } MFS_DirEnt_t;
 
 
+// Calls without a context go to the servers given to MFS_Init and must not
+// be made from several threads at once.
+// hostname may list one server per shard: "host1:port1,host2:port2,..."
+// (entries without a port use port); shard i is served by entry i
 int MFS_Init(char *hostname, int port);
 int MFS_Lookup(int pinum, char *name);
 int MFS_Stat(int inum, MFS_Stat_t *m);
 int MFS_Write(int inum, char *buffer, int block);
 int MFS_Read(int inum, char *buffer, int block);
+int MFS_Punch(int inum, int block, int count);
 int MFS_Creat(int pinum, int type, char *name);
 int MFS_Unlink(int pinum, char *name);
+int MFS_Rename(int srcpinum, char *srcname, int dstpinum, char *dstname);
+int MFS_Snapshot();
+int MFS_SnapshotDelete(int inum);
+int MFS_StatFS(int inum, MFS_StatFS_t *m);
+int MFS_SchedStats(int inum, char *buffer, int n);
+int MFS_AddReplica(int shard, char *hostname, int port);
+
+// A context holds a set of servers; its calls are safe from any number of
+// threads. Each thread gets its own socket on an ephemeral port (and its own
+// stream / shared-memory connections), and replies are matched to requests
+// by a tag, so concurrent calls never see each other's replies.
+typedef struct __MFS_Ctx_t MFS_Ctx_t;
+
+MFS_Ctx_t *MFS_Ctx_Open(char *hostname, int port);
+void MFS_Ctx_Close(MFS_Ctx_t *ctx);
+int MFS_Ctx_Lookup(MFS_Ctx_t *ctx, int pinum, char *name);
+int MFS_Ctx_Stat(MFS_Ctx_t *ctx, int inum, MFS_Stat_t *m);
+int MFS_Ctx_Write(MFS_Ctx_t *ctx, int inum, char *buffer, int block);
+int MFS_Ctx_Read(MFS_Ctx_t *ctx, int inum, char *buffer, int block);
+int MFS_Ctx_Punch(MFS_Ctx_t *ctx, int inum, int block, int count);
+int MFS_Ctx_Creat(MFS_Ctx_t *ctx, int pinum, int type, char *name);
+int MFS_Ctx_Unlink(MFS_Ctx_t *ctx, int pinum, char *name);
+int MFS_Ctx_Rename(MFS_Ctx_t *ctx, int srcpinum, char *srcname, int dstpinum, char *dstname);
+int MFS_Ctx_Snapshot(MFS_Ctx_t *ctx);
+int MFS_Ctx_SnapshotDelete(MFS_Ctx_t *ctx, int inum);
+int MFS_Ctx_StatFS(MFS_Ctx_t *ctx, int inum, MFS_StatFS_t *m);
+int MFS_Ctx_SchedStats(MFS_Ctx_t *ctx, int inum, char *buffer, int n);
+int MFS_Ctx_AddReplica(MFS_Ctx_t *ctx, int shard, char *hostname, int port);
 
 #endif // __MFS_h__
@@ -0,0 +1,117 @@
+#include <stdint.h>
+#include <string.h>
+#include "popcount.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+static size_t (*count_fn)(const unsigned char *, size_t) = NULL;
+
+// portable fallback, 8 bytes per step
+static size_t
+popcount_sw(const unsigned char *p, size_t n)
+{
+    size_t count = 0;
+    while (n >= 8) {
+	uint64_t x;
+	memcpy(&x, p, 8);
+	x = x - ((x >> 1) & 0x5555555555555555ull);
+	x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+	count += (x * 0x0101010101010101ull) >> 56;
+	p += 8;
+	n -= 8;
+    }
+    while (n > 0) {
+	unsigned char b = *p++;
+	while (b != 0) {
+	    count += b & 1;
+	    b >>= 1;
+	}
+	n--;
+    }
+    return count;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("popcnt")))
+static size_t
+popcount_hw(const unsigned char *p, size_t n)
+{
+    size_t count = 0;
+    while (n >= 8) {
+	uint64_t x;
+	memcpy(&x, p, 8);
+	count += _mm_popcnt_u64(x);
+	p += 8;
+	n -= 8;
+    }
+    return count + popcount_sw(p, n);
+}
+
+// 32 bytes per step: each nibble indexes a 16 entry table of bit counts
+// (vpshufb), and vpsadbw sums the byte counts into four 64-bit lanes
+__attribute__((target("avx2,popcnt")))
+static size_t
+popcount_avx2(const unsigned char *p, size_t n)
+{
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+					    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+    while (n >= 32) {
+	__m256i v = _mm256_loadu_si256((const __m256i *) p);
+	__m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low));
+	__m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+	total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+	p += 32;
+	n -= 32;
+    }
+    size_t count = _mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1) +
+		   _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3);
+    return count + popcount_hw(p, n);
+}
+#endif
+
+// pick the implementation once
+static void
+popcount_init(void)
+{
+    count_fn = popcount_sw;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+	count_fn = popcount_avx2;
+    }
+    else if (__builtin_cpu_supports("popcnt")) {
+	count_fn = popcount_hw;
+    }
+#endif
+}
+
+size_t
+Popcount(const void *buffer, size_t n)
+{
+    if (count_fn == NULL) {
+	popcount_init();
+    }
+    return count_fn((const unsigned char *) buffer, n);
+}
+
+int
+Popcount_Vector(void)
+{
+    if (count_fn == NULL) {
+	popcount_init();
+    }
+#if defined(__x86_64__)
+    if (count_fn == popcount_avx2) {
+	return 2;
+    }
+    if (count_fn == popcount_hw) {
+	return 1;
+    }
+#endif
+    return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef __POPCOUNT_h__
+#define __POPCOUNT_h__
+
+#include <stddef.h>
+
+//
+// prototypes
+// 
+
+// Number of set bits in n bytes of buffer
+// Uses AVX2 (nibble lookup) or the popcnt instruction when the CPU has them,
+// else a portable bit-twiddling fallback
+size_t Popcount(const void *buffer, size_t n);
+
+// Returns 2 if the AVX2 path is in use, 1 for popcnt, 0 for the fallback
+int Popcount_Vector(void);
+
+#endif // __POPCOUNT_h__
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <time.h>
+#include "udp.h"
+#include "trace.h"
+
+// Re-issues a trace recorded with server -t against a server, one request at a
+// time, and compares latencies and results with the recording. The recorded
+// latency is measured in the server; the replayed one is the client round trip.
+
+#define BUFFER_SIZE (4096)
+#define MAX_OPS (64)
+
+typedef struct __Samples_t {
+    int count;
+    int cap;
+    double *recorded;        // us
+    double *replayed;        // us
+    int mismatches;          // replies that differ from the recorded result
+    int lost;                // requests that got no reply
+} Samples_t;
+
+Samples_t samples[MAX_OPS];
+
+static void
+add_sample(Samples_t *s, double recorded, double replayed)
+{
+    if (s->count == s->cap) {
+	s->cap = (s->cap == 0) ? 1024 : s->cap * 2;
+	s->recorded = realloc(s->recorded, sizeof(double) * s->cap);
+	s->replayed = realloc(s->replayed, sizeof(double) * s->cap);
+	assert((s->recorded != NULL) && (s->replayed != NULL));
+    }
+    s->recorded[s->count] = recorded;
+    s->replayed[s->count] = replayed;
+    s->count++;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// mean and 99th percentile of n values (sorts them)
+static void
+summarize(double *v, int n, double *mean, double *p99)
+{
+    double sum = 0;
+    for (int i = 0; i < n; i++) {
+	sum += v[i];
+    }
+    qsort(v, n, sizeof(double), cmp_double);
+    *mean = (n > 0) ? sum / n : 0;
+    *p99 = (n > 0) ? v[(int) ((n - 1) * 0.99)] : 0;
+}
+
+// sends msg tagged with id and waits for the reply with that tag
+// returns the reply's integer, sets *ok to 0 if there was none
+static int
+call(int sd, struct sockaddr_in *addr, unsigned int id, char *msg, int *ok)
+{
+    char tagged[BUFFER_SIZE * 2 + 32];
+    char reply[BUFFER_SIZE * 2 + 64];
+    int len = snprintf(tagged, sizeof(tagged), "#%u %s", id, msg) + 1;
+    *ok = 0;
+    if (UDP_Write(sd, addr, tagged, len) <= 0) {
+	return -1;
+    }
+    while (1) {
+	struct sockaddr_in from;
+	int rc = UDP_Read(sd, &from, reply, sizeof(reply) - 1);
+	if (rc <= 0) {
+	    return -1;
+	}
+	reply[rc] = '\0';
+	char *body;
+	if ((reply[0] == '#') && ((unsigned int) strtoul(reply + 1, &body, 10) == id) && (*body == ' ')) {
+	    *ok = 1;
+	    return atoi(body + 1);
+	}
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc < 4) {
+	printf("Usage: replay trace-file server-name server-port [-s speed | -m]\n");
+	printf("  -s  replay at speed times the recorded rate (default 1, the original timing)\n");
+	printf("  -m  replay as fast as the server answers\n");
+	exit(1);
+    }
+    double speed = 1.0;
+    int max_speed = 0;
+    for (int i = 4; i < argc; i++) {
+	if ((strcmp(argv[i], "-s") == 0) && (i + 1 < argc)) {
+	    speed = atof(argv[++i]);
+	}
+	else if (strcmp(argv[i], "-m") == 0) {
+	    max_speed = 1;
+	}
+    }
+    if (speed <= 0) {
+	printf("Invalid speed %f\n", speed);
+	exit(1);
+    }
+
+    FILE *f = fopen(argv[1], "r");
+    Trace_Header_t header;
+    if ((f == NULL) || (Trace_ReadHeader(f, &header) == -1)) {
+	printf("%s is not a trace\n", argv[1]);
+	exit(1);
+    }
+    int sd = UDP_Open(0);
+    assert(sd > -1);
+    struct sockaddr_in addr;
+    int rc = UDP_FillSockAddr(&addr, argv[2], atoi(argv[3]));
+    assert(rc == 0);
+
+    Trace_Record_t rec;
+    char payload[TRACE_MAX_PAYLOAD + 1];
+    char msg[BUFFER_SIZE * 2];
+    unsigned int id = 0;
+    uint64_t recorded_span = 0;
+    uint64_t start = Trace_Now();
+    while (Trace_Next(f, &rec, payload) == 0) {
+	// hold the request until its (scaled) arrival time
+	if (max_speed == 0) {
+	    uint64_t due = start + (uint64_t) (rec.arrival_ns / speed);
+	    uint64_t now = Trace_Now();
+	    if (due > now) {
+		struct timespec ts;
+		ts.tv_sec = (due - now) / 1000000000ull;
+		ts.tv_nsec = (due - now) % 1000000000ull;
+		nanosleep(&ts, NULL);
+	    }
+	}
+	recorded_span = rec.arrival_ns + rec.latency_ns;
+
+	Trace_Format(&rec, payload, msg);
+	int ok;
+	uint64_t sent = Trace_Now();
+	int result = call(sd, &addr, id++, msg, &ok);
+	uint64_t done = Trace_Now();
+	Samples_t *s = &samples[rec.op % MAX_OPS];
+	if (ok == 0) {
+	    s->lost++;
+	    continue;
+	}
+	if (result != rec.result) {
+	    s->mismatches++;
+	}
+	add_sample(s, rec.latency_ns / 1000.0, (done - sent) / 1000.0);
+    }
+    uint64_t replay_span = Trace_Now() - start;
+
+    printf("%-9s %7s %10s %10s %10s %10s %10s %6s %5s\n", "op", "count", "rec mean", "rec p99",
+	   "rep mean", "rep p99", "diff mean", "differ", "lost");
+    int total = 0;
+    int differ = 0;
+    for (int op = 0; op < Trace_NumOps(); op++) {
+	Samples_t *s = &samples[op];
+	if ((s->count == 0) && (s->lost == 0)) {
+	    continue;
+	}
+	double rec_mean, rec_p99, rep_mean, rep_p99;
+	summarize(s->recorded, s->count, &rec_mean, &rec_p99);
+	summarize(s->replayed, s->count, &rep_mean, &rep_p99);
+	printf("%-9s %7d %10.1f %10.1f %10.1f %10.1f %+10.1f %6d %5d\n", Trace_OpName(op), s->count,
+	       rec_mean, rec_p99, rep_mean, rep_p99, rep_mean - rec_mean, s->mismatches, s->lost);
+	total += s->count + s->lost;
+	differ += s->mismatches;
+    }
+    printf("latencies in us; %d requests, %d with a different result\n", total, differ);
+    printf("recorded span %.3f s, replayed in %.3f s\n", recorded_span / 1e9, replay_span / 1e9);
+    fclose(f);
+    UDP_Close(sd);
+    return 0;
+}
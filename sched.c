@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "sched.h"
+
+typedef struct __Sched_Client_t {
+    uint64_t key;
+    int used;
+    Sched_Item_t *head[SCHED_CLASSES];
+    Sched_Item_t *tail[SCHED_CLASSES];
+    int depth[SCHED_CLASSES];
+    double finish[SCHED_CLASSES];   // tag of its last queued request
+    unsigned long served;
+    uint64_t last;                  // last time it submitted
+} Sched_Client_t;
+
+static Sched_Client_t clients[SCHED_CLIENTS];
+static double vtime[SCHED_CLASSES];
+static int queued[SCHED_CLASSES];
+static unsigned long served[SCHED_CLASSES];
+static uint64_t wait_sum[SCHED_CLASSES];
+static uint64_t wait_max[SCHED_CLASSES];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int
+idle(Sched_Client_t *c)
+{
+    return c->depth[SCHED_META] == 0 && c->depth[SCHED_BULK] == 0;
+}
+
+// the client's entry: its own, a free one, the longest idle one, or a shared one if all are busy
+static Sched_Client_t *
+find_client(uint64_t key)
+{
+    Sched_Client_t *spare = NULL;
+    for (int i = 0; i < SCHED_CLIENTS; i++) {
+	Sched_Client_t *c = &clients[i];
+	if (c->used && c->key == key) {
+	    return c;
+	}
+	if (!c->used) {
+	    if (spare == NULL || spare->used) {
+		spare = c;
+	    }
+	}
+	else if (idle(c) && (spare == NULL || (spare->used && c->last < spare->last))) {
+	    spare = c;
+	}
+    }
+    if (spare == NULL) {
+	return &clients[key % SCHED_CLIENTS];
+    }
+    memset(spare, 0, sizeof(Sched_Client_t));
+    spare->used = 1;
+    spare->key = key;
+    return spare;
+}
+
+int
+Sched_Submit(Sched_Item_t *item)
+{
+    pthread_mutex_lock(&lock);
+    if (queued[SCHED_META] + queued[SCHED_BULK] >= SCHED_MAX_QUEUED) {
+	pthread_mutex_unlock(&lock);
+	return -1;
+    }
+    int cls = (item->cls == SCHED_META) ? SCHED_META : SCHED_BULK;
+    int weight = (item->weight < 1) ? 1 : item->weight;
+    Sched_Client_t *c = find_client(item->client);
+    double start = (c->finish[cls] > vtime[cls]) ? c->finish[cls] : vtime[cls];
+    item->cls = cls;
+    item->tag = start + (1.0 / weight);
+    item->enqueued = now_ns();
+    item->next = NULL;
+    c->finish[cls] = item->tag;
+    c->last = item->enqueued;
+    if (c->tail[cls] == NULL) {
+	c->head[cls] = item;
+    }
+    else {
+	c->tail[cls]->next = item;
+    }
+    c->tail[cls] = item;
+    c->depth[cls]++;
+    queued[cls]++;
+    pthread_cond_signal(&ready);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+Sched_Item_t *
+Sched_Next(void)
+{
+    pthread_mutex_lock(&lock);
+    while (queued[SCHED_META] + queued[SCHED_BULK] == 0) {
+	pthread_cond_wait(&ready, &lock);
+    }
+    uint64_t now = now_ns();
+
+    // metadata reads first, unless bulk work has waited too long
+    int cls = (queued[SCHED_META] > 0) ? SCHED_META : SCHED_BULK;
+    if (cls == SCHED_META && queued[SCHED_BULK] > 0) {
+	for (int i = 0; i < SCHED_CLIENTS; i++) {
+	    Sched_Item_t *head = clients[i].head[SCHED_BULK];
+	    if (head != NULL && now - head->enqueued > (uint64_t) SCHED_AGE_MS * 1000000ull) {
+		cls = SCHED_BULK;
+		break;
+	    }
+	}
+    }
+
+    // smallest finish tag among the class's queue heads
+    Sched_Client_t *best = NULL;
+    for (int i = 0; i < SCHED_CLIENTS; i++) {
+	Sched_Item_t *head = clients[i].head[cls];
+	if (head != NULL && (best == NULL || head->tag < best->head[cls]->tag)) {
+	    best = &clients[i];
+	}
+    }
+    Sched_Item_t *item = best->head[cls];
+    best->head[cls] = item->next;
+    if (best->head[cls] == NULL) {
+	best->tail[cls] = NULL;
+    }
+    best->depth[cls]--;
+    best->served++;
+    queued[cls]--;
+    vtime[cls] = item->tag;
+
+    uint64_t wait = now - item->enqueued;
+    served[cls]++;
+    wait_sum[cls] += wait;
+    if (wait > wait_max[cls]) {
+	wait_max[cls] = wait;
+    }
+    pthread_mutex_unlock(&lock);
+    return item;
+}
+
+int
+Sched_Stats(char *buffer, int n)
+{
+    static char *names[SCHED_CLASSES] = { "meta", "bulk" };
+    int len = 0;
+    pthread_mutex_lock(&lock);
+    for (int cls = 0; cls < SCHED_CLASSES && len < n; cls++) {
+	double avg = (served[cls] > 0) ? (double) wait_sum[cls] / served[cls] / 1000.0 : 0;
+	len += snprintf(buffer + len, n - len, "%s%s depth %d served %lu wait_avg_us %.1f wait_max_us %.1f",
+			(cls > 0) ? " " : "", names[cls], queued[cls], served[cls], avg, wait_max[cls] / 1000.0);
+    }
+    for (int i = 0; i < SCHED_CLIENTS && len < n; i++) {
+	Sched_Client_t *c = &clients[i];
+	if (c->used && !idle(c)) {
+	    len += snprintf(buffer + len, n - len, " client %llx depth %d/%d served %lu", (unsigned long long) c->key,
+			    c->depth[SCHED_META], c->depth[SCHED_BULK], c->served);
+	}
+    }
+    pthread_mutex_unlock(&lock);
+    return (len < n) ? len : n - 1;
+}
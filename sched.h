@@ -0,0 +1,49 @@
+#ifndef __SCHED_h__
+#define __SCHED_h__
+
+//
+// Request scheduler
+//
+// Requests wait in per-client queues, one per class, and are handed out by
+// weighted fair queuing: each request gets a virtual finish tag of
+// max(class virtual time, client's last tag) + 1 / weight, and the smallest
+// head tag goes next, so a client with weight 2 gets twice the turns of one
+// with weight 1 while both have work queued. Metadata reads go ahead of
+// everything else unless a bulk request has waited SCHED_AGE_MS.
+//
+
+#include <stdint.h>
+
+#define SCHED_META (0)          // metadata reads: lookup, stat, statfs
+#define SCHED_BULK (1)          // everything else
+#define SCHED_CLASSES (2)
+#define SCHED_CLIENTS (256)     // clients tracked at once, idle ones are reused
+#define SCHED_MAX_QUEUED (1024)
+#define SCHED_AGE_MS (50)
+
+typedef struct __Sched_Item_t {
+    struct __Sched_Item_t *next;
+    uint64_t client;            // who sent it
+    int weight;                 // client's share, at least 1
+    int cls;                    // SCHED_META or SCHED_BULK
+    uint64_t enqueued;          // set by Sched_Submit (ns)
+    double tag;                 // set by Sched_Submit
+    void *data;                 // the caller's request
+} Sched_Item_t;
+
+//
+// prototypes
+// 
+
+// Queues item (client, weight, cls and data filled in)
+// Returns 0 if success, -1 if SCHED_MAX_QUEUED requests are already waiting
+int Sched_Submit(Sched_Item_t *item);
+
+// Takes the next item to run, waiting for one
+Sched_Item_t *Sched_Next(void);
+
+// Writes queue depths, requests served and wait times (per class, then per busy client) to buffer
+// Returns number of characters written
+int Sched_Stats(char *buffer, int n);
+
+#endif // __SCHED_h__
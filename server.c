@@ -1,64 +1,216 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include "udp.h"
+#include "stream.h"
+#include "shm.h"
 #include "mfs.h"
-
-#define NUM_INODES (4096)
-#define NUM_BLOCKS (4096)
-#define INODE_SIZE (52)
-#define BLOCK_SIZE (4096)
-
-
-#define FIRST_INODE (1024)
-#define INODE_BITMAP_START (0)
-#define BLOCK_BITMAP_START (512)
-#define INODE_START (1024)
-#define BLOCK_START (214016)
-
-#define INODE_OFFSET_TYPE (0)
-#define INODE_OFFSET_SIZE (4)
-#define INODE_OFFSET_NUM_B (8)
-#define INODE_OFFSET_PTR (12)
+#include "crc32c.h"
+#include "lz.h"
+#include "cache.h"
+#include "lfs.h"
+#include "trace.h"
+#include "popcount.h"
+#include "sched.h"
+#include "layout.h"
 
 #define BUFFER_SIZE (4096)
-#define FS_SIZE (16978944)
-// #define MFS_DIRECTORY    (0) // defined in mfs.h
-// #define MFS_REGULAR_FILE (1)
-
-/***************
-Filesystem Structure:
-Bytes 0-511: Inode bitmap
-Bytes 512-1023: Data block bitmap
-Bytes 1024-214015: Inodes (212992 bytes)
-Bytes 214016-16991231: Data blocks
-Total size (max): 16.9 MB
-***************/
-
-/***************
-Bitmap Structure:
-char's of 1 byte each - bits accessed via bit manipulation
-***************/
-
-/***************
-Inode Structure (File):
-Byte 0-3: type (type int, 0 = dir, 1 = file)
-Byte 4-7: size in bytes (type int)
-Byte 8-11: num of blocks (type int)
-Byte 12-51: 	If type 1, pointer to up to 10 blocks (type int, indicates byte number of block)
-			If type 0, pointer to up to 10 blocks pointing to other inodes (type int, indicates block number)
-NOTE: inode name is stored in blocks linked to directory inodes - 4 byte inode number + 252 bytes of char
-NOTE: if block pointer is -1, it is unusued
-NOTE: blocks are numbered 0-9
-Total size: 52 bytes
-***************/
 
 int fs_creat(int pinum, int type, char *name);
+int is_snap_inum(int inum);
+void snap_load();
+int snap_lookup(int inum, char *name);
+int snap_stat(int inum, int *stat_type, int *stat_size, int *stat_blocks);
+int snap_read(int inum, char *buffer, int block);
+int parser(char *command, int *stat1, int *stat2, int *stat3, int *is_read, char *read_buffer);
+void statfs_count();
+int fs_drop(int inum);
+int inode_field(int inum, int offset);
+int read_dirent_block(int blocknum, char *name);
+void rename_recover();
+void meta_sync();
+int meta_write(void *buf, int len, int off);
+long now_ms();
+int shm_attach(char *name);
 
 int fs = -1;
 
+// Serializes the file system core between receive threads
+pthread_mutex_t core_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Shard this process serves; directory entries hold global inums (see MFS_INUM)
+// so they can name inodes on other shards, everything else works on local inums
+int my_shard = 0;
+
+// Set when the image is log-structured; every fs_* call then goes to the LFS engine
+int lfs_mode = 0;
+int lfs_format = 0;
+
+// Number of block reads (and metadata chunks at load) that failed checksum verification
+int csum_errors = 0;
+
+// Checksums of the bitmap and inode chunks as last written, see Checksum Structure;
+// a chunk that failed at load keeps its checksum until mfs-fsck -y has checked it.
+// meta_copy holds bytes 0 to BLOCK_START as the server wrote them (read in at load),
+// meta_dirty marks the chunks written since the last meta_sync
+unsigned int meta_csum[META_CHUNKS];
+char meta_bad[META_CHUNKS];
+char meta_copy[BLOCK_START];
+char meta_dirty[META_CHUNKS];
+
+// Rename intent record, see Rename Intent Structure
+typedef struct __Rename_Intent_t {
+	int magic;          // INTENT_MAGIC while a rename is in progress
+	int inum;           // global inum being renamed
+	int srcp;           // source directory, entry srcslot is cleared
+	int srcslot;
+	int srcsize;
+	int dstp;           // destination directory, entry dstslot becomes block
+	int dstslot;
+	int dstsize;
+	int block;          // new entry block naming inum as name
+	int child;          // local inum of a directory moved to a new parent, -1 if none
+	int dotdot;         // its new ".." entry block
+	int freed[3];       // old entry blocks to free, -1 if unused
+	int dropped;        // local inum of the inode the rename replaced, -1 if none
+	char name[252];
+	unsigned int crc;   // CRC32C of the fields above
+} Rename_Intent_t;
+
+// Warm start: [image].warm lists the hottest inodes (by inode_hits) and the blocks in the
+// data block cache at clean shutdown; startup reads the metadata sequentially and
+// prefetches them with WARM_THREADS threads while requests are already served
+#define WARM_MAGIC (0x4d524157)
+#define WARM_INODES (256)
+#define WARM_THREADS (4)
+unsigned int inode_hits[NUM_INODES];
+
+// Scheduler mode (-W): receive threads queue requests per client and class, and
+// sched_execute runs them in weighted fair order (see sched.h). Clients are keyed by
+// address and port (UDP, TCP), socket (Unix-domain) or process (shared memory);
+// sched_weight gives clients from an IPv4 address another weight than the default.
+#define SCHED_WEIGHTS (64)
+#define SCHED_KEY_UNIX (1ull << 48)
+#define SCHED_KEY_SHM (2ull << 48)
+int sched_mode = 0;
+int sched_default_weight = 1;
+int sched_nweights = 0;
+in_addr_t sched_weight_ip[SCHED_WEIGHTS];
+int sched_weight[SCHED_WEIGHTS];
+
+// Clean shutdown on SIGINT / SIGTERM, see shutdown_wait
+sigset_t shutdown_signals;
+char *image_path = NULL;
+
+// Free inodes and blocks for statfs, kept in step by set_inode_bitmap / set_block_bitmap
+// and recounted from the bitmaps at load and when snapshots change what they hold.
+// Blocks held by a snapshot are not free.
+int free_inodes = 0;
+int free_blocks = 0;
+
+// Set when every parsed request is recorded to a trace file (-t, see trace.h)
+int trace_mode = 0;
+
+// Dedup mode: identical file data blocks are stored once and refcounted
+// block_refs counts inode block pointers to each data block, block_fp holds its fingerprint (CRC32C)
+// Both are indexed by ptr_key() so packed slot runs get their own counts
+// dedup_index is an open addressing table of block pointers keyed by fingerprint
+#define DEDUP_SLOTS (2 * NUM_KEYS)
+#define DEDUP_EMPTY (-1)
+#define DEDUP_DELETED (-2)
+int dedup_mode = 0;
+int block_refs[NUM_KEYS];
+unsigned int block_fp[NUM_KEYS];
+int dedup_index[DEDUP_SLOTS];
+
+// Compression mode: file data blocks that compress well are packed into slots
+// slot_map mirrors the on-disk slot maps
+int compress_mode = 0;
+unsigned char slot_map[NUM_BLOCKS];
+
+// Delayed allocation mode (-D, classic images): file writes wait in memory, per inode,
+// and only get blocks when they are flushed: when the server is idle, when
+// DELALLOC_MAX_BLOCKS are pending, after any request once the oldest has waited
+// DELALLOC_AGE_MS, and before a snapshot or shutdown. A flush gives a file's pending
+// blocks one contiguous run if there is one, written with one pwritev, and rewrites its
+// inode once. Files dropped before then never reach the disk. A write is acked once
+// buffered, so a crash loses it.
+#define DELALLOC_MAX_BLOCKS (256)
+#define DELALLOC_AGE_MS (1000)
+typedef struct __Pending_t {
+	int mask;                       // bit i set if block i is pending
+	char data[10][BLOCK_SIZE];
+} Pending_t;
+int delalloc_mode = 0;
+Pending_t *pending[NUM_INODES];
+int pending_blocks = 0;
+long pending_since = 0;             // now_ms() of the oldest pending write
+
+// Union of the block bitmaps and slot maps of all valid snapshots (blocks and slots they hold)
+int snap_state[MAX_SNAPSHOTS];
+unsigned char snap_blocks[NUM_BLOCKS / 8];
+unsigned char snap_slots[NUM_BLOCKS];
+
+// Replication: a primary (-R) ships each successful mutation, in order, to its replicas
+// as "repl <seq> <command>". A replica (-r) applies entry seq only right after seq - 1 and
+// acks with the last seq it applied, so lost or reordered entries are just sent again.
+// An idle primary sends "repl <seq>" heartbeats. A replica takes "repl" messages only over
+// UDP from its primary's address (-r host), and rejects client mutations and
+// serves lookup/stat/read only if it was caught up with the primary within repl_bound_ms,
+// otherwise it replies -2 and the client asks the primary.
+// Only the last seq survives a restart, not the log: a primary comes back with an empty
+// log, and replicas that had not acked everything before the restart need a resync.
+#define REPL_NONE (0)
+#define REPL_PRIMARY (1)
+#define REPL_REPLICA (2)
+#define REPL_LOG (256)
+#define REPL_WINDOW (32)
+#define REPL_HEARTBEAT_MS (100)
+#define REPL_RESEND_MS (50)
+int repl_role = REPL_NONE;
+int repl_bound_ms = 1000;
+int repl_state = -1;        // [image].repl: last seq logged (primary) or applied (replica)
+int repl_seq = 0;           // primary: last seq logged, replica: last seq applied
+int repl_log_first = 1;     // primary: oldest seq logged since the start
+int repl_fd = -1;           // primary: ships entries and receives acks
+int num_replicas = 0;
+struct sockaddr_in replicas[MFS_MAX_REPLICAS];
+int replica_acked[MFS_MAX_REPLICAS];     // -1 until the replica first acks
+int replica_sent[MFS_MAX_REPLICAS];
+long replica_sent_at[MFS_MAX_REPLICAS];
+long repl_heartbeat = 0;
+int repl_primary_seq = 0;   // replica: newest seq the primary announced
+long repl_current = 0;      // replica: last time it had applied all of them
+struct sockaddr_in repl_primary;        // replica: address of the primary (-r host)
+char repl_log[REPL_LOG][BUFFER_SIZE * 2];
+
+// Converts local inum to the global inum stored in directory entries and sent to clients
+int global_inum(int inum) {
+	if (inum < 0) {
+		return inum;
+	}
+	return MFS_INUM(my_shard, inum);
+}
+
+// Converts global inum from a client or directory entry to a local inum
+// Returns local inum, -1 if inum belongs to another shard
+int local_inum(int inum) {
+	if ((inum < 0) || (MFS_SHARD(inum) != my_shard)) {
+		return -1;
+	}
+	return MFS_LOCAL(inum);
+}
+
 // Checks if inum inode is valid in bitmap
 // Returns 0 if free inum, 1 if occupied
 int valid_inum(int inum) {
@@ -97,6 +249,7 @@ int set_inode_bitmap(int inum, int value) {
 
 	// Reset bit
 	int bitnum = inum % 8;
+	int old = (*ichunk >> bitnum) & 1;
 	char mask = 0x01 << bitnum;
 	if (value == 0) {
 		mask ^= 0xff;
@@ -108,14 +261,25 @@ int set_inode_bitmap(int inum, int value) {
 	}
 
 	// Write new byte to fs
-	lseek(fs, INODE_BITMAP_START + (inum / 8), SEEK_SET);
-	status = write(fs, ichunk, 1);
+	status = meta_write(ichunk, 1, INODE_BITMAP_START + (inum / 8));
 	if (status < 0) {
 		return -1;
 	}
+	if (old != (value != 0)) {
+		free_inodes += (value == 0) ? 1 : -1;
+	}
 	return 0;
 }
 
+// Gives the storage behind free block blocknum back to the host (the image stays sparse)
+// and drops its checksum, so it reads back as zeros until it is written again
+void release_block(int blocknum) {
+	unsigned int crc = 0;
+	if (fallocate(fs, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, BLOCK_START + ((off_t) blocknum * BLOCK_SIZE), BLOCK_SIZE) == 0) {
+		pwrite(fs, &crc, sizeof(int), CSUM_START + (blocknum * sizeof(int)));
+	}
+}
+
 // Set bitmap inode inum bit to value
 int set_block_bitmap(int inum, int value) {
 	// Get value of corresponding byte in bitmap
@@ -128,6 +292,7 @@ int set_block_bitmap(int inum, int value) {
 
 	// Reset bit
 	int bitnum = inum % 8;
+	int old = (*ichunk >> bitnum) & 1;
 	char mask = 0x01 << bitnum;
 	if (value == 0) {
 		mask ^= 0xff;
@@ -139,11 +304,17 @@ int set_block_bitmap(int inum, int value) {
 	}
 
 	// Write new byte to fs
-	lseek(fs, BLOCK_BITMAP_START + (inum / 8), SEEK_SET);
-	status = write(fs, ichunk, 1);
+	status = meta_write(ichunk, 1, BLOCK_BITMAP_START + (inum / 8));
 	if (status < 0) {
 		return -1;
 	}
+	// A block a snapshot holds stays in use either way
+	if ((old != (value != 0)) && (((snap_blocks[inum / 8] >> bitnum) & 1) == 0)) {
+		free_blocks += (value == 0) ? 1 : -1;
+		if (value == 0) {
+			release_block(inum);
+		}
+	}
 	return 0;
 }
 
@@ -163,17 +334,436 @@ int is_directory(int inum) {
 	}
 }
 
+// Writes BLOCK_SIZE bytes of data to block blocknum and records its checksum
+// Returns 0 if success, -1 if failure
+int write_block(int blocknum, char *data) {
+	Cache_Drop(blocknum);
+	lseek(fs, BLOCK_START + (blocknum * BLOCK_SIZE), SEEK_SET);
+	int status = write(fs, data, BLOCK_SIZE);
+	if (status < 0) {
+		return -1;
+	}
+
+	unsigned int crc = CRC32C(0, data, BLOCK_SIZE);
+	lseek(fs, CSUM_START + (blocknum * sizeof(int)), SEEK_SET);
+	status = write(fs, (void *) &crc, sizeof(int));
+	if (status < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+// Reads block blocknum into data (BLOCK_SIZE bytes) and verifies its checksum
+// Returns 0 if success, -1 if failure (read error, checksum mismatch)
+int read_block(int blocknum, char *data) {
+	lseek(fs, BLOCK_START + (blocknum * BLOCK_SIZE), SEEK_SET);
+	int status = read(fs, data, BLOCK_SIZE);
+	if (status < 0) {
+		return -1;
+	}
+
+	unsigned int crc = 0;
+	lseek(fs, CSUM_START + (blocknum * sizeof(int)), SEEK_SET);
+	status = read(fs, (void *) &crc, sizeof(int));
+	if ((status == sizeof(int)) && (crc != 0) && (crc != CRC32C(0, data, BLOCK_SIZE))) {
+		csum_errors++;
+		printf("Checksum mismatch on block %d (%d total)\n", blocknum, csum_errors);
+		return -1;
+	}
+	return 0;
+}
+
+// Writes len bytes of the bitmaps or inodes at offset off, and the same bytes to meta_copy,
+// marking the chunks they fall in for meta_sync
+// Returns number of bytes written, -1 if failure
+int meta_write(void *buf, int len, int off) {
+	if (pwrite(fs, buf, len, off) != len) {
+		return -1;
+	}
+	memcpy(meta_copy + off, buf, len);
+	for (int i = off / BLOCK_SIZE; i <= (off + len - 1) / BLOCK_SIZE; i++) {
+		meta_dirty[i] = 1;
+	}
+	return len;
+}
+
+// Records the checksums of the chunks written since the last call. They are computed from
+// meta_copy, not read back, so bytes that changed on disk behind the server's back still
+// fail at the next load. Called once a request's metadata writes are done, before the
+// image is synced
+void meta_sync() {
+	if (lfs_mode == 1) {
+		return;
+	}
+	for (int i = 0; i < META_CHUNKS; i++) {
+		if ((meta_dirty[i] == 0) || (meta_bad[i] == 1)) {
+			continue;
+		}
+		meta_dirty[i] = 0;
+		unsigned int crc = CRC32C(0, meta_copy + (i * BLOCK_SIZE), META_CHUNK_LEN(i));
+		if (crc != meta_csum[i]) {
+			meta_csum[i] = crc;
+			pwrite(fs, &crc, sizeof(int), META_CSUM_START + (i * sizeof(int)));
+		}
+	}
+}
+
+// Reads the bitmaps and inodes into meta_copy and verifies each chunk against its checksum
+// at load. A chunk that fails is reported (and counted in csum_errors) and the image is
+// still served, but the chunk's checksum is left as it is, so it fails again until
+// mfs-fsck -y has checked it. Every chunk of a new image (all checksums 0) is marked
+// for meta_sync
+// Returns number of chunks that failed
+int meta_verify() {
+	unsigned int stored[META_CHUNKS];
+	memset(stored, 0, sizeof(stored));
+	if (pread(fs, meta_copy, BLOCK_START, 0) != BLOCK_START) {
+		return 0;
+	}
+	pread(fs, stored, sizeof(stored), META_CSUM_START);
+	int bad = 0;
+	for (int i = 0; i < META_CHUNKS; i++) {
+		meta_csum[i] = stored[i];
+		if (stored[i] == 0) {
+			meta_dirty[i] = 1;
+		}
+		else if (stored[i] != CRC32C(0, meta_copy + (i * BLOCK_SIZE), META_CHUNK_LEN(i))) {
+			csum_errors++;
+			meta_bad[i] = 1;
+			bad++;
+			printf("Checksum mismatch on metadata bytes %d-%d (bitmaps and inodes), check the image with mfs-fsck\n",
+			       i * BLOCK_SIZE, (i * BLOCK_SIZE) + META_CHUNK_LEN(i) - 1);
+		}
+	}
+	return bad;
+}
+
+// Writes a directory entry block (4 byte inode number + 252 bytes of name) to block blocknum
+// Returns 0 if success, -1 if failure
+int write_dirent_block(int blocknum, int inum, char *name) {
+	char data[BLOCK_SIZE];
+	memset(data, 0, BLOCK_SIZE);
+	memcpy(data, &inum, sizeof(int));
+	strncpy(data + sizeof(int), name, 252);
+	return write_block(blocknum, data);
+}
+
 // Searches through block bitmap for first free block
 // Returns block number of free block, -1 if none found or error
 int find_free_block() {
 	for (int i = 0; i < NUM_BLOCKS; i++) {
-		if (valid_block(i) == 0) {
+		// Blocks still held by a snapshot can't be reused
+		if ((valid_block(i) == 0) && (((snap_blocks[i / 8] >> (i % 8)) & 1) == 0)) {
 			return i;
 		}
 	}
 	return -1;
 }
 
+// Checks if block pointer ptr refers to a packed slot run
+// Returns 1 if packed, 0 if not
+int is_packed(int ptr) {
+	return ptr >= PTR_PACKED;
+}
+
+// Checks if ptr is a data block pointer (raw block number or packed slot run)
+// Returns 1 if valid, 0 if not
+int valid_ptr(int ptr) {
+	if ((ptr >= 0) && (ptr < NUM_BLOCKS)) {
+		return 1;
+	}
+	return (ptr >= PTR_PACKED) && (ptr < PTR_PACKED + NUM_KEYS);
+}
+
+// Returns data block number that block pointer ptr lives in
+int ptr_block(int ptr) {
+	if (is_packed(ptr) == 1) {
+		return (ptr - PTR_PACKED) / SLOTS_PER_BLOCK;
+	}
+	return ptr;
+}
+
+// Returns index of block pointer ptr in per-pointer tables (refcounts, fingerprints)
+int ptr_key(int ptr) {
+	if (is_packed(ptr) == 1) {
+		return ptr - PTR_PACKED;
+	}
+	return ptr * SLOTS_PER_BLOCK;
+}
+
+// Sets slot map byte of block blocknum to value
+// Returns 0 if success, -1 if failure
+int set_slot_map(int blocknum, unsigned char value) {
+	slot_map[blocknum] = value;
+	lseek(fs, SLOTMAP_START + blocknum, SEEK_SET);
+	int status = write(fs, &value, 1);
+	if (status < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+// Finds nslots consecutive free slots, in a partly used packed block if possible
+// Returns block number and sets *slot to the first slot, -1 if none found
+int find_free_slots(int nslots, int *slot) {
+	int mask = (1 << nslots) - 1;
+	for (int i = 0; i < NUM_BLOCKS; i++) {
+		if (slot_map[i] == 0) {
+			continue;
+		}
+		for (int j = 0; j + nslots <= SLOTS_PER_BLOCK; j++) {
+			if (((slot_map[i] | snap_slots[i]) & (mask << j)) == 0) {
+				*slot = j;
+				return i;
+			}
+		}
+	}
+	*slot = 0;
+	return find_free_block();
+}
+
+// Compresses data and stores it in a packed slot run
+// Returns block pointer, -1 if data doesn't compress enough or no space
+int store_packed(char *data) {
+	char packed[BLOCK_SIZE];
+	int cap = ((SLOTS_PER_BLOCK - 1) * SLOT_SIZE) - sizeof(int);
+	int clen = LZ_Compress(data, BLOCK_SIZE, packed + sizeof(int), cap);
+	if (clen < 0) {
+		return -1;
+	}
+	memcpy(packed, &clen, sizeof(int));
+	int nslots = (clen + sizeof(int) + SLOT_SIZE - 1) / SLOT_SIZE;
+
+	int slot;
+	int blocknum = find_free_slots(nslots, &slot);
+	if (blocknum == -1) {
+		return -1;
+	}
+
+	// Other slots of the block may be in use, so rewrite it around them
+	char raw[BLOCK_SIZE];
+	if (slot_map[blocknum] == 0) {
+		memset(raw, 0, BLOCK_SIZE);
+		set_block_bitmap(blocknum, 1);
+	}
+	else if (read_block(blocknum, raw) < 0) {
+		return -1;
+	}
+	memcpy(raw + (slot * SLOT_SIZE), packed, clen + sizeof(int));
+	if (write_block(blocknum, raw) < 0) {
+		return -1;
+	}
+	set_slot_map(blocknum, slot_map[blocknum] | (((1 << nslots) - 1) << slot));
+
+	int ptr = PTR_PACKED + (blocknum * SLOTS_PER_BLOCK) + slot;
+	Cache_Put(ptr, data);
+	return ptr;
+}
+
+// Reads packed slot run ptr and decompresses it into data (BLOCK_SIZE bytes)
+// Returns 0 if success, -1 if failure
+int read_packed(int ptr, char *data) {
+	char raw[BLOCK_SIZE];
+	int offset = ((ptr - PTR_PACKED) % SLOTS_PER_BLOCK) * SLOT_SIZE;
+	if (read_block(ptr_block(ptr), raw) < 0) {
+		return -1;
+	}
+	int clen;
+	memcpy(&clen, raw + offset, sizeof(int));
+	if ((clen <= 0) || (clen > (int) (BLOCK_SIZE - offset - sizeof(int)))) {
+		return -1;
+	}
+	if (LZ_Decompress(raw + offset + sizeof(int), clen, data, BLOCK_SIZE) != BLOCK_SIZE) {
+		return -1;
+	}
+	return 0;
+}
+
+// Reads file data at block pointer ptr into data (BLOCK_SIZE bytes), from the block cache if there
+// Returns 0 if success, -1 if failure
+int read_data(int ptr, char *data) {
+	if (Cache_Get(ptr, data) == 0) {
+		return 0;
+	}
+	if (is_packed(ptr) == 1) {
+		if (read_packed(ptr, data) < 0) {
+			return -1;
+		}
+	}
+	else if (read_block(ptr, data) < 0) {
+		return -1;
+	}
+	Cache_Put(ptr, data);
+	return 0;
+}
+
+// Frees the storage behind block pointer ptr (whole block, or its slots if packed)
+void free_data_ptr(int ptr) {
+	Cache_Drop(ptr);
+	int blocknum = ptr_block(ptr);
+	if (is_packed(ptr) == 0) {
+		set_block_bitmap(blocknum, 0);
+		return;
+	}
+
+	int slot = (ptr - PTR_PACKED) % SLOTS_PER_BLOCK;
+	int clen = 0;
+	lseek(fs, BLOCK_START + (blocknum * BLOCK_SIZE) + (slot * SLOT_SIZE), SEEK_SET);
+	read(fs, &clen, sizeof(int));
+	int nslots = (clen + sizeof(int) + SLOT_SIZE - 1) / SLOT_SIZE;
+	set_slot_map(blocknum, slot_map[blocknum] & ~(((1 << nslots) - 1) << slot));
+	if (slot_map[blocknum] == 0) {
+		set_block_bitmap(blocknum, 0);
+	}
+}
+
+// Looks up a block pointer holding exactly data, fingerprint fp
+// Returns block pointer of match, -1 if none
+int dedup_find(char *data, unsigned int fp) {
+	char candidate[BLOCK_SIZE];
+	int slot = fp % DEDUP_SLOTS;
+	for (int i = 0; i < DEDUP_SLOTS; i++) {
+		int ptr = dedup_index[slot];
+		if (ptr == DEDUP_EMPTY) {
+			break;
+		}
+		// Fingerprints can collide, so compare contents before sharing
+		if ((ptr >= 0) && (block_fp[ptr_key(ptr)] == fp)) {
+			if ((read_data(ptr, candidate) == 0) && (memcmp(candidate, data, BLOCK_SIZE) == 0)) {
+				return ptr;
+			}
+		}
+		slot = (slot + 1) % DEDUP_SLOTS;
+	}
+	return -1;
+}
+
+// Adds block pointer ptr with fingerprint fp to the dedup index
+void dedup_insert(int ptr, unsigned int fp) {
+	block_fp[ptr_key(ptr)] = fp;
+	int slot = fp % DEDUP_SLOTS;
+	while (dedup_index[slot] >= 0) {
+		slot = (slot + 1) % DEDUP_SLOTS;
+	}
+	dedup_index[slot] = ptr;
+}
+
+// Removes block pointer ptr from the dedup index
+void dedup_remove(int ptr) {
+	int slot = block_fp[ptr_key(ptr)] % DEDUP_SLOTS;
+	for (int i = 0; i < DEDUP_SLOTS; i++) {
+		if (dedup_index[slot] == DEDUP_EMPTY) {
+			return;
+		}
+		if (dedup_index[slot] == ptr) {
+			dedup_index[slot] = DEDUP_DELETED;
+			return;
+		}
+		slot = (slot + 1) % DEDUP_SLOTS;
+	}
+}
+
+// Rebuilds block refcounts and the dedup index from the inodes on disk
+void dedup_rebuild() {
+	char data[BLOCK_SIZE];
+	int ptrs[10];
+	for (int i = 0; i < NUM_KEYS; i++) {
+		block_refs[i] = 0;
+	}
+	for (int i = 0; i < DEDUP_SLOTS; i++) {
+		dedup_index[i] = DEDUP_EMPTY;
+	}
+
+	for (int inum = 0; inum < NUM_INODES; inum++) {
+		if ((valid_inum(inum) == 0) || (is_directory(inum) == 0)) {
+			continue;
+		}
+		lseek(fs, INODE_START + (inum * INODE_SIZE) + INODE_OFFSET_PTR, SEEK_SET);
+		read(fs, ptrs, sizeof(ptrs));
+		for (int i = 0; i < 10; i++) {
+			if (valid_ptr(ptrs[i]) == 0) {
+				continue;
+			}
+			block_refs[ptr_key(ptrs[i])]++;
+			if ((block_refs[ptr_key(ptrs[i])] == 1) && (read_data(ptrs[i], data) == 0)) {
+				dedup_insert(ptrs[i], CRC32C(0, data, BLOCK_SIZE));
+			}
+		}
+	}
+}
+
+// Marks the image as one whose data blocks may be shared, the first time it is served with -d.
+// Without -d, a marked image is refused: freeing a shared block without its refcounts
+// would free it under the other files that still point to it
+// Returns 0 if success, -1 if failure (marked image and dedup is off)
+int dedup_mark() {
+	int features = 0;
+	pread(fs, &features, sizeof(int), FEATURES_START);
+	if ((features & FEATURE_DEDUP) == 0) {
+		if (dedup_mode == 0) {
+			return 0;
+		}
+		features |= FEATURE_DEDUP;
+		pwrite(fs, &features, sizeof(int), FEATURES_START);
+		fsync(fs);
+		return 0;
+	}
+	return (dedup_mode == 1) ? 0 : -1;
+}
+
+// Stores BLOCK_SIZE bytes of file data in a data block
+// In dedup mode, shares an existing block with identical contents if there is one
+// In compression mode, packs it into slots if it compresses well
+// Returns block pointer, -1 if failure (no free block)
+int store_data_block(char *data) {
+	unsigned int fp = 0;
+	if (dedup_mode == 1) {
+		fp = CRC32C(0, data, BLOCK_SIZE);
+		int match = dedup_find(data, fp);
+		if (match != -1) {
+			block_refs[ptr_key(match)]++;
+			return match;
+		}
+	}
+
+	int newptr = -1;
+	if (compress_mode == 1) {
+		newptr = store_packed(data);
+	}
+	if (newptr == -1) {
+		// Create new block (search bitmap for free block)
+		newptr = find_free_block();
+		if (newptr == -1) {
+			return -1;
+		}
+		set_block_bitmap(newptr, 1);
+		if (write_block(newptr, data) < 0) {
+			return -1;
+		}
+		Cache_Put(newptr, data);
+	}
+
+	if (dedup_mode == 1) {
+		block_refs[ptr_key(newptr)] = 1;
+		dedup_insert(newptr, fp);
+	}
+	return newptr;
+}
+
+// Drops one inode's reference to file data at block pointer ptr (dedup mode only)
+// Frees the block (or slots) once nothing points to it
+void release_data_block(int ptr) {
+	if ((dedup_mode == 0) || (valid_ptr(ptr) == 0)) {
+		return;
+	}
+	block_refs[ptr_key(ptr)]--;
+	if (block_refs[ptr_key(ptr)] <= 0) {
+		block_refs[ptr_key(ptr)] = 0;
+		dedup_remove(ptr);
+		free_data_ptr(ptr);
+	}
+}
+
 // Searches through inode bitmap for first free inode
 // Returns inode number of free inode, -1 if none found or error
 int find_free_inode() {
@@ -200,9 +790,8 @@ int reset_fs() {
 		set_inode_bitmap(i,0);
 		set_block_bitmap(i,0);
 	}
-	// Write 0 to end of filesystem to set file size
-	lseek(fs, FS_SIZE-1, SEEK_SET);
-	status = write(fs, "a", 1);
+	// Size the image without writing it, space nothing uses stays a hole in the host file
+	status = ftruncate(fs, FS_SIZE);
 	lseek(fs, 0, SEEK_SET);
 
 	// Set first inode as root directory
@@ -211,7 +800,7 @@ int reset_fs() {
 	int *wrapper = (int *)intwriter;
 	*wrapper = 0;
 	lseek(fs, FIRST_INODE, SEEK_SET);
-	status = write(fs, intwriter, 1);	// write type = 0
+	status = write(fs, intwriter, 4);	// write type = 0
 	write(fs, intwriter, 4); // write size = 0
 	write(fs, intwriter, 4); // write num blocks = 0
 	
@@ -226,10 +815,7 @@ int reset_fs() {
 	// Write "." entry to root directory
 	int newblockid = find_free_block();
 	set_block_bitmap(newblockid, 1);
-	lseek(fs, BLOCK_START + (newblockid * BLOCK_SIZE), SEEK_SET);
-	*wrapper = 0;
-	status = write(fs, intwriter, 4);
-	status = write(fs, ".", 252);
+	status = write_dirent_block(newblockid, global_inum(0), ".");
 	
 	// Link new inode to pinum inode
 	*wrapper = newblockid;
@@ -255,10 +841,7 @@ int reset_fs() {
 	// Write ".." entry to root directory
 	newblockid = find_free_block();
 	set_block_bitmap(newblockid, 1);
-	lseek(fs, BLOCK_START + (newblockid * BLOCK_SIZE), SEEK_SET);
-	*wrapper = 0;
-	status = write(fs, intwriter, 4);
-	status = write(fs, "..", 252);
+	status = write_dirent_block(newblockid, global_inum(0), "..");
 	
 	// Link new inode to pinum inode
 	*wrapper = newblockid;
@@ -293,28 +876,229 @@ int load_fs(char *filename) {
 	// Open fs and set global pointer
 	fs = open(filename, O_RDWR|O_CREAT, 0666);
 
+	// Check if open fs succeeded
+	if (fs == -1) {
+		return -1;
+	}
+
 	// Reset fs if new file created
+	LFS_SetShard(my_shard);
 	if (status < 0) {
-		reset_fs();
+		if (lfs_format == 1) {
+			LFS_Format(fs);
+		}
+		else {
+			reset_fs();
+		}
 	}
 	// printf("errno: %d\n", errno);
-	
-	// Check if open fs succeeded
-	if (fs == -1) {
-		return -1;
+
+	// Log-structured images carry their own metadata
+	if (LFS_Load(fs) == 0) {
+		printf("Log-structured image\n");
+		lfs_mode = 1;
+		return 0;
 	}
-	else {
+
+	// Older images end before the metadata checksums: grow them (sparsely) to the full layout
+	if (lseek(fs, 0, SEEK_END) < FS_SIZE) {
+		ftruncate(fs, FS_SIZE);
+	}
+
+	// Check the bitmaps and inodes, a new or older image gets its checksums recorded here
+	meta_verify();
+	meta_sync();
+
+	// Keep packed block slot maps in memory
+	memset(slot_map, 0, NUM_BLOCKS);
+	lseek(fs, SLOTMAP_START, SEEK_SET);
+	status = read(fs, slot_map, NUM_BLOCKS);
+	snap_load();
+	return 0;
+}
+
+// Inodes by descending hit count, for qsort
+int cmp_hits(const void *a, const void *b) {
+	unsigned int x = inode_hits[*(const int *) a];
+	unsigned int y = inode_hits[*(const int *) b];
+	return (x < y) - (x > y);
+}
+
+// Writes the warm start manifest [image].warm: the WARM_INODES most used inodes and the
+// keys of the cached data blocks. Written to a temporary file and renamed into place.
+// Returns 0 if success, -1 if failure
+int warm_save(char *image) {
+	if (lfs_mode == 1) {
 		return 0;
 	}
+	int inums[NUM_INODES];
+	int n = 0;
+	for (int i = 0; i < NUM_INODES; i++) {
+		if (inode_hits[i] > 0) {
+			inums[n++] = i;
+		}
+	}
+	qsort(inums, n, sizeof(int), cmp_hits);
+	int header[3];
+	int keys[CACHE_SETS * CACHE_WAYS];
+	header[0] = WARM_MAGIC;
+	header[1] = (n < WARM_INODES) ? n : WARM_INODES;
+	header[2] = Cache_Keys(keys, CACHE_SETS * CACHE_WAYS);
+
+	char path[4096];
+	char tmp[4096];
+	snprintf(path, sizeof(path), "%s.warm", image);
+	snprintf(tmp, sizeof(tmp), "%s.warm.tmp", image);
+	int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	if (fd == -1) {
+		return -1;
+	}
+	int ok = (write(fd, header, sizeof(header)) == sizeof(header)) &&
+		(write(fd, inums, header[1] * sizeof(int)) == (ssize_t) (header[1] * sizeof(int))) &&
+		(write(fd, keys, header[2] * sizeof(int)) == (ssize_t) (header[2] * sizeof(int))) &&
+		(fsync(fd) == 0);
+	close(fd);
+	if ((ok == 0) || (rename(tmp, path) == -1)) {
+		unlink(tmp);
+		return -1;
+	}
+	printf("Warm manifest: %d inodes, %d cached blocks\n", header[1], header[2]);
+	return 0;
+}
+
+// Work for the warm start threads: byte offsets of blocks to pull into the page cache
+typedef struct __Warm_t {
+	off_t *offsets;
+	int count;
+	int *keys;          // cached blocks to decode into the data block cache at the end
+	int nkeys;
+} Warm_t;
+
+// One prefetch thread: preads every WARM_THREADS-th offset, starting at its own index
+void *warm_fetch(void *arg) {
+	Warm_t *warm = ((void **) arg)[0];
+	int first = (int) (long) ((void **) arg)[1];
+	char block[BLOCK_SIZE];
+	for (int i = first; i < warm->count; i += WARM_THREADS) {
+		pread(fs, block, BLOCK_SIZE, warm->offsets[i]);
+	}
+	return NULL;
+}
+
+// Runs the prefetch threads, then refills the data block cache under core_lock
+void *warm_run(void *arg) {
+	Warm_t *warm = (Warm_t *) arg;
+	long start = now_ms();
+	pthread_t threads[WARM_THREADS];
+	void *args[WARM_THREADS][2];
+	for (int i = 0; i < WARM_THREADS; i++) {
+		args[i][0] = warm;
+		args[i][1] = (void *) (long) i;
+		pthread_create(&threads[i], NULL, warm_fetch, args[i]);
+	}
+	for (int i = 0; i < WARM_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	// Least recently used first, so the cache ends up in the order it was saved in
+	char data[BLOCK_SIZE];
+	pthread_mutex_lock(&core_lock);
+	for (int i = warm->nkeys - 1; i >= 0; i--) {
+		int key = warm->keys[i];
+		if ((valid_ptr(key) == 1) && (valid_block(ptr_block(key)) == 1)) {
+			read_data(key, data);
+		}
+	}
+	pthread_mutex_unlock(&core_lock);
+	printf("Warm start: %d blocks prefetched, %d cached in %ld ms\n", warm->count, warm->nkeys, now_ms() - start);
+	free(warm->offsets);
+	free(warm->keys);
+	free(warm);
+	return NULL;
+}
+
+// Warm start: reads the bitmaps and inodes (and block checksums and slot maps) in one
+// sequential read, then prefetches the blocks named by [image].warm in the background.
+// The metadata read only fills the host page cache (the buffers are freed; the inodes
+// are used to find the hot inodes' blocks): every later metadata access is still a
+// read() of the image, just one that no longer waits on the disk
+void warm_start(char *image) {
+	if (lfs_mode == 1) {
+		return;
+	}
+	char *meta = malloc(BLOCK_START);
+	char *tail = malloc(SLOTMAP_START + NUM_BLOCKS - CSUM_START);
+	if ((meta == NULL) || (tail == NULL) || (pread(fs, meta, BLOCK_START, 0) != BLOCK_START)) {
+		free(meta);
+		free(tail);
+		return;
+	}
+	pread(fs, tail, SLOTMAP_START + NUM_BLOCKS - CSUM_START, CSUM_START);
+	free(tail);
+
+	char path[4096];
+	int header[3];
+	snprintf(path, sizeof(path), "%s.warm", image);
+	int fd = open(path, O_RDONLY);
+	if ((fd == -1) || (read(fd, header, sizeof(header)) != sizeof(header)) || (header[0] != WARM_MAGIC) ||
+		(header[1] < 0) || (header[1] > WARM_INODES) || (header[2] < 0) || (header[2] > CACHE_SETS * CACHE_WAYS)) {
+		if (fd != -1) {
+			close(fd);
+		}
+		free(meta);
+		return;
+	}
+	int inums[WARM_INODES];
+	Warm_t *warm = calloc(1, sizeof(Warm_t));
+	warm->keys = malloc(sizeof(int) * (header[2] + 1));
+	warm->offsets = malloc(sizeof(off_t) * ((header[1] * 10) + header[2] + 1));
+	read(fd, inums, header[1] * sizeof(int));
+	warm->nkeys = read(fd, warm->keys, header[2] * sizeof(int)) / (int) sizeof(int);
+	close(fd);
+
+	// Blocks (or inline records) of the hot inodes, taken from the inodes just read
+	for (int i = 0; i < header[1]; i++) {
+		int inum = inums[i];
+		if ((inum < 0) || (inum > NUM_INODES - 1) || (((meta[INODE_BITMAP_START + (inum / 8)] >> (inum % 8)) & 1) == 0)) {
+			continue;
+		}
+		int ptrs[10];
+		memcpy(ptrs, meta + INODE_START + (inum * INODE_SIZE) + INODE_OFFSET_PTR, sizeof(ptrs));
+		for (int j = 0; j < 10; j++) {
+			if ((j == 0) && (ptrs[j] == INODE_PTR_INLINE)) {
+				warm->offsets[warm->count++] = INLINE_START + (inum * INLINE_SIZE);
+			}
+			else if (valid_ptr(ptrs[j]) == 1) {
+				warm->offsets[warm->count++] = BLOCK_START + ((off_t) ptr_block(ptrs[j]) * BLOCK_SIZE);
+			}
+		}
+	}
+	for (int i = 0; i < warm->nkeys; i++) {
+		if (valid_ptr(warm->keys[i]) == 1) {
+			warm->offsets[warm->count++] = BLOCK_START + ((off_t) ptr_block(warm->keys[i]) * BLOCK_SIZE);
+		}
+	}
+	free(meta);
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, warm_run, warm);
+	pthread_detach(thread);
 }
 
 // Looks at inode at pinum for entry name, 
 // Returns inode number of entry or -1 if not found
 int fs_lookup(int pinum, char *name) {
+	if (lfs_mode == 1) {
+		return LFS_Lookup(pinum, name);
+	}
+	if (is_snap_inum(pinum) == 1) {
+		return snap_lookup(pinum, name);
+	}
 	// Check for valid pinum and if pinum is directory
 	if ((pinum < 0) || (pinum > NUM_INODES - 1)) {
 		return -1;
 	}
+	inode_hits[pinum]++;
 	if ((valid_inum(pinum) == 0) || (is_directory(pinum) == -1)) {
 		return -1;
 	}
@@ -328,13 +1112,11 @@ int fs_lookup(int pinum, char *name) {
 	for (int i = 0; i < 10; i++) {
 		lseek(fs, INODE_START + (pinum * INODE_SIZE) + INODE_OFFSET_PTR + (i * sizeof(int)), SEEK_SET);
 		status = read(fs, intbuffer, sizeof(int));
-		if (*blockid != -1) {
-			lseek(fs, BLOCK_START + (*blockid * BLOCK_SIZE), SEEK_SET);
-			status = read(fs, inodeintbuffer, sizeof(int));
-			status = read(fs, namebuffer, sizeof(char) * 252);
+		if ((*blockid >= 0) && (*blockid < NUM_BLOCKS)) {
+			*inodeid = read_dirent_block(*blockid, namebuffer);
 			printf("Namebuffer: %s\n", namebuffer);
 			// If found, return child inode number
-			if (strcmp(namebuffer, name) == 0) {
+			if ((*inodeid != -1) && (strcmp(namebuffer, name) == 0)) {
 				return *inodeid;
 			}
 		}
@@ -343,13 +1125,28 @@ int fs_lookup(int pinum, char *name) {
 	return -1;
 }
 
+// Returns end (in bytes) of the last block of inode inum waiting for delayed allocation, 0 if none
+int pending_end(int inum) {
+	if (pending[inum] == NULL) {
+		return 0;
+	}
+	return (32 - __builtin_clz(pending[inum]->mask)) * BLOCK_SIZE;
+}
+
 // Returns MFS_Stat_t linked to by inum. 
 // Returns 0 if success, -1 if failure (inum does not exist).
 int fs_stat(int inum, int *stat_type, int *stat_size, int *stat_blocks) {
+	if (lfs_mode == 1) {
+		return LFS_Stat(inum, stat_type, stat_size, stat_blocks);
+	}
+	if (is_snap_inum(inum) == 1) {
+		return snap_stat(inum, stat_type, stat_size, stat_blocks);
+	}
 	// Check for valid inum
 	if ((inum < 0) || (inum > NUM_INODES - 1)) {
 		return -1;
 	}
+	inode_hits[inum]++;
 	if (valid_inum(inum) == 0) {
 		return -1;
 	}
@@ -373,24 +1170,247 @@ int fs_stat(int inum, int *stat_type, int *stat_size, int *stat_blocks) {
 	*stat_blocks = *wrapper;
 	// printf("blocks: %d\n", *wrapper);
 
+	// Count blocks waiting for delayed allocation as written
+	if (pending[inum] != NULL) {
+		*stat_blocks += Popcount(&pending[inum]->mask, sizeof(int));
+		if (*stat_size < pending_end(inum)) {
+			*stat_size = pending_end(inum);
+		}
+	}
+
 	// printf("m->type: %d\n", m->type);
 	// printf("m->size: %d\n", m->size);
 	// printf("m->blocks: %d\n", m->blocks);
 	return 0;
 }
 
-// Writes block of 4096 bytes at block# block in inode inum. 
-// Returns 0 if success, -1 if failure (invalid inum, invalid block, directory inum)
-int fs_write(int inum, char *buffer, int block) {
-	// Check for valid inum and valid file and valid block
-	if ((inum < 0) || (inum > NUM_INODES - 1)) {
-		printf("Real basic\n");
+// Checks if block data can be stored inline (all bytes past INLINE_SIZE are 0)
+// Returns 1 if it fits, 0 if not
+int fits_inline(char *data) {
+	for (int i = INLINE_SIZE; i < BLOCK_SIZE; i++) {
+		if (data[i] != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Moves inline block 0 of inode inum out to a newly allocated data block
+// Returns 0 if success, -1 if failure (no free block)
+int move_inline_to_block(int inum) {
+	char data[BLOCK_SIZE];
+	memset(data, 0, BLOCK_SIZE);
+	lseek(fs, INLINE_START + (inum * INLINE_SIZE), SEEK_SET);
+	int status = read(fs, data, INLINE_SIZE);
+	if (status < 0) {
 		return -1;
 	}
-	if ((valid_inum(inum) == 0) || (is_directory(inum) == 0)) {
+
+	int newblockid = store_data_block(data);
+	if (newblockid == -1) {
+		return -1;
+	}
+
+	// Relink block 0 only after its data is in place
+	status = meta_write((void *) &newblockid, sizeof(int), INODE_START + (inum * INODE_SIZE) + INODE_OFFSET_PTR);
+	if (status < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+// Searches through block bitmap for n consecutive free blocks
+// Returns first block number of the run, -1 if none found
+int find_free_run(int n) {
+	int run = 0;
+	for (int i = 0; i < NUM_BLOCKS; i++) {
+		if ((valid_block(i) == 0) && (((snap_blocks[i / 8] >> (i % 8)) & 1) == 0)) {
+			run++;
+			if (run == n) {
+				return i - n + 1;
+			}
+		}
+		else {
+			run = 0;
+		}
+	}
+	return -1;
+}
+
+// Writes the pending blocks of inode inum to disk and links them into the inode
+// Returns 0 if success, -1 if failure (blocks that didn't make it stay pending)
+int delalloc_flush_inode(int inum) {
+	Pending_t *p = pending[inum];
+	if (p == NULL) {
+		return 0;
+	}
+	int inode[INODE_SIZE / sizeof(int)];
+	if (pread(fs, inode, INODE_SIZE, INODE_START + (inum * INODE_SIZE)) != INODE_SIZE) {
+		return -1;
+	}
+	int *ptrs = inode + (INODE_OFFSET_PTR / sizeof(int));
+	int blocks[10];
+	int n = 0;
+	for (int i = 0; i < 10; i++) {
+		if ((p->mask >> i) & 1) {
+			blocks[n++] = i;
+		}
+	}
+
+	int done = 0;
+	int status = 0;
+	if ((n == 1) && (blocks[0] == 0) && (inode[INODE_OFFSET_NUM_B / sizeof(int)] == 0) && (fits_inline(p->data[0]) == 1)) {
+		// A file of one small block goes inline, as in fs_write
+		if (pwrite(fs, p->data[0], INLINE_SIZE, INLINE_START + (inum * INLINE_SIZE)) != INLINE_SIZE) {
+			return -1;
+		}
+		ptrs[0] = INODE_PTR_INLINE;
+		done = 1;
+	}
+	else {
+		if (ptrs[0] == INODE_PTR_INLINE) {
+			if (move_inline_to_block(inum) < 0) {
+				return -1;
+			}
+			pread(fs, &ptrs[0], sizeof(int), INODE_START + (inum * INODE_SIZE) + INODE_OFFSET_PTR);
+		}
+
+		// Whole burst in one run of blocks; dedup and compression place blocks one by one
+		int start = ((dedup_mode == 0) && (compress_mode == 0)) ? find_free_run(n) : -1;
+		if (start != -1) {
+			struct iovec iov[10];
+			unsigned int crc[10];
+			for (int j = 0; j < n; j++) {
+				iov[j].iov_base = p->data[blocks[j]];
+				iov[j].iov_len = BLOCK_SIZE;
+				crc[j] = CRC32C(0, p->data[blocks[j]], BLOCK_SIZE);
+				set_block_bitmap(start + j, 1);
+			}
+			if ((pwritev(fs, iov, n, BLOCK_START + ((off_t) start * BLOCK_SIZE)) != n * BLOCK_SIZE) ||
+			    (pwrite(fs, crc, n * sizeof(int), CSUM_START + (start * sizeof(int))) != (ssize_t) (n * sizeof(int)))) {
+				for (int j = 0; j < n; j++) {
+					set_block_bitmap(start + j, 0);
+				}
+				return -1;
+			}
+			for (int j = 0; j < n; j++) {
+				ptrs[blocks[j]] = start + j;
+				Cache_Put(start + j, p->data[blocks[j]]);
+			}
+			done = n;
+		}
+		else {
+			for (done = 0; done < n; done++) {
+				int ptr = store_data_block(p->data[blocks[done]]);
+				if (ptr == -1) {
+					status = -1;
+					break;
+				}
+				ptrs[blocks[done]] = ptr;
+			}
+		}
+	}
+
+	// One write for size, block count and pointers
+	inode[INODE_OFFSET_NUM_B / sizeof(int)] += done;
+	for (int j = 0; j < done; j++) {
+		if (inode[INODE_OFFSET_SIZE / sizeof(int)] < (blocks[j] + 1) * BLOCK_SIZE) {
+			inode[INODE_OFFSET_SIZE / sizeof(int)] = (blocks[j] + 1) * BLOCK_SIZE;
+		}
+	}
+	if (meta_write(inode + 1, INODE_SIZE - sizeof(int), INODE_START + (inum * INODE_SIZE) + INODE_OFFSET_SIZE) < 0) {
+		return -1;
+	}
+	for (int j = 0; j < done; j++) {
+		p->mask &= ~(1 << blocks[j]);
+	}
+	pending_blocks -= done;
+	if (p->mask == 0) {
+		free(p);
+		pending[inum] = NULL;
+	}
+	return status;
+}
+
+// Flushes the pending blocks of every inode
+// Returns 0 if success, -1 if failure
+int delalloc_flush() {
+	int status = 0;
+	for (int inum = 0; (inum < NUM_INODES) && (pending_blocks > 0); inum++) {
+		status |= delalloc_flush_inode(inum);
+	}
+	return status;
+}
+
+// Flushes the pending blocks once the oldest has waited DELALLOC_AGE_MS. Checked after
+// every request, so reads alone cannot hold back writes that were acked long ago
+// Returns 1 if it flushed, 0 if not
+int delalloc_expire() {
+	if ((pending_blocks == 0) || (now_ms() - pending_since < DELALLOC_AGE_MS)) {
+		return 0;
+	}
+	delalloc_flush();
+	return 1;
+}
+
+// Forgets the pending blocks of inode inum, which is going away
+void delalloc_discard(int inum) {
+	if (pending[inum] == NULL) {
+		return;
+	}
+	pending_blocks -= Popcount(&pending[inum]->mask, sizeof(int));
+	free(pending[inum]);
+	pending[inum] = NULL;
+}
+
+// Holds data as block# block of inode inum until the next flush
+// Returns 0 if success, -1 if failure (block already written, no space)
+int delalloc_write(int inum, char *data, int block) {
+	if ((pending[inum] != NULL) && ((pending[inum]->mask >> block) & 1)) {
+		return -1;
+	}
+	if ((pending_blocks >= DELALLOC_MAX_BLOCKS) || (pending_blocks >= free_blocks)) {
+		delalloc_flush();
+	}
+	delalloc_expire();
+	// Every pending block must still find a block at flush time
+	if (pending_blocks >= free_blocks) {
+		return -1;
+	}
+	if (pending[inum] == NULL) {
+		pending[inum] = calloc(1, sizeof(Pending_t));
+		if (pending[inum] == NULL) {
+			return -1;
+		}
+	}
+	if (pending_blocks == 0) {
+		pending_since = now_ms();
+	}
+	memcpy(pending[inum]->data[block], data, BLOCK_SIZE);
+	pending[inum]->mask |= 1 << block;
+	pending_blocks++;
+	return 0;
+}
+
+// Writes block of 4096 bytes at block# block in inode inum. 
+// Returns 0 if success, -1 if failure (invalid inum, invalid block, directory inum)
+int fs_write(int inum, char *buffer, int block) {
+	if (lfs_mode == 1) {
+		return LFS_Write(inum, buffer, block);
+	}
+	// Check for valid inum and valid file and valid block
+	if ((inum < 0) || (inum > NUM_INODES - 1)) {
+		printf("Real basic\n");
+		return -1;
+	}
+	inode_hits[inum]++;
+	if ((valid_inum(inum) == 0) || (is_directory(inum) == 0)) {
 		printf("Basic\n");
 		return -1;
 	}
+	if ((block < 0) || (block > 9) || (buffer == NULL)) {
+		return -1;
+	}
 	// Check for valid block entry in inum inode
 	char *reader = malloc(sizeof(int));
 	int *blockstatus = (int *) reader;
@@ -401,41 +1421,65 @@ int fs_write(int inum, char *buffer, int block) {
 		return -1;
 	}
 
-	// Create new block (search bitmap for free block)
-	int newblockid = find_free_block();
-	set_block_bitmap(newblockid, 1);
+	// Data arrives as a string, so pad the rest of the block with 0
+	char data[BLOCK_SIZE];
+	strncpy(data, buffer, BLOCK_SIZE);
+	if (delalloc_mode == 1) {
+		return delalloc_write(inum, data, block);
+	}
 
-	// Read buffer into block
-	lseek(fs, BLOCK_START + (newblockid * BLOCK_SIZE), SEEK_SET);
-	status = write(fs, buffer, BUFFER_SIZE);
-	if (status < 0) {
-		printf("Failed here\n");
-		return -1;
+	lseek(fs, INODE_START + (inum * INODE_SIZE) + INODE_OFFSET_NUM_B, SEEK_SET);
+	status = read(fs, reader, sizeof(int));
+	int numblocks = *blockstatus;
+
+	int newblockid;
+	if ((block == 0) && (numblocks == 0) && (fits_inline(data) == 1)) {
+		// Small first block goes into the inode's inline record instead of a data block
+		lseek(fs, INLINE_START + (inum * INLINE_SIZE), SEEK_SET);
+		status = write(fs, data, INLINE_SIZE);
+		if (status < 0) {
+			return -1;
+		}
+		newblockid = INODE_PTR_INLINE;
+	}
+	else {
+		// File is growing past its inline block, move it out to a data block first
+		lseek(fs, INODE_START + (inum * INODE_SIZE) + INODE_OFFSET_PTR, SEEK_SET);
+		status = read(fs, reader, sizeof(int));
+		if ((*blockstatus == INODE_PTR_INLINE) && (move_inline_to_block(inum) < 0)) {
+			return -1;
+		}
+
+		// Read buffer into block (shared with an identical block in dedup mode)
+		newblockid = store_data_block(data);
+		if (newblockid == -1) {
+			printf("Failed here\n");
+			return -1;
+		}
 	}
 	// Link block to inum inode
-	lseek(fs, INODE_START + (inum * INODE_SIZE) + INODE_OFFSET_PTR + (sizeof(int) * block), SEEK_SET);
-	status = write(fs, (void *) &newblockid, sizeof(int));
+	status = meta_write((void *) &newblockid, sizeof(int), INODE_START + (inum * INODE_SIZE) + INODE_OFFSET_PTR + (sizeof(int) * block));
 	if (status < 0) {
 		printf("Failed there\n");
 		return -1;
 	}
 
 	// Update inum inode metadata
-	lseek(fs, INODE_START + (inum * INODE_SIZE) + INODE_OFFSET_NUM_B, SEEK_SET);
-	status = read(fs, reader, sizeof(int));
+	*blockstatus = numblocks;
 	printf("Old num-b: %d\n", *blockstatus);
 	*blockstatus += 1;
 	printf("New num-b: %d\n", *blockstatus);
-	lseek(fs, INODE_START + (inum * INODE_SIZE) + INODE_OFFSET_NUM_B, SEEK_SET);
-	status = write(fs, reader, sizeof(int));
+	status = meta_write(reader, sizeof(int), INODE_START + (inum * INODE_SIZE) + INODE_OFFSET_NUM_B);
 
+	// Size runs to the end of the last block, earlier blocks never written are holes
 	lseek(fs, INODE_START + (inum * INODE_SIZE) + INODE_OFFSET_SIZE, SEEK_SET);
 	status = read(fs, reader, sizeof(int));
 	printf("Old size: %d\n", *blockstatus);
-	*blockstatus += BLOCK_SIZE;
+	if (*blockstatus < (block + 1) * BLOCK_SIZE) {
+		*blockstatus = (block + 1) * BLOCK_SIZE;
+	}
 	printf("New size: %d\n", *blockstatus);
-	lseek(fs, INODE_START + (inum * INODE_SIZE) + INODE_OFFSET_SIZE, SEEK_SET);
-	status = write(fs, reader, sizeof(int));
+	status = meta_write(reader, sizeof(int), INODE_START + (inum * INODE_SIZE) + INODE_OFFSET_SIZE);
 
 
 	return 0;
@@ -444,16 +1488,28 @@ int fs_write(int inum, char *buffer, int block) {
 // Reads block# block into buffer at inode inum. If inum is directory, return MFS_DirEnt_t in buffer
 // Returns 0 if success, -1 if failure (invalid inum, invalid block)
 int fs_read(int inum, char *buffer, int block) {
+	if (lfs_mode == 1) {
+		return LFS_Read(inum, buffer, block);
+	}
+	if (is_snap_inum(inum) == 1) {
+		return snap_read(inum, buffer, block);
+	}
 	// Check for valid inum and block number
 	if ((inum < 0) || (inum > NUM_INODES - 1)) {
 		return -1;
 	}
+	inode_hits[inum]++;
 	if (valid_inum(inum) == 0) {
 		return -1;
 	}
 	if ((block < 0) || (block > 9)) {
 		return -1;
 	}
+	// Blocks waiting for delayed allocation are read from memory
+	if ((pending[inum] != NULL) && ((pending[inum]->mask >> block) & 1)) {
+		memcpy(buffer, pending[inum]->data[block], BLOCK_SIZE);
+		return 0;
+	}
 	// Check for valid block
 	int status;
 	char *readint = malloc(sizeof(int));
@@ -461,198 +1517,973 @@ int fs_read(int inum, char *buffer, int block) {
 	lseek(fs, INODE_START + (inum * INODE_SIZE) + INODE_OFFSET_PTR + (block * sizeof(int)), SEEK_SET);
 	status = read(fs, readint, sizeof(int));
 	if (*wrapper == -1) {
+		// A hole (block never written, or punched) before the end of a file reads as zeros
+		int size = inode_field(inum, INODE_OFFSET_SIZE);
+		size = (size > pending_end(inum)) ? size : pending_end(inum);
+		if ((is_directory(inum) == -1) && (size >= (block + 1) * BLOCK_SIZE)) {
+			memset(buffer, 0, BLOCK_SIZE);
+			return 0;
+		}
 		return -1;
 	}
 
-	if (valid_block(*wrapper) == 0) {
-		return -1;
+	// Inline block 0 is read from the inode's inline record
+	if (*wrapper == INODE_PTR_INLINE) {
+		memset(buffer, 0, BLOCK_SIZE);
+		lseek(fs, INLINE_START + (inum * INLINE_SIZE), SEEK_SET);
+		status = read(fs, buffer, INLINE_SIZE);
+		return 0;
 	}
 
-	// Read block into buffer
-	lseek(fs, BLOCK_START + (*wrapper * BLOCK_SIZE), SEEK_SET);
-	status = read(fs, buffer, BLOCK_SIZE);
+	if ((valid_ptr(*wrapper) == 0) || (valid_block(ptr_block(*wrapper)) == 0)) {
+		return -1;
+	}
 
-	return 0;
+	// Read block into buffer (decompressed if packed)
+	return read_data(*wrapper, buffer);
 }
 
-// Creates new file/directory in inode pinum with name name. 
-// Returns 0 if success, -1 if failure (pinum does not exist)
-int fs_creat(int pinum, int type, char *name) {
-	// Check if pinum is valid in bitmap and is a directory
-	if ((pinum < 0) || (pinum > NUM_INODES - 1)) {
+// Deallocates blocks block .. block + count - 1 of file inum; they read as zeros after,
+// and the file keeps its size. Blocks nothing else holds go back to the host.
+// Returns 0 if success, -1 if failure (invalid inum, directory inum, invalid range)
+int fs_punch(int inum, int block, int count) {
+	if (lfs_mode == 1) {
+		return LFS_Punch(inum, block, count);
+	}
+	if ((inum < 0) || (inum > NUM_INODES - 1)) {
 		return -1;
 	}
-	if ((valid_inum(pinum) == 0) || (is_directory(pinum) == -1)) {
+	if ((valid_inum(inum) == 0) || (is_directory(inum) == 0)) {
+		return -1;
+	}
+	// count > 10 - block rather than block + count > 10, which can overflow
+	if ((block < 0) || (count < 1) || (count > 10 - block)) {
+		return -1;
+	}
+	inode_hits[inum]++;
+	int inode[INODE_SIZE / sizeof(int)];
+	if (pread(fs, inode, INODE_SIZE, INODE_START + (inum * INODE_SIZE)) != INODE_SIZE) {
+		return -1;
+	}
+	int *ptrs = inode + (INODE_OFFSET_PTR / sizeof(int));
+	for (int i = block; i < block + count; i++) {
+		// Blocks waiting for delayed allocation never get one
+		if ((pending[inum] != NULL) && ((pending[inum]->mask >> i) & 1)) {
+			pending[inum]->mask &= ~(1 << i);
+			pending_blocks--;
+		}
+		if (ptrs[i] == -1) {
+			continue;
+		}
+		if (dedup_mode == 1) {
+			release_data_block(ptrs[i]);
+		}
+		else if (valid_ptr(ptrs[i]) == 1) {
+			free_data_ptr(ptrs[i]);
+		}
+		ptrs[i] = -1;
+		inode[INODE_OFFSET_NUM_B / sizeof(int)]--;
+	}
+	if ((pending[inum] != NULL) && (pending[inum]->mask == 0)) {
+		free(pending[inum]);
+		pending[inum] = NULL;
+	}
+	if (meta_write(inode, INODE_SIZE, INODE_START + (inum * INODE_SIZE)) != INODE_SIZE) {
 		return -1;
 	}
+	return 0;
+}
 
-	// Find free data block entry in pinum
-	int status;
-	char *readint = malloc(sizeof(int));
-	int *wrapper = (int *) readint;
-	int free_entry = -1;
+// Finds unused data block pointer in directory pinum
+// Returns pointer slot (0-9), -1 if directory is full
+int find_free_entry(int pinum) {
+	int ptrs[10];
+	lseek(fs, INODE_START + (pinum * INODE_SIZE) + INODE_OFFSET_PTR, SEEK_SET);
+	read(fs, ptrs, sizeof(ptrs));
 	for (int i = 0; i < 10; i++) {
-		lseek(fs, INODE_START + (pinum * INODE_SIZE) + INODE_OFFSET_PTR + (i * sizeof(int)), SEEK_SET);
-		status = read(fs, readint, sizeof(int));
-		if (*wrapper == -1) {
-			free_entry = i;
-			break;
+		if (ptrs[i] == -1) {
+			return i;
 		}
 	}
-	printf("FREE ENTRY AT: %d\n", free_entry);
-	
-	// Check if free data block entry was found in pinum
-	if (free_entry == -1) {
+	return -1;
+}
+
+// Creates new file/directory inode that no directory names yet. A directory gets
+// "." and ".." entries, ".." naming parent (a global inum, possibly on another shard).
+// Returns new local inum if success, -1 if failure (no free inode)
+int fs_mknod(int type, int parent) {
+	if (lfs_mode == 1) {
+		return LFS_Mknod(type, parent);
+	}
+	if ((type != MFS_DIRECTORY) && (type != MFS_REGULAR_FILE)) {
 		return -1;
 	}
-
-	// Create new inode for new file/directory
 	int newinum = find_free_inode();
-	set_inode_bitmap(newinum, 1);
-	lseek(fs, INODE_START + (newinum * INODE_SIZE), SEEK_SET);
-	char *intwriter = malloc(sizeof(int));
-	wrapper = (int *)intwriter;
-	*wrapper = type;
-	status = write(fs, intwriter, 4);	// write type
-	*wrapper = 0;
-	lseek(fs, INODE_START + (newinum * INODE_SIZE) + INODE_OFFSET_SIZE, SEEK_SET);
-	status = write(fs, intwriter, 4); // write size = 0
-	*wrapper = 0;
-	lseek(fs, INODE_START + (newinum * INODE_SIZE) + INODE_OFFSET_NUM_B, SEEK_SET);
-	status = write(fs, intwriter, 4); // write num blocks = 0
-	
-	// Fill data block pointers of new inode with -1 to indicate unused
-	*wrapper = -1;
-	for (int i = 0; i < 10; i++) {
-		write(fs, intwriter, 4);
+	if (newinum == -1) {
+		return -1;
 	}
-	
-	// Create new file/directory name entry in new data block (search bitmap for free block)
-	int newblockid = find_free_block();
-	set_block_bitmap(newblockid, 1);
-	lseek(fs, BLOCK_START + (newblockid * BLOCK_SIZE), SEEK_SET);
-	*wrapper = newinum;
-	status = write(fs, intwriter, 4);
-	status = write(fs, name, 252);
 
-	// Link inode-name data block to pinum inode
-	*wrapper = newblockid;
-	lseek(fs, INODE_START + (pinum * INODE_SIZE) + INODE_OFFSET_PTR + (free_entry * sizeof(int)), SEEK_SET);
-	status = write(fs, intwriter, 4);
+	// Type, size 0, no blocks, all data block pointers unused
+	int inode[13];
+	inode[0] = type;
+	inode[1] = 0;
+	inode[2] = 0;
+	for (int i = 0; i < 10; i++) {
+		inode[3 + i] = -1;
+	}
 
-	// If new inode is directory, add "." and ".." directories to data blocks of new inode
-	if (type == 0) {
-		// Add "." and ".." directories in new inode
-		newblockid = find_free_block();
+	// Add "." and ".." entries to a new directory
+	if (type == MFS_DIRECTORY) {
+		int newblockid = find_free_block();
 		set_block_bitmap(newblockid, 1);
-		lseek(fs, BLOCK_START + (newblockid * BLOCK_SIZE), SEEK_SET);
-		*wrapper = newinum;
-		status = write(fs, intwriter, 4);
-		status = write(fs, ".", 252);
+		write_dirent_block(newblockid, global_inum(newinum), ".");
+		inode[3] = newblockid;
 
 		newblockid = find_free_block();
 		set_block_bitmap(newblockid, 1);
-		lseek(fs, BLOCK_START + (newblockid * BLOCK_SIZE), SEEK_SET);
-		*wrapper = pinum;
-		status = write(fs, intwriter, 4);
-		status = write(fs, "..", 252);
-
-		// Update new inode metadata
-		lseek(fs, INODE_START + (newinum * INODE_SIZE), SEEK_SET);
-		*wrapper = type;
-		status = write(fs, intwriter, 4);	// write type
-		*wrapper = 512;
-		status = write(fs, intwriter, 4); // write size = 512
-		*wrapper = 1;
-		status = write(fs, intwriter, 4); // write num blocks = 1
-	}
-	
-	// Update number of blocks field in pinum inode
-	// lseek(fs, INODE_START + (pinum * INODE_SIZE) + INODE_OFFSET_NUM_B, SEEK_SET);
-	// status = read(fs, intwriter, 4);
-	// *wrapper += 1;
-	// lseek(fs, INODE_START + (pinum * INODE_SIZE) + INODE_OFFSET_NUM_B, SEEK_SET);
-	// status = write(fs, intwriter, 4); 
+		write_dirent_block(newblockid, parent, "..");
+		inode[4] = newblockid;
 
-	// Update size of pinum inode
-	lseek(fs, INODE_START + (pinum * INODE_SIZE) + INODE_OFFSET_SIZE, SEEK_SET);
-	status = read(fs, intwriter, 4);
-	*wrapper += 256;
-	lseek(fs, INODE_START + (pinum * INODE_SIZE) + INODE_OFFSET_SIZE, SEEK_SET);
-	status = write(fs, intwriter, 4);
+		inode[1] = 512;
+		inode[2] = 1;
+	}
 
-	return 0;
+	int status = meta_write(inode, INODE_SIZE, INODE_START + (newinum * INODE_SIZE));
+	if (status < 0) {
+		return -1;
+	}
+	set_inode_bitmap(newinum, 1);
+	return newinum;
 }
 
-// Removes file/directory name from directory at pinum. Does not delete any blocks.
-// Returns 0 if success, -1 if failure (invalid pinum, pinum is not directory, removed directory is not empty)
-int fs_unlink(int pinum, char *name) {
-	// Check if pinum is valid in bitmap and if pinum is directory
-	if ((pinum < 0) || (pinum > NUM_INODES - 1)) {
+// Adds entry name for inode inum (a global inum, possibly on another shard) to directory pinum
+// Returns 0 if success, -1 if failure (pinum does not exist or is full)
+int fs_link(int pinum, int inum, char *name) {
+	if (lfs_mode == 1) {
+		return LFS_Link(pinum, inum, name);
+	}
+	if ((pinum < 0) || (pinum > NUM_INODES - 1) || (name == NULL)) {
 		return -1;
 	}
 	if ((valid_inum(pinum) == 0) || (is_directory(pinum) == -1)) {
 		return -1;
 	}
-	// Search for name (if not found, return 0)
-	int blockid = fs_lookup(pinum, name);
-	lseek(fs, BLOCK_START + (blockid * BLOCK_SIZE), SEEK_SET);
-	if (blockid == -1) {
-		return 0;
+	int free_entry = find_free_entry(pinum);
+	printf("FREE ENTRY AT: %d\n", free_entry);
+	if (free_entry == -1) {
+		return -1;
 	}
 
-	// Get inum associated with name from blockid
-	char *intbuffer = malloc(sizeof(int));
-	int *inum = (int *) intbuffer;
-	int status = read(fs, intbuffer, sizeof(int));
+	// Create name entry in new data block and link it to pinum inode
+	int newblockid = find_free_block();
+	set_block_bitmap(newblockid, 1);
+	int status = write_dirent_block(newblockid, inum, name);
+	status = meta_write(&newblockid, sizeof(int), INODE_START + (pinum * INODE_SIZE) + INODE_OFFSET_PTR + (free_entry * sizeof(int)));
 
-	// Check if name's inode is empty directory
-	char *intreader = malloc(sizeof(int));
-	int *numblocks = (int *) intreader;
-	if (is_directory(*inum) == 0) {
-		lseek(fs, INODE_START + (*inum * INODE_SIZE) + INODE_OFFSET_NUM_B, SEEK_SET);
-		status = read(fs, intreader, sizeof(int));
-		if (*numblocks > 2) {
+	// Update size of pinum inode
+	int size;
+	lseek(fs, INODE_START + (pinum * INODE_SIZE) + INODE_OFFSET_SIZE, SEEK_SET);
+	status = read(fs, &size, sizeof(int));
+	size += 256;
+	status = meta_write(&size, sizeof(int), INODE_START + (pinum * INODE_SIZE) + INODE_OFFSET_SIZE);
+	if (status < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+// Frees inode inum. Does not delete any blocks, except that in dedup mode a file's
+// data blocks lose a reference (and are freed at 0).
+// Returns 0 if success, -1 if failure (inum does not exist, inum is a non-empty directory)
+int fs_drop(int inum) {
+	if (lfs_mode == 1) {
+		return LFS_Drop(inum);
+	}
+	if ((inum < 1) || (inum > NUM_INODES - 1) || (valid_inum(inum) == 0)) {
+		return -1;
+	}
+
+	// Directories must be empty (only "." and ".." left)
+	int size;
+	int status;
+	if (is_directory(inum) == 0) {
+		lseek(fs, INODE_START + (inum * INODE_SIZE) + INODE_OFFSET_SIZE, SEEK_SET);
+		status = read(fs, &size, sizeof(int));
+		if (size > 512) {
 			return -1;
 		}
 	}
+	else if (dedup_mode == 1) {
+		// Drop the file's references to its data blocks
+		int ptrs[10];
+		lseek(fs, INODE_START + (inum * INODE_SIZE) + INODE_OFFSET_PTR, SEEK_SET);
+		status = read(fs, ptrs, sizeof(ptrs));
+		for (int i = 0; i < 10; i++) {
+			release_data_block(ptrs[i]);
+		}
+	}
 	
 	// Remove inode inum from inode map
-	set_inode_bitmap(*inum, 0);
+	delalloc_discard(inum);
+	return set_inode_bitmap(inum, 0);
+}
 
-	// Remove inode entry from directory
-	for (int i = 0; i < 10; i++) {
-		lseek(fs, INODE_START + (pinum * INODE_SIZE) + INODE_OFFSET_PTR + (i * sizeof(int)), SEEK_SET);
-		status = read(fs, intbuffer, sizeof(int));
-		if (*inum == blockid) {
-			printf("Killing entry %d\n", i);
-			lseek(fs, INODE_START + (pinum * INODE_SIZE) + INODE_OFFSET_PTR + (i * sizeof(int)), SEEK_SET);
-			*numblocks = -1;
-			status = write(fs, intreader, sizeof(int));
-			break;
-		}
+// Creates new file/directory in inode pinum with name name. 
+// Returns 0 if success, -1 if failure (pinum does not exist)
+int fs_creat(int pinum, int type, char *name) {
+	if (lfs_mode == 1) {
+		return LFS_Creat(pinum, type, name);
+	}
+	// Check if pinum is valid in bitmap and is a directory
+	if ((pinum < 0) || (pinum > NUM_INODES - 1)) {
+		return -1;
+	}
+	if ((valid_inum(pinum) == 0) || (is_directory(pinum) == -1)) {
+		return -1;
+	}
+	
+	// Check for free data block entry in pinum before taking an inode
+	if (find_free_entry(pinum) == -1) {
+		return -1;
 	}
 
-	// Adjust pinum metrics
-	lseek(fs, INODE_START + (pinum * INODE_SIZE) + INODE_OFFSET_SIZE, SEEK_SET);
-	status = read(fs, intreader, sizeof(int));
-	printf("Old size: %d\n", *numblocks);
-	*numblocks -= 256;
-	printf("New size: %d\n", *numblocks);
-	lseek(fs, INODE_START + (pinum * INODE_SIZE) + INODE_OFFSET_SIZE, SEEK_SET);
-	status = write(fs, intreader, sizeof(int));
-
-	return 0;
+	// Create new inode for new file/directory and name it in pinum
+	int newinum = fs_mknod(type, global_inum(pinum));
+	if (newinum == -1) {
+		return -1;
+	}
+	return fs_link(pinum, global_inum(newinum), name);
 }
 
+// Searches directory pinum for entry name
+// Returns pointer slot (0-9) holding the entry and sets *inum to its inode number, -1 if not found
+int find_entry(int pinum, char *name, int *inum) {
+	int ptrs[10];
+	char entry[252];
+	lseek(fs, INODE_START + (pinum * INODE_SIZE) + INODE_OFFSET_PTR, SEEK_SET);
+	read(fs, ptrs, sizeof(ptrs));
+	for (int i = 0; i < 10; i++) {
+		if ((ptrs[i] < 0) || (ptrs[i] > NUM_BLOCKS - 1)) {
+			continue;
+		}
+		int child = read_dirent_block(ptrs[i], entry);
+		if ((child != -1) && (strcmp(entry, name) == 0)) {
+			*inum = child;
+			return i;
+		}
+	}
+	return -1;
+}
 
-// Command parser 
-// Takes command string from client and executes correct subroutine
-// Command string will be in format: "[command] [arg1] [arg2] [arg3]"
-int parser(char *command, int *stat1, int *stat2, int *stat3, int *is_read, char *read_buffer) {
-	char *cmd, *arg1, *arg2, *arg3;
-	int pinum, inum, type, block, result;
-	cmd = strtok(command, " ");
+// Removes file/directory name from directory at pinum and frees its inode (see fs_drop).
+// An entry naming an inode on another shard is only removed; the client drops the inode there.
+// Returns 0 if success, -1 if failure (invalid pinum, pinum is not directory, removed directory is not empty)
+int fs_unlink(int pinum, char *name) {
+	if (lfs_mode == 1) {
+		return LFS_Unlink(pinum, name);
+	}
+	// Check if pinum is valid in bitmap and if pinum is directory
+	if ((pinum < 0) || (pinum > NUM_INODES - 1)) {
+		return -1;
+	}
+	if ((valid_inum(pinum) == 0) || (is_directory(pinum) == -1)) {
+		return -1;
+	}
+	if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) {
+		return -1;
+	}
+	// Search for name (if not found, return 0)
+	int inum;
+	int slot = find_entry(pinum, name, &inum);
+	if (slot == -1) {
+		return 0;
+	}
+	inum = local_inum(inum);
+
+	// Free name's inode first, a non-empty directory stays
+	if ((inum != -1) && (fs_drop(inum) == -1)) {
+		return -1;
+	}
+
+	// Remove inode entry from directory
+	printf("Killing entry %d\n", slot);
+	int value = -1;
+	int status;
+	status = meta_write(&value, sizeof(int), INODE_START + (pinum * INODE_SIZE) + INODE_OFFSET_PTR + (slot * sizeof(int)));
+
+	// Adjust pinum metrics
+	lseek(fs, INODE_START + (pinum * INODE_SIZE) + INODE_OFFSET_SIZE, SEEK_SET);
+	status = read(fs, &value, sizeof(int));
+	printf("Old size: %d\n", value);
+	value -= 256;
+	printf("New size: %d\n", value);
+	status = meta_write(&value, sizeof(int), INODE_START + (pinum * INODE_SIZE) + INODE_OFFSET_SIZE);
+
+	return 0;
+}
+
+// Reads the entry in directory entry block blocknum, verifying the block's checksum
+// Returns inum of the entry, name (252 bytes) filled in; -1 if failure (checksum mismatch)
+int read_dirent_block(int blocknum, char *name) {
+	char entry[BLOCK_SIZE];
+	int inum;
+	name[0] = '\0';
+	if (read_block(blocknum, entry) < 0) {
+		return -1;
+	}
+	memcpy(&inum, entry, sizeof(int));
+	memcpy(name, entry + sizeof(int), 252);
+	name[251] = '\0';
+	return inum;
+}
+
+// Reads int field at offset of inode inum
+int inode_field(int inum, int offset) {
+	int value = -1;
+	lseek(fs, INODE_START + (inum * INODE_SIZE) + offset, SEEK_SET);
+	read(fs, &value, sizeof(int));
+	return value;
+}
+
+// Writes int field at offset of inode inum
+// Returns 0 if success, -1 if failure
+int set_inode_field(int inum, int offset, int value) {
+	return (meta_write(&value, sizeof(int), INODE_START + (inum * INODE_SIZE) + offset) == sizeof(int)) ? 0 : -1;
+}
+
+// Applies rename intent in (again, if a crash cut it short)
+// Returns 0 if success, -1 if failure
+int rename_apply(Rename_Intent_t *in) {
+	int status = 0;
+	set_block_bitmap(in->block, 1);
+	status |= write_dirent_block(in->block, in->inum, in->name);
+	status |= set_inode_field(in->dstp, INODE_OFFSET_PTR + (in->dstslot * sizeof(int)), in->block);
+	if ((in->srcp != in->dstp) || (in->srcslot != in->dstslot)) {
+		status |= set_inode_field(in->srcp, INODE_OFFSET_PTR + (in->srcslot * sizeof(int)), -1);
+	}
+	status |= set_inode_field(in->srcp, INODE_OFFSET_SIZE, in->srcsize);
+	status |= set_inode_field(in->dstp, INODE_OFFSET_SIZE, in->dstsize);
+	if (in->child != -1) {
+		set_block_bitmap(in->dotdot, 1);
+		status |= write_dirent_block(in->dotdot, global_inum(in->dstp), "..");
+		status |= set_inode_field(in->child, INODE_OFFSET_PTR + sizeof(int), in->dotdot);
+	}
+	for (int i = 0; i < 3; i++) {
+		if (in->freed[i] != -1) {
+			set_block_bitmap(in->freed[i], 0);
+		}
+	}
+	if ((in->dropped != -1) && (valid_inum(in->dropped) == 1)) {
+		status |= fs_drop(in->dropped);
+	}
+	return (status == 0) ? 0 : -1;
+}
+
+// Writes rename intent in (or clears it, in == NULL) and syncs it
+// Returns 0 if success, -1 if failure
+int rename_log(Rename_Intent_t *in) {
+	Rename_Intent_t none;
+	if (in == NULL) {
+		memset(&none, 0, sizeof(none));
+		in = &none;
+	}
+	in->crc = CRC32C(0, in, sizeof(Rename_Intent_t) - sizeof(int));
+	lseek(fs, INTENT_START, SEEK_SET);
+	if (write(fs, in, sizeof(Rename_Intent_t)) != sizeof(Rename_Intent_t)) {
+		return -1;
+	}
+	return fsync(fs);
+}
+
+// Finishes a rename that was in progress when the server stopped. A record that fails
+// its checksum was cut short while it was written, before any of it was applied, so
+// it is dropped (checksum 0: written before records had one)
+void rename_recover() {
+	Rename_Intent_t in;
+	lseek(fs, INTENT_START, SEEK_SET);
+	if ((read(fs, &in, sizeof(in)) != sizeof(in)) || (in.magic != INTENT_MAGIC)) {
+		return;
+	}
+	if ((in.crc != 0) && (in.crc != CRC32C(0, &in, sizeof(Rename_Intent_t) - sizeof(int)))) {
+		csum_errors++;
+		printf("Checksum mismatch on the rename intent record, rename of inode %d not applied\n", in.inum);
+		rename_log(NULL);
+		return;
+	}
+	printf("Completing interrupted rename of inode %d\n", in.inum);
+	rename_apply(&in);
+	meta_sync();
+	fsync(fs);
+	rename_log(NULL);
+}
+
+// Moves entry srcname in directory srcp to name dstname in directory dstp, in one step:
+// an entry already named dstname is replaced (and its inode freed) if it is of the same
+// type, and an empty directory if a directory. A directory moved to a new parent gets
+// its ".." updated. Only metadata changes, file data stays where it is.
+// Returns 0 if success, -1 if failure (no such entry, invalid or full directory,
+// replacing a non-empty directory or one of another type, moving a directory into itself)
+int fs_rename(int srcp, char *srcname, int dstp, char *dstname) {
+	if (lfs_mode == 1) {
+		return LFS_Rename(srcp, srcname, dstp, dstname);
+	}
+	if ((srcp < 0) || (srcp > NUM_INODES - 1) || (dstp < 0) || (dstp > NUM_INODES - 1)) {
+		return -1;
+	}
+	if ((valid_inum(srcp) == 0) || (is_directory(srcp) == -1) || (valid_inum(dstp) == 0) || (is_directory(dstp) == -1)) {
+		return -1;
+	}
+	if ((strcmp(srcname, ".") == 0) || (strcmp(srcname, "..") == 0) || (strcmp(dstname, ".") == 0) ||
+		(strcmp(dstname, "..") == 0) || (strlen(dstname) > 251)) {
+		return -1;
+	}
+	int inum;
+	int srcslot = find_entry(srcp, srcname, &inum);
+	if (srcslot == -1) {
+		return -1;
+	}
+	if ((srcp == dstp) && (strcmp(srcname, dstname) == 0)) {
+		return 0;
+	}
+	int child = (MFS_SHARD(inum) == my_shard) ? local_inum(inum) : -1;
+	int is_dir = (child == -1) || (is_directory(child) == 0);
+
+	// A directory on another shard keeps its ".." there, so it can only be renamed in place
+	if ((child == -1) && (srcp != dstp)) {
+		return -1;
+	}
+	// A directory can't move into itself: walk up from dstp to the root
+	if (is_dir && (child != -1) && (srcp != dstp)) {
+		char name[252];
+		int cur = dstp;
+		for (int i = 0; (i < NUM_INODES) && (cur != 0); i++) {
+			if (cur == child) {
+				return -1;
+			}
+			int up = read_dirent_block(inode_field(cur, INODE_OFFSET_PTR + sizeof(int)), name);
+			if (up == -1) {
+				return -1;
+			}
+			if (MFS_SHARD(up) != my_shard) {
+				break;
+			}
+			cur = local_inum(up);
+		}
+	}
+
+	Rename_Intent_t in;
+	memset(&in, 0, sizeof(in));
+	in.magic = INTENT_MAGIC;
+	in.inum = inum;
+	in.srcp = srcp;
+	in.srcslot = srcslot;
+	in.dstp = dstp;
+	in.child = -1;
+	in.dotdot = -1;
+	in.dropped = -1;
+	in.freed[0] = inode_field(srcp, INODE_OFFSET_PTR + (srcslot * sizeof(int)));
+	in.freed[1] = -1;
+	in.freed[2] = -1;
+	strncpy(in.name, dstname, sizeof(in.name) - 1);
+
+	int old;
+	int dstslot = find_entry(dstp, dstname, &old);
+	int replace = (dstslot != -1);
+	if (replace) {
+		if (old == inum) {
+			return 0;
+		}
+		// The replaced inode is freed here, so it must live on this shard
+		if ((MFS_SHARD(old) != my_shard) || (child == -1)) {
+			return -1;
+		}
+		old = local_inum(old);
+		int old_dir = (is_directory(old) == 0);
+		if ((old_dir != is_dir) || (old_dir && (inode_field(old, INODE_OFFSET_SIZE) > 512))) {
+			return -1;
+		}
+		in.freed[1] = inode_field(dstp, INODE_OFFSET_PTR + (dstslot * sizeof(int)));
+		in.dropped = old;
+	}
+	else if (srcp == dstp) {
+		dstslot = srcslot;
+	}
+	else {
+		dstslot = find_free_entry(dstp);
+		if (dstslot == -1) {
+			return -1;
+		}
+	}
+	in.dstslot = dstslot;
+
+	int srcsize = inode_field(srcp, INODE_OFFSET_SIZE);
+	if (srcp == dstp) {
+		in.srcsize = srcsize - (replace ? 256 : 0);
+		in.dstsize = in.srcsize;
+	}
+	else {
+		in.srcsize = srcsize - 256;
+		in.dstsize = inode_field(dstp, INODE_OFFSET_SIZE) + (replace ? 0 : 256);
+	}
+
+	// New entry blocks, held until the intent is applied
+	in.block = find_free_block();
+	if (in.block == -1) {
+		return -1;
+	}
+	set_block_bitmap(in.block, 1);
+	if (is_dir && (child != -1) && (srcp != dstp)) {
+		in.child = child;
+		in.freed[2] = inode_field(child, INODE_OFFSET_PTR + sizeof(int));
+		in.dotdot = find_free_block();
+		if (in.dotdot == -1) {
+			set_block_bitmap(in.block, 0);
+			return -1;
+		}
+		set_block_bitmap(in.dotdot, 1);
+	}
+
+	if (rename_log(&in) == -1) {
+		return -1;
+	}
+	int status = rename_apply(&in);
+	fsync(fs);
+	rename_log(NULL);
+	return status;
+}
+
+
+// Returns byte offset of snapshot s's metadata copy
+int snap_meta(int s) {
+	return SNAP_START + BLOCK_SIZE + (s * SNAP_META_SIZE);
+}
+
+// Checks if inum names an inode of a valid snapshot
+// Returns 1 if so, 0 if not
+int is_snap_inum(int inum) {
+	int s = (inum >> SNAP_INUM_SHIFT) - 1;
+	if ((inum < 0) || (s < 0) || (s > MAX_SNAPSHOTS - 1)) {
+		return 0;
+	}
+	return snap_state[s] == 1;
+}
+
+// Recounts free_inodes and free_blocks with a popcount pass over the bitmaps
+void statfs_count() {
+	unsigned char bitmap[NUM_BLOCKS / 8];
+	lseek(fs, INODE_BITMAP_START, SEEK_SET);
+	read(fs, bitmap, NUM_INODES / 8);
+	free_inodes = NUM_INODES - Popcount(bitmap, NUM_INODES / 8);
+	lseek(fs, BLOCK_BITMAP_START, SEEK_SET);
+	read(fs, bitmap, NUM_BLOCKS / 8);
+	for (int i = 0; i < NUM_BLOCKS / 8; i++) {
+		bitmap[i] |= snap_blocks[i];
+	}
+	free_blocks = NUM_BLOCKS - Popcount(bitmap, NUM_BLOCKS / 8);
+}
+
+// Returns total and free inodes and blocks of the file system
+// Returns 0 if success, -1 if failure
+int fs_statfs(int *inodes, int *inodes_free, int *blocks, int *blocks_free) {
+	if (lfs_mode == 1) {
+		return LFS_StatFS(inodes, inodes_free, blocks, blocks_free);
+	}
+	*inodes = NUM_INODES;
+	*inodes_free = free_inodes;
+	*blocks = NUM_BLOCKS;
+	*blocks_free = free_blocks - pending_blocks;
+	return 0;
+}
+
+// Rebuilds the held block and slot maps from the valid snapshots, then recounts free space
+void snap_rebuild_held() {
+	unsigned char bitmap[NUM_BLOCKS / 8];
+	unsigned char slots[NUM_BLOCKS];
+	memset(snap_blocks, 0, sizeof(snap_blocks));
+	memset(snap_slots, 0, sizeof(snap_slots));
+	for (int s = 0; s < MAX_SNAPSHOTS; s++) {
+		if (snap_state[s] != 1) {
+			continue;
+		}
+		lseek(fs, snap_meta(s) + BLOCK_BITMAP_START, SEEK_SET);
+		read(fs, bitmap, sizeof(bitmap));
+		lseek(fs, snap_meta(s) + BLOCK_START + (NUM_INODES * INLINE_SIZE), SEEK_SET);
+		read(fs, slots, sizeof(slots));
+		for (int i = 0; i < NUM_BLOCKS / 8; i++) {
+			snap_blocks[i] |= bitmap[i];
+		}
+		for (int i = 0; i < NUM_BLOCKS; i++) {
+			snap_slots[i] |= slots[i];
+		}
+	}
+	statfs_count();
+}
+
+// Loads the snapshot table
+void snap_load() {
+	memset(snap_state, 0, sizeof(snap_state));
+	lseek(fs, SNAP_START, SEEK_SET);
+	read(fs, snap_state, sizeof(snap_state));
+	snap_rebuild_held();
+}
+
+// Takes a snapshot of the live image: copies its metadata, shares its data blocks
+// Returns inum of the snapshot's root directory, -1 if failure (no free snapshot)
+int fs_snapshot() {
+	if (lfs_mode == 1) {
+		return -1;
+	}
+	// The snapshot must see buffered writes
+	if (delalloc_flush() < 0) {
+		return -1;
+	}
+	int s;
+	for (s = 0; s < MAX_SNAPSHOTS; s++) {
+		if (snap_state[s] == 0) {
+			break;
+		}
+	}
+	if (s == MAX_SNAPSHOTS) {
+		return -1;
+	}
+
+	// Bitmaps and inodes in one piece
+	char *meta = malloc(BLOCK_START);
+	lseek(fs, 0, SEEK_SET);
+	int status = read(fs, meta, BLOCK_START);
+	lseek(fs, snap_meta(s), SEEK_SET);
+	status = write(fs, meta, BLOCK_START);
+	if (status < 0) {
+		free(meta);
+		return -1;
+	}
+
+	// Inline records of inodes that have one
+	char record[INLINE_SIZE];
+	for (int i = 0; i < NUM_INODES; i++) {
+		int ptr0;
+		memcpy(&ptr0, meta + INODE_START + (i * INODE_SIZE) + INODE_OFFSET_PTR, sizeof(int));
+		if ((((meta[INODE_BITMAP_START + (i / 8)] >> (i % 8)) & 1) == 0) || (ptr0 != INODE_PTR_INLINE)) {
+			continue;
+		}
+		lseek(fs, INLINE_START + (i * INLINE_SIZE), SEEK_SET);
+		status = read(fs, record, INLINE_SIZE);
+		lseek(fs, snap_meta(s) + BLOCK_START + (i * INLINE_SIZE), SEEK_SET);
+		status = write(fs, record, INLINE_SIZE);
+	}
+	free(meta);
+
+	lseek(fs, snap_meta(s) + BLOCK_START + (NUM_INODES * INLINE_SIZE), SEEK_SET);
+	status = write(fs, slot_map, NUM_BLOCKS);
+	fsync(fs);
+
+	// Snapshot exists once its table entry is written
+	int valid = 1;
+	lseek(fs, SNAP_START + (s * sizeof(int)), SEEK_SET);
+	status = write(fs, &valid, sizeof(int));
+	if (status < 0) {
+		return -1;
+	}
+	snap_state[s] = 1;
+	snap_rebuild_held();
+	return (s + 1) << SNAP_INUM_SHIFT;
+}
+
+// Deletes the snapshot whose root is inum. Blocks only it held become free right away,
+// since the live bitmap never counted them, so there is nothing left to reclaim afterwards.
+// Returns 0 if success, -1 if failure (not a snapshot root)
+int fs_snapdel(int inum) {
+	if ((is_snap_inum(inum) == 0) || ((inum & (NUM_INODES - 1)) != 0)) {
+		return -1;
+	}
+	int s = (inum >> SNAP_INUM_SHIFT) - 1;
+	int freed = 0;
+	lseek(fs, SNAP_START + (s * sizeof(int)), SEEK_SET);
+	int status = write(fs, &freed, sizeof(int));
+	if (status < 0) {
+		return -1;
+	}
+	snap_state[s] = 0;
+	unsigned char held[NUM_BLOCKS / 8];
+	memcpy(held, snap_blocks, sizeof(held));
+	snap_rebuild_held();
+
+	// Blocks only this snapshot kept go back to the host
+	for (int i = 0; i < NUM_BLOCKS; i++) {
+		if ((((held[i / 8] & ~snap_blocks[i / 8]) >> (i % 8)) & 1) && (valid_block(i) == 0)) {
+			release_block(i);
+		}
+	}
+	return 0;
+}
+
+// Reads int field at offset of inode i in snapshot s
+int snap_field(int s, int i, int offset) {
+	int value = -1;
+	lseek(fs, snap_meta(s) + INODE_START + (i * INODE_SIZE) + offset, SEEK_SET);
+	read(fs, &value, sizeof(int));
+	return value;
+}
+
+// Checks if inode i is allocated in snapshot s
+// Returns 1 if so, 0 if not
+int snap_valid_inum(int s, int i) {
+	char byte = 0;
+	lseek(fs, snap_meta(s) + INODE_BITMAP_START + (i / 8), SEEK_SET);
+	read(fs, &byte, 1);
+	return (byte >> (i % 8)) & 1;
+}
+
+// Looks at snapshot directory inum for entry name
+// Returns snapshot inum of entry or -1 if not found
+int snap_lookup(int inum, char *name) {
+	int s = (inum >> SNAP_INUM_SHIFT) - 1;
+	int i = inum & (NUM_INODES - 1);
+	if ((snap_valid_inum(s, i) == 0) || (snap_field(s, i, INODE_OFFSET_TYPE) != MFS_DIRECTORY)) {
+		return -1;
+	}
+	char entry[252];
+	for (int j = 0; j < 10; j++) {
+		int ptr = snap_field(s, i, INODE_OFFSET_PTR + (j * sizeof(int)));
+		if ((ptr < 0) || (ptr > NUM_BLOCKS - 1)) {
+			continue;
+		}
+		int child = read_dirent_block(ptr, entry);
+		if ((child != -1) && (strcmp(entry, name) == 0)) {
+			return MFS_INUM(MFS_SHARD(child), ((s + 1) << SNAP_INUM_SHIFT) | MFS_LOCAL(child));
+		}
+	}
+	return -1;
+}
+
+// Fills stat fields from snapshot inode inum
+// Returns 0 if success, -1 if failure (inum does not exist in the snapshot)
+int snap_stat(int inum, int *stat_type, int *stat_size, int *stat_blocks) {
+	int s = (inum >> SNAP_INUM_SHIFT) - 1;
+	int i = inum & (NUM_INODES - 1);
+	if (snap_valid_inum(s, i) == 0) {
+		return -1;
+	}
+	*stat_type = snap_field(s, i, INODE_OFFSET_TYPE);
+	*stat_size = snap_field(s, i, INODE_OFFSET_SIZE);
+	*stat_blocks = snap_field(s, i, INODE_OFFSET_NUM_B);
+	return 0;
+}
+
+// Reads block# block of snapshot inode inum into buffer
+// Returns 0 if success, -1 if failure (invalid inum, invalid block)
+int snap_read(int inum, char *buffer, int block) {
+	int s = (inum >> SNAP_INUM_SHIFT) - 1;
+	int i = inum & (NUM_INODES - 1);
+	if ((snap_valid_inum(s, i) == 0) || (block < 0) || (block > 9)) {
+		return -1;
+	}
+	int ptr = snap_field(s, i, INODE_OFFSET_PTR + (block * sizeof(int)));
+	if ((ptr == -1) && (snap_field(s, i, INODE_OFFSET_TYPE) == MFS_REGULAR_FILE) &&
+	    (snap_field(s, i, INODE_OFFSET_SIZE) >= (block + 1) * BLOCK_SIZE)) {
+		memset(buffer, 0, BLOCK_SIZE);
+		return 0;
+	}
+	if (ptr == INODE_PTR_INLINE) {
+		memset(buffer, 0, BLOCK_SIZE);
+		lseek(fs, snap_meta(s) + BLOCK_START + (i * INLINE_SIZE), SEEK_SET);
+		read(fs, buffer, INLINE_SIZE);
+		return 0;
+	}
+	if (valid_ptr(ptr) == 0) {
+		return -1;
+	}
+	return read_data(ptr, buffer);
+}
+
+
+// Returns monotonic clock in milliseconds
+long now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+// Checks if request (command string from a client) changes the file system
+// Returns 1 if so, 0 if not
+int is_mutation(char *request) {
+	char *mutations[] = {"write", "creat", "unlink", "rename", "mknod", "link", "drop", "snapshot", "snapdel", "punch", NULL};
+	int n = strcspn(request, " ");
+	for (int i = 0; mutations[i] != NULL; i++) {
+		if (((int) strlen(mutations[i]) == n) && (strncmp(request, mutations[i], n) == 0)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Opens replication state file [image].repl and loads the last seq from it
+// Returns 0 if success, -1 if failure
+int repl_open(char *image) {
+	char path[4096];
+	snprintf(path, sizeof(path), "%s.repl", image);
+	repl_state = open(path, O_RDWR|O_CREAT, 0666);
+	if (repl_state == -1) {
+		return -1;
+	}
+	repl_seq = 0;
+	if (pread(repl_state, &repl_seq, sizeof(int), 0) != sizeof(int)) {
+		repl_seq = 0;
+	}
+	// Entries logged before this start are gone
+	repl_log_first = repl_seq + 1;
+	return 0;
+}
+
+// Saves the last seq
+// Returns 0 if success, -1 if failure
+int repl_save() {
+	if (pwrite(repl_state, &repl_seq, sizeof(int), 0) != sizeof(int)) {
+		return -1;
+	}
+	return fdatasync(repl_state);
+}
+
+// Adds replicas from list "host:port,host:port,...", each port moved by offset
+// Returns 0 if success, -1 if failure
+int repl_add(char *list, int offset) {
+	char copy[4096];
+	char *save;
+	strncpy(copy, list, sizeof(copy) - 1);
+	copy[sizeof(copy) - 1] = '\0';
+	for (char *host = strtok_r(copy, ",", &save); host != NULL; host = strtok_r(NULL, ",", &save)) {
+		char *colon = strchr(host, ':');
+		if ((colon == NULL) || (num_replicas == MFS_MAX_REPLICAS)) {
+			return -1;
+		}
+		*colon = '\0';
+		if (UDP_FillSockAddr(&replicas[num_replicas], host, atoi(colon + 1) + offset) != 0) {
+			return -1;
+		}
+		replica_acked[num_replicas] = -1;
+		replica_sent[num_replicas] = -1;
+		num_replicas++;
+	}
+	repl_fd = UDP_Open(0);
+	return (repl_fd > -1) ? 0 : -1;
+}
+
+// Logs request, a mutation that succeeded, as the next seq
+void repl_append(char *request) {
+	repl_seq++;
+	strncpy(repl_log[repl_seq % REPL_LOG], request, BUFFER_SIZE * 2 - 1);
+	repl_save();
+}
+
+// Sends each replica the entries it has not seen (at most REPL_WINDOW past its ack),
+// resends unacked ones after REPL_RESEND_MS, sends heartbeats, then takes in arrived acks
+void repl_ship() {
+	char msg[BUFFER_SIZE * 2 + 32];
+	int len;
+	long now = now_ms();
+	int heartbeat = (now - repl_heartbeat) >= REPL_HEARTBEAT_MS;
+	if (heartbeat == 1) {
+		repl_heartbeat = now;
+	}
+	int oldest = (repl_log_first > repl_seq - REPL_LOG + 1) ? repl_log_first : repl_seq - REPL_LOG + 1;
+	for (int r = 0; r < num_replicas; r++) {
+		int acked = replica_acked[r];
+		int first = replica_sent[r] + 1;
+		if ((acked != -1) && (acked + 1 < oldest)) {
+			// Entries it needs are gone from the log (wrapped, or from before a restart),
+			// it stays stale and needs a resync (copy the image over)
+			if (heartbeat == 1) {
+				printf("Replica %d needs a resync: acked %d, log starts at %d, seq %d\n", r, acked, oldest, repl_seq);
+			}
+			continue;
+		}
+		if ((acked == -1) || (now - replica_sent_at[r] >= REPL_RESEND_MS)) {
+			first = acked + 1;
+		}
+		int sent = 0;
+		for (int seq = first; (acked != -1) && (seq <= repl_seq) && (seq <= acked + REPL_WINDOW); seq++) {
+			len = sprintf(msg, "repl %d %s", seq, repl_log[seq % REPL_LOG]);
+			UDP_Write(repl_fd, &replicas[r], msg, len + 1);
+			replica_sent[r] = seq;
+			sent++;
+		}
+		if (sent > 0) {
+			replica_sent_at[r] = now;
+		}
+		else if (heartbeat == 1) {
+			len = sprintf(msg, "repl %d", repl_seq);
+			UDP_Write(repl_fd, &replicas[r], msg, len + 1);
+		}
+	}
+
+	// Acks carry the last seq the replica applied
+	struct sockaddr_in from;
+	socklen_t fromlen = sizeof(from);
+	char reply[64];
+	while (recvfrom(repl_fd, reply, sizeof(reply) - 1, MSG_DONTWAIT, (struct sockaddr *) &from, &fromlen) > 0) {
+		reply[sizeof(reply) - 1] = '\0';
+		for (int r = 0; r < num_replicas; r++) {
+			if ((from.sin_addr.s_addr == replicas[r].sin_addr.s_addr) && (from.sin_port == replicas[r].sin_port)) {
+				replica_acked[r] = atoi(reply);
+				if (replica_sent[r] < replica_acked[r]) {
+					replica_sent[r] = replica_acked[r];
+				}
+			}
+		}
+		fromlen = sizeof(from);
+	}
+}
+
+// Applies replication message "repl <seq> [command]" from the primary
+// Returns last seq applied, which is the ack
+int repl_apply(char *msg) {
+	char *command;
+	int seq = strtol(msg + strlen("repl "), &command, 10);
+	if (seq > repl_primary_seq) {
+		repl_primary_seq = seq;
+	}
+	// An entry always carries a command, an empty one is not applied (nor acked)
+	if ((*command == ' ') && (command[1 + strspn(command + 1, " ")] != '\0') && (seq == repl_seq + 1)) {
+		int stat1, stat2, stat3, is_read;
+		char *read_buffer = malloc(BUFFER_SIZE);
+		parser(command + 1, &stat1, &stat2, &stat3, &is_read, read_buffer);
+		free(read_buffer);
+		repl_seq = seq;
+		repl_save();
+	}
+	if (repl_seq >= repl_primary_seq) {
+		repl_current = now_ms();
+	}
+	return repl_seq;
+}
+
+// Checks if replication message came from this replica's primary, over UDP from the
+// address given with -r. The primary ships from an ephemeral port, a new one after each
+// restart, so the port is not compared
+// Returns 1 if so, 0 if not
+int repl_from_primary(struct sockaddr_in *from) {
+	return (from != NULL) && (from->sin_addr.s_addr == repl_primary.sin_addr.s_addr);
+}
+
+// Checks if this replica is too far behind the primary to serve reads
+// Returns 1 if so, 0 if not
+int repl_stale() {
+	return (now_ms() - repl_current) > repl_bound_ms;
+}
+
+
+// Command parser 
+// Takes command string from client and executes correct subroutine
+// Command string will be in format: "[command] [arg1] [arg2] [arg3]"
+// Inums are global on the wire and local to the fs_* calls
+int parser(char *command, int *stat1, int *stat2, int *stat3, int *is_read, char *read_buffer) {
+	char *cmd, *arg1, *arg2, *arg3;
+	int pinum, inum, type, block, result;
+	cmd = strtok(command, " ");
+	if (cmd == NULL) {
+		printf("Invalid command received\n");
+		return -1;
+	}
 	arg1 = strtok(NULL, " ");
 	arg2 = strtok(NULL, " ");
 	arg3 = strtok(NULL, "");
@@ -660,7 +2491,7 @@ int parser(char *command, int *stat1, int *stat2, int *stat3, int *is_read, char
 	// lookup pinum name
 	if (strcmp(cmd, "lookup") == 0) {
 		printf("lookup!\n");
-		pinum = atoi(arg1);
+		pinum = local_inum(atoi(arg1));
 		result = fs_lookup(pinum, arg2);
 		return result;
 	}
@@ -668,7 +2499,7 @@ int parser(char *command, int *stat1, int *stat2, int *stat3, int *is_read, char
 	// RETURNS BUFFER
 	else if (strcmp(cmd, "stat") == 0) {
 		printf("stat!\n");
-		inum = atoi(arg1);
+		inum = local_inum(atoi(arg1));
 		result = fs_stat(inum, stat1, stat2, stat3);
 		printf("parser stat.type: %d\n", *stat1);
 		printf("parser stat.size: %d\n", *stat2);
@@ -678,7 +2509,7 @@ int parser(char *command, int *stat1, int *stat2, int *stat3, int *is_read, char
 	// write inum block [data]
 	else if (strcmp(cmd, "write") == 0) {
 		printf("write!\n");
-		inum = atoi(arg1);
+		inum = local_inum(atoi(arg1));
 		block = atoi(arg2);
 		result = fs_write(inum, arg3, block);
 		return result;
@@ -688,7 +2519,7 @@ int parser(char *command, int *stat1, int *stat2, int *stat3, int *is_read, char
 	else if (strcmp(cmd, "read") == 0) {
 		printf("read!\n");
 		*is_read = 0;
-		inum = atoi(arg1);
+		inum = local_inum(atoi(arg1));
 		block = atoi(arg2);
 		result = fs_read(inum, read_buffer, block);
 		return result;
@@ -696,82 +2527,788 @@ int parser(char *command, int *stat1, int *stat2, int *stat3, int *is_read, char
 	// creat pinum type [name]
 	else if (strcmp(cmd, "creat") == 0) {
 		printf("creat!\n");
-		pinum = atoi(arg1);
+		pinum = local_inum(atoi(arg1));
 		type = atoi(arg2);
 		result = fs_creat(pinum, type, arg3);
 		return result;
 	}
+	// mknod type parent
+	else if (strcmp(cmd, "mknod") == 0) {
+		printf("mknod!\n");
+		type = atoi(arg1);
+		result = fs_mknod(type, atoi(arg2));
+		return global_inum(result);
+	}
+	// link pinum inum [name]
+	else if (strcmp(cmd, "link") == 0) {
+		printf("link!\n");
+		pinum = local_inum(atoi(arg1));
+		inum = atoi(arg2);
+		result = fs_link(pinum, inum, arg3);
+		return result;
+	}
+	// drop inum
+	else if (strcmp(cmd, "drop") == 0) {
+		printf("drop!\n");
+		inum = local_inum(atoi(arg1));
+		result = fs_drop(inum);
+		return result;
+	}
 	// unlink pinum [name]
 	else if (strcmp(cmd, "unlink") == 0) {
 		printf("unlink!\n");
-		pinum = atoi(arg1);
+		pinum = local_inum(atoi(arg1));
 		result = fs_unlink(pinum, arg2);
 		return result;
 	}
+	// rename srcpinum dstpinum [srcname] [dstname]
+	else if (strcmp(cmd, "rename") == 0) {
+		printf("rename!\n");
+		char *dstname = (arg3 != NULL) ? strchr(arg3, ' ') : NULL;
+		if (dstname == NULL) {
+			return -1;
+		}
+		*dstname++ = '\0';
+		result = fs_rename(local_inum(atoi(arg1)), arg3, local_inum(atoi(arg2)), dstname);
+		return result;
+	}
+	// punch inum block count
+	else if (strcmp(cmd, "punch") == 0) {
+		printf("punch!\n");
+		if ((arg2 == NULL) || (arg3 == NULL)) {
+			return -1;
+		}
+		inum = local_inum(atoi(arg1));
+		result = fs_punch(inum, atoi(arg2), atoi(arg3));
+		return result;
+	}
+	// snapshot
+	else if (strcmp(cmd, "snapshot") == 0) {
+		printf("snapshot!\n");
+		return global_inum(fs_snapshot());
+	}
+	// snapdel inum
+	else if (strcmp(cmd, "snapdel") == 0) {
+		printf("snapdel!\n");
+		inum = local_inum(atoi(arg1));
+		return fs_snapdel(inum);
+	}
+	// statfs inum
+	// RETURNS BUFFER
+	else if (strcmp(cmd, "statfs") == 0) {
+		printf("statfs!\n");
+		int inodes, inodes_free, blocks, blocks_free;
+		*is_read = 0;
+		result = fs_statfs(&inodes, &inodes_free, &blocks, &blocks_free);
+		sprintf(read_buffer, "%d %d %d %d", inodes, inodes_free, blocks, blocks_free);
+		return result;
+	}
+	// csumerrs
+	else if (strcmp(cmd, "csumerrs") == 0) {
+		printf("csumerrs!\n");
+		return csum_errors;
+	}
 	else {
 		printf("Invalid command received\n");
 		return -1;
 	}
 }
 
-// Main server code
-int main(int argc, char *argv[]) {
-	// Catch improper starting
-	if (argc < 3) {
-		printf("Usage: server [port-number] [file-system-image]\n");
-		exit(1);
+// Runs one command from any transport through the file system core
+// under core_lock and fills reply (a string); from is the sender over UDP, NULL otherwise
+// Returns number of reply bytes to send, including the terminating 0
+int handle_command(char *msg, int len, char *reply, struct sockaddr_in *from) {
+	int stat1 = -1;
+	int stat2 = -1;
+	int stat3 = -1;
+	int is_read = -1;
+	char return_read_buffer[BUFFER_SIZE + 1];
+	return_read_buffer[BUFFER_SIZE] = '\0';
+	uint64_t arrival = (trace_mode == 1) ? Trace_Now() : 0;
+	// Requests are capped at twice the block size, well above the largest (a block write);
+	// a longer one (or a datagram cut short by the receive buffer) is refused, not truncated
+	if (len > BUFFER_SIZE * 2 - 1) {
+		return sprintf(reply, "-1") + 1;
 	}
+	msg[len] = '\0';
+	printf("Received %d bytes || Message: '%s'\n", len, msg);
 
-	// Grab file system image
-	load_fs(argv[2]);
+	// Scheduler queue depths, requests served and wait times
+	if (strcmp(msg, "schedstats") == 0) {
+		if (sched_mode == 0) {
+			sprintf(reply, "-1");
+		}
+		else {
+			int n = sprintf(reply, "0 ");
+			Sched_Stats(reply + n, BUFFER_SIZE);
+		}
+		return strlen(reply) + 1;
+	}
 
-	printf("First 8 bits:\n");
-	for (int i = 0; i < 8; i++) {
-		printf("Bit %d: %d\n", i, valid_inum(i));
+	// Same-host clients move over to a shared-memory ring: shmattach name
+	if (strncmp(msg, "shmattach ", 10) == 0) {
+		sprintf(reply, "%d", shm_attach(msg + 10));
+		return strlen(reply) + 1;
 	}
 
-	// Setup UDP server
-	int portid = atoi(argv[1]);
-	int comms = UDP_Open(portid);
-	assert(comms > -1);
+	// Replicas ack what the primary ships with the last seq applied, and refuse it from anyone else
+	if ((repl_role == REPL_REPLICA) && (strncmp(msg, "repl ", 5) == 0) && (repl_from_primary(from) == 0)) {
+		return sprintf(reply, "-1") + 1;
+	}
+	pthread_mutex_lock(&core_lock);
+	if ((repl_role == REPL_REPLICA) && (strncmp(msg, "repl ", 5) == 0)) {
+		sprintf(reply, "%d", repl_apply(msg));
+		meta_sync();
+		fsync(fs);
+		pthread_mutex_unlock(&core_lock);
+		return strlen(reply) + 1;
+	}
+	// Keep the request for the replicas before the parser splits it up
+	int mutation = is_mutation(msg);
+	char request[BUFFER_SIZE * 2];
+	if (repl_role == REPL_PRIMARY) {
+		strcpy(request, msg);
+	}
+	Trace_Record_t rec;
+	char payload[TRACE_MAX_PAYLOAD + 1];
+	int traced = (trace_mode == 1) ? Trace_Parse(msg, &rec, payload) : -1;
+	// Parse commmand,
+	int result;
+	if ((repl_role == REPL_REPLICA) && (mutation == 1)) {
+		result = -1;
+	}
+	else if ((repl_role == REPL_REPLICA) && (repl_stale() == 1)) {
+		result = -2;
+	}
+	else {
+		result = parser(msg, &stat1, &stat2, &stat3, &is_read, return_read_buffer);
+	}
+	if ((repl_role == REPL_PRIMARY) && (mutation == 1) && (result >= 0)) {
+		repl_append(request);
+	}
+	// Reply consists of integer return of function, followed by buffer if buffer is supposed to be returned
+	if (stat1 != -1) {
+		printf("Replying via stat!\n");
+		sprintf(reply, "%d %d %d %d", result, stat1, stat2, stat3);
+	}
+	else if (is_read != -1) {
+		printf("Replying via read!\n");
+		sprintf(reply, "%d %s", result, return_read_buffer);
+	}
+	else {
+		printf("Replying via anything else\n");
+		sprintf(reply, "%d", result);
+	}
+	// Writes acked DELALLOC_AGE_MS ago are flushed even if this request only reads
+	int flushed = (delalloc_mode == 1) ? delalloc_expire() : 0;
+	if ((mutation == 1) || (flushed == 1)) {
+		meta_sync();
+	}
+	fsync(fs);
+	if ((repl_role == REPL_PRIMARY) && (mutation == 1)) {
+		repl_ship();
+	}
+	if (traced == 0) {
+		uint64_t latency = Trace_Now() - arrival;
+		rec.arrival_ns = arrival;
+		rec.latency_ns = (latency > UINT32_MAX) ? UINT32_MAX : latency;
+		rec.result = result;
+		Trace_Log(&rec, payload);
+	}
+	pthread_mutex_unlock(&core_lock);
+	return strlen(reply) + 1;
+}
+
+// Handles one request; a request tagged "#id cmd" (context clients, see mfs.h) gets
+// "#id " back in front of its reply so the client can match it to the request
+// Returns number of bytes of reply to send
+int handle_request(char *msg, int len, char *reply, struct sockaddr_in *from) {
+	if ((len > 0) && (msg[0] == '#')) {
+		char *space = memchr(msg, ' ', (len < 16) ? len : 16);
+		if (space != NULL) {
+			int tag = space + 1 - msg;
+			memcpy(reply, msg, tag);
+			return tag + handle_command(msg + tag, len - tag, reply + tag, from);
+		}
+	}
+	return handle_command(msg, len, reply, from);
+}
+
+// A request waiting in the scheduler. sched_execute replies over UDP (udp > -1, and
+// frees it) or wakes the receive thread waiting for it (done)
+typedef struct __Sched_Req_t {
+	Sched_Item_t item;
+	int udp;
+	struct sockaddr_in addr;
+	int len;
+	int reply_len;
+	int done;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char msg[BUFFER_SIZE * 2];
+	char reply[BUFFER_SIZE * 2 + 32];
+} Sched_Req_t;
+
+// Returns scheduling class of request msg: SCHED_META for metadata reads
+int sched_class(char *msg) {
+	char *reads[] = {"lookup", "stat", "statfs", NULL};
+	if (msg[0] == '#') {
+		char *space = strchr(msg, ' ');
+		msg = (space != NULL) ? space + 1 : msg;
+	}
+	int n = strcspn(msg, " ");
+	for (int i = 0; reads[i] != NULL; i++) {
+		if (((int) strlen(reads[i]) == n) && (strncmp(msg, reads[i], n) == 0)) {
+			return SCHED_META;
+		}
+	}
+	return SCHED_BULK;
+}
 
-	printf("Listening...\n");
+// Returns scheduler key of a client at address addr
+uint64_t sched_key(struct sockaddr_in *addr) {
+	return ((uint64_t) ntohl(addr->sin_addr.s_addr) << 16) | ntohs(addr->sin_port);
+}
+
+// Parses -W spec: comma separated "a.b.c.d=weight" entries and at most one bare default weight
+// Returns 0 if success, -1 if failure
+int sched_parse(char *spec) {
+	char list[4096];
+	char *save;
+	strncpy(list, spec, sizeof(list) - 1);
+	list[sizeof(list) - 1] = '\0';
+	for (char *entry = strtok_r(list, ",", &save); entry != NULL; entry = strtok_r(NULL, ",", &save)) {
+		char *eq = strchr(entry, '=');
+		if (eq == NULL) {
+			sched_default_weight = atoi(entry);
+			if (sched_default_weight < 1) {
+				return -1;
+			}
+			continue;
+		}
+		*eq = '\0';
+		struct in_addr ip;
+		if ((sched_nweights == SCHED_WEIGHTS) || (inet_aton(entry, &ip) == 0) || (atoi(eq + 1) < 1)) {
+			return -1;
+		}
+		sched_weight_ip[sched_nweights] = ip.s_addr;
+		sched_weight[sched_nweights] = atoi(eq + 1);
+		sched_nweights++;
+	}
+	return 0;
+}
+
+// Queues req from client
+// Returns 0 if success, -1 if the scheduler is full
+int sched_submit(Sched_Req_t *req, uint64_t client) {
+	req->item.client = client;
+	req->item.cls = sched_class(req->msg);
+	req->item.weight = sched_default_weight;
+	req->item.data = req;
+	if (client < SCHED_KEY_UNIX) {
+		in_addr_t ip = htonl((in_addr_t) (client >> 16));
+		for (int i = 0; i < sched_nweights; i++) {
+			if (sched_weight_ip[i] == ip) {
+				req->item.weight = sched_weight[i];
+			}
+		}
+	}
+	return Sched_Submit(&req->item);
+}
+
+// Runs the requests the scheduler hands out, one at a time
+void *sched_execute(void *arg) {
+	while (1) {
+		Sched_Req_t *req = (Sched_Req_t *) Sched_Next()->data;
+		req->reply_len = handle_request(req->msg, req->len, req->reply, (req->udp > -1) ? &req->addr : NULL);
+		if (req->udp > -1) {
+			UDP_Write(req->udp, &req->addr, req->reply, req->reply_len);
+			free(req);
+			continue;
+		}
+		pthread_mutex_lock(&req->lock);
+		req->done = 1;
+		pthread_cond_signal(&req->cond);
+		pthread_mutex_unlock(&req->lock);
+	}
+	return NULL;
+}
+
+// Handles request msg from client on a connection (stream, shared memory) that waits for
+// its reply: directly, or through the scheduler in scheduler mode
+// Returns number of bytes of reply to send
+int schedule_request(char *msg, int len, char *reply, uint64_t client) {
+	if (sched_mode == 0) {
+		return handle_request(msg, len, reply, NULL);
+	}
+	Sched_Req_t *req = malloc(sizeof(Sched_Req_t));
+	if (req == NULL) {
+		return sprintf(reply, "-1") + 1;
+	}
+	if (len > BUFFER_SIZE * 2 - 1) {
+		free(req);
+		return sprintf(reply, "-1") + 1;
+	}
+	memcpy(req->msg, msg, len);
+	req->msg[len] = '\0';
+	req->len = len;
+	req->udp = -1;
+	req->done = 0;
+	pthread_mutex_init(&req->lock, NULL);
+	pthread_cond_init(&req->cond, NULL);
+	int n;
+	if (sched_submit(req, client) == -1) {
+		n = sprintf(reply, "-1") + 1;
+	}
+	else {
+		pthread_mutex_lock(&req->lock);
+		while (req->done == 0) {
+			pthread_cond_wait(&req->cond, &req->lock);
+		}
+		pthread_mutex_unlock(&req->lock);
+		n = req->reply_len;
+		memcpy(reply, req->reply, n);
+	}
+	pthread_mutex_destroy(&req->lock);
+	pthread_cond_destroy(&req->cond);
+	free(req);
+	return n;
+}
+
+// Receive loop for one UDP socket, run by each receive thread. Receiving and replying
+// happen in parallel, the file system core only under core_lock
+void *serve(void *arg) {
+	int comms = *(int *) arg;
 
 	// Listen for UDP requests
 	while (1) {
 		struct sockaddr_in s;
 		char msg[BUFFER_SIZE * 2];
-		int stat1 = -1;
-		int stat2 = -1;
-		int stat3 = -1;
-		int is_read = -1;
-		char *return_read_buffer = malloc(BUFFER_SIZE);
-		char reply[BUFFER_SIZE * 2];
+		char reply[BUFFER_SIZE * 2 + 32];
 		int rxStatus = UDP_Read(comms, &s, msg, BUFFER_SIZE * 2);
-		// Parse request and send reply
-		if (rxStatus > 0) {
-			printf("Received %d bytes || Message: '%s'\n", rxStatus, msg);
-			// Parse commmand,
-			int result = parser(msg, &stat1, &stat2, &stat3, &is_read, return_read_buffer);
-			// Reply consists of integer return of function, followed by buffer if buffer is supposed to be returned
-			if (stat1 != -1) {
-				printf("Replying via stat!\n");
-				sprintf(reply, "%d %d %d %d", result, stat1, stat2, stat3);
-			}
-			else if (is_read != -1) {
-				printf("Replying via read!\n");
-				sprintf(reply, "%d %s", result, return_read_buffer);
-			}
-			else {
-				printf("Replying via anything else\n");
-				sprintf(reply, "%d", result);
+		// Parse request and send reply, or leave that to sched_execute
+		if ((rxStatus > 0) && (sched_mode == 1)) {
+			Sched_Req_t *req = malloc(sizeof(Sched_Req_t));
+			if (req != NULL) {
+				memcpy(req->msg, msg, rxStatus);
+				req->len = rxStatus;
+				req->udp = comms;
+				req->addr = s;
+				if (sched_submit(req, sched_key(&s)) == -1) {
+					free(req);
+				}
 			}
+		}
+		else if (rxStatus > 0) {
+			int n = handle_request(msg, rxStatus, reply, &s);
+			rxStatus = UDP_Write(comms, &s, reply, n);
+		}
+		pthread_mutex_lock(&core_lock);
+		// Receive timed out, use the idle time to clean log segments
+		if ((rxStatus <= 0) && (lfs_mode == 1)) {
+			LFS_Clean(0);
+		}
+		if (repl_role == REPL_PRIMARY) {
+			repl_ship();
+		}
+		if ((rxStatus <= 0) && (trace_mode == 1)) {
+			Trace_Flush();
+		}
+		if ((rxStatus <= 0) && (delalloc_mode == 1) && (pending_blocks > 0)) {
+			delalloc_flush();
+			meta_sync();
 			fsync(fs);
-			rxStatus = UDP_Write(comms, &s, reply, BUFFER_SIZE * 2);
 		}
+		pthread_mutex_unlock(&core_lock);
 	}
 
+	return NULL;
+}
+
+// Serves one stream connection (TCP or Unix-domain) until the client goes away
+void *stream_serve(void *arg) {
+	int conn = (int) (long) arg;
+	char msg[BUFFER_SIZE * 2];
+	char reply[BUFFER_SIZE * 2 + 32];
+	struct sockaddr_in peer;
+	socklen_t peerlen = sizeof(peer);
+	uint64_t client = SCHED_KEY_UNIX | conn;
+	if ((getpeername(conn, (struct sockaddr *) &peer, &peerlen) == 0) && (peer.sin_family == AF_INET)) {
+		client = sched_key(&peer);
+	}
+	while (1) {
+		int len = Stream_Read(conn, msg, BUFFER_SIZE * 2);
+		int n;
+		if (len == -2) {
+			// Frame over the request cap, skipped
+			n = sprintf(reply, "-1") + 1;
+		}
+		else if (len <= 0) {
+			break;
+		}
+		else {
+			n = schedule_request(msg, len, reply, client);
+		}
+		if (Stream_Write(conn, reply, n) < 0) {
+			break;
+		}
+	}
+	Stream_Close(conn);
+	return NULL;
+}
+
+// Accepts stream connections on a listening descriptor, a thread each
+void *stream_accept(void *arg) {
+	int listener = (int) (long) arg;
+	while (1) {
+		int conn = Stream_Accept(listener);
+		if (conn < 0) {
+			continue;
+		}
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, stream_serve, (void *) (long) conn) != 0) {
+			Stream_Close(conn);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+// Serves one shared-memory client: requests come in on its submission ring, replies are
+// written into the same slot and go back on its completion ring. Ends when the client is gone.
+void *shm_serve(void *arg) {
+	Shm_Region_t *region = (Shm_Region_t *) arg;
+	while (1) {
+		int slot = Shm_Pop(&region->sq, 1000);
+		if (slot == -1) {
+			if ((kill(region->client_pid, 0) == -1) && (errno == ESRCH)) {
+				break;
+			}
+			continue;
+		}
+		if ((slot < 0) || (slot > SHM_SLOTS - 1)) {
+			break;
+		}
+		Shm_Slot_t *s = &region->slots[slot];
+		int len = s->len;
+		if ((len < 0) || (len > SHM_MSG_SIZE - 1)) {
+			len = 0;
+		}
+		s->reply_len = schedule_request(s->msg, len, s->reply, SCHED_KEY_SHM | region->client_pid);
+		Shm_Push(&region->cq, slot);
+	}
+	printf("Shared-memory client %d gone\n", region->client_pid);
+	Shm_Detach(region);
+	return NULL;
+}
+
+// Maps the client's shared-memory region name and starts serving it. The name must be
+// one the client library makes, "/mfs.pid.n", for a live process that owns the region,
+// and a region is served once.
+// Returns 0 if success, -1 if failure
+int shm_attach(char *name) {
+	int pid;
+	unsigned int n;
+	int end = 0;
+	if ((sscanf(name, "/mfs.%d.%u%n", &pid, &n, &end) != 2) || (name[end] != '\0') || (pid <= 0) || (kill(pid, 0) == -1)) {
+		return -1;
+	}
+	Shm_Region_t *region = Shm_Attach(name);
+	if (region == NULL) {
+		return -1;
+	}
+	if ((region->client_pid != pid) || (__atomic_exchange_n(&region->attached, 1, __ATOMIC_ACQ_REL) != 0)) {
+		Shm_Detach(region);
+		return -1;
+	}
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, shm_serve, region) != 0) {
+		Shm_Detach(region);
+		return -1;
+	}
+	pthread_detach(thread);
 	return 0;
 }
 
+// Waits for SIGINT / SIGTERM (blocked in every other thread), then shuts down cleanly:
+// once it holds core_lock no request is half done, so it saves the warm start manifest,
+// flushes the trace and the image, and exits
+void *shutdown_wait(void *arg) {
+	int sig;
+	sigwait(&shutdown_signals, &sig);
+	pthread_mutex_lock(&core_lock);
+	printf("Signal %d, shutting down\n", sig);
+	delalloc_flush();
+	meta_sync();
+	warm_save(image_path);
+	Trace_Flush();
+	fsync(fs);
+	exit(0);
+	return NULL;
+}
+
+// Main server code
+int main(int argc, char *argv[]) {
+	// Catch improper starting
+	if (argc < 3) {
+		printf("Usage: server [port-number] [file-system-image] [-d] [-z] [-D] [-L] [-S shard[-last]]\n");
+		printf("              [-R host:port,... | -r host] [-B ms] [-N sockets] [-A] [-Q bytes]\n");
+		printf("              [-u socket-path] [-t trace-file] [-W weights]\n");
+		printf("  -d  deduplicate identical file data blocks (the image needs -d from then on)\n");
+		printf("  -z  compress file data blocks into packed slots\n");
+		printf("  -D  delay block allocation of file writes until they are flushed together\n");
+		printf("  -L  format a new image as log-structured\n");
+		printf("  -S  serve shard, or shards shard..last on consecutive ports with images [image].N\n");
+		printf("  -R  primary: ship mutations to these replicas (ports move with the shard like -S)\n");
+		printf("  -r  replica of the primary at host: apply only what it ships, serve reads only\n");
+		printf("  -B  replica: max staleness in ms of the reads it serves (default 1000)\n");
+		printf("  -N  receive on this many SO_REUSEPORT sockets, one thread each\n");
+		printf("  -A  pin receive thread i to CPU i\n");
+		printf("  -Q  socket receive buffer size (SO_RCVBUF) in bytes\n");
+		printf("  -u  also accept Unix-domain stream connections at this path ([path].N for shard N of a range)\n");
+		printf("  -t  record every request to this trace file ([file].N for shard N of a range), see replay\n");
+		printf("  -W  schedule requests fairly per client, metadata reads first; weights are\n");
+		printf("      a default weight and/or a.b.c.d=weight entries, comma separated (e.g. 1,10.0.0.5=4)\n");
+		printf("  TCP stream connections are accepted on the same port number as UDP\n");
+		exit(1);
+	}
 
+	// Parse options after the positional arguments
+	int opt;
+	int shard_first = 0;
+	int shard_last = -1;
+	char *replica_list = NULL;
+	char *primary_host = NULL;
+	int num_sockets = 1;
+	int pin_threads = 0;
+	int rcvbuf = 0;
+	char *unix_path = NULL;
+	char *trace_path = NULL;
+	optind = 3;
+	while ((opt = getopt(argc, argv, "dzDLS:R:r:B:N:AQ:u:t:W:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dedup_mode = 1;
+			break;
+		case 'D':
+			delalloc_mode = 1;
+			break;
+		case 'z':
+			compress_mode = 1;
+			break;
+		case 'L':
+			lfs_format = 1;
+			break;
+		case 'S':
+			if (sscanf(optarg, "%d-%d", &shard_first, &shard_last) < 2) {
+				shard_last = shard_first;
+			}
+			if ((shard_first < 0) || (shard_last < shard_first) || (shard_last > MFS_MAX_SHARDS - 1)) {
+				printf("Invalid shard range %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'R':
+			repl_role = REPL_PRIMARY;
+			replica_list = optarg;
+			break;
+		case 'r':
+			repl_role = REPL_REPLICA;
+			primary_host = optarg;
+			break;
+		case 'B':
+			repl_bound_ms = atoi(optarg);
+			break;
+		case 'N':
+			num_sockets = atoi(optarg);
+			if (num_sockets < 1) {
+				num_sockets = 1;
+			}
+			break;
+		case 'A':
+			pin_threads = 1;
+			break;
+		case 'Q':
+			rcvbuf = atoi(optarg);
+			break;
+		case 'u':
+			unix_path = optarg;
+			break;
+		case 't':
+			trace_path = optarg;
+			break;
+		case 'W':
+			if (sched_parse(optarg) == -1) {
+				printf("Invalid weights %s\n", optarg);
+				exit(1);
+			}
+			sched_mode = 1;
+			break;
+		default:
+			exit(1);
+		}
+	}
+
+	// A range of shards runs one process per shard: shard N listens on
+	// port + (N - first) with its own image [image].N
+	int portid = atoi(argv[1]);
+	char *image = argv[2];
+	char shard_image[4096];
+	my_shard = shard_first;
+	if (shard_last > shard_first) {
+		for (int n = shard_first; n <= shard_last; n++) {
+			pid_t pid = fork();
+			if (pid < 0) {
+				exit(1);
+			}
+			if (pid == 0) {
+				my_shard = n;
+				portid += n - shard_first;
+				snprintf(shard_image, sizeof(shard_image), "%s.%d", argv[2], n);
+				image = shard_image;
+				break;
+			}
+		}
+		// Parent only waits for the shard servers
+		if (image == argv[2]) {
+			while (wait(NULL) > 0) {
+			}
+			return 0;
+		}
+	}
+
+	// Grab file system image
+	load_fs(image);
+	if ((lfs_mode == 1) && ((dedup_mode == 1) || (compress_mode == 1))) {
+		printf("Dedup and compression are not supported on log-structured images\n");
+		dedup_mode = 0;
+		compress_mode = 0;
+	}
+	if ((lfs_mode == 0) && (dedup_mark() == -1)) {
+		printf("%s was served with -d and may share data blocks, serve it with -d\n", image);
+		exit(1);
+	}
+	if (dedup_mode == 1) {
+		dedup_rebuild();
+	}
+	// Finish a rename cut short by a crash, once the slot maps, snapshots and block
+	// refcounts it frees blocks against are loaded
+	if (lfs_mode == 0) {
+		rename_recover();
+	}
+	if ((repl_role != REPL_NONE) && (repl_open(image) == -1)) {
+		printf("Cannot open replication state of %s\n", image);
+		exit(1);
+	}
+	if ((repl_role == REPL_REPLICA) && (UDP_FillSockAddr(&repl_primary, primary_host, 0) != 0)) {
+		printf("Invalid primary %s\n", primary_host);
+		exit(1);
+	}
+	if ((repl_role == REPL_PRIMARY) && (repl_add(replica_list, my_shard - shard_first) == -1)) {
+		printf("Invalid replica list %s\n", replica_list);
+		exit(1);
+	}
+
+	// Signals are taken by shutdown_wait alone: every thread made from here on inherits the mask
+	image_path = image;
+	sigemptyset(&shutdown_signals);
+	sigaddset(&shutdown_signals, SIGINT);
+	sigaddset(&shutdown_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &shutdown_signals, NULL);
+	pthread_t shutdown_thread;
+	pthread_create(&shutdown_thread, NULL, shutdown_wait, NULL);
+	pthread_detach(shutdown_thread);
+
+	// Pull the metadata and the hot blocks of the last run back in while serving
+	warm_start(image);
+
+	if (sched_mode == 1) {
+		pthread_t executor;
+		pthread_create(&executor, NULL, sched_execute, NULL);
+		pthread_detach(executor);
+	}
+
+	if (trace_path != NULL) {
+		char shard_trace[4096];
+		if (shard_last > shard_first) {
+			snprintf(shard_trace, sizeof(shard_trace), "%s.%d", trace_path, my_shard);
+			trace_path = shard_trace;
+		}
+		if (Trace_Open(trace_path) == -1) {
+			printf("Cannot open trace file %s\n", trace_path);
+			exit(1);
+		}
+		trace_mode = 1;
+	}
+
+	printf("First 8 bits:\n");
+	for (int i = 0; i < 8; i++) {
+		printf("Bit %d: %d\n", i, valid_inum(i));
+	}
+
+	// Setup UDP server: one socket, or num_sockets sharing the port with a thread each
+	int *comms = malloc(sizeof(int) * num_sockets);
+	for (int i = 0; i < num_sockets; i++) {
+		if (num_sockets == 1) {
+			comms[i] = UDP_Open(portid);
+			if ((comms[i] > -1) && (rcvbuf > 0)) {
+				setsockopt(comms[i], SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+			}
+		}
+		else {
+			comms[i] = UDP_OpenReusePort(portid, rcvbuf);
+		}
+		assert(comms[i] > -1);
+		if (repl_role == REPL_PRIMARY) {
+			// Wake up often enough to send heartbeats and resends
+			struct timeval timeout;
+			timeout.tv_sec = 0;
+			timeout.tv_usec = REPL_HEARTBEAT_MS * 1000;
+			setsockopt(comms[i], SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));
+		}
+	}
+
+	// Stream transports: TCP on the same port number, Unix-domain socket if asked for
+	int listeners[2];
+	char shard_path[4096];
+	listeners[0] = Stream_ListenTCP(portid);
+	listeners[1] = -1;
+	if (unix_path != NULL) {
+		if (shard_last > shard_first) {
+			snprintf(shard_path, sizeof(shard_path), "%s.%d", unix_path, my_shard);
+			unix_path = shard_path;
+		}
+		listeners[1] = Stream_ListenUnix(unix_path);
+		assert(listeners[1] > -1);
+	}
+	for (int i = 0; i < 2; i++) {
+		pthread_t thread;
+		if (listeners[i] > -1) {
+			pthread_create(&thread, NULL, stream_accept, (void *) (long) listeners[i]);
+			pthread_detach(thread);
+		}
+	}
+
+	printf("Shard %d listening on port %d (%d sockets)...\n", my_shard, portid, num_sockets);
+	if (num_sockets == 1) {
+		serve(&comms[0]);
+		return 0;
+	}
+	pthread_t *threads = malloc(sizeof(pthread_t) * num_sockets);
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (int i = 0; i < num_sockets; i++) {
+		pthread_create(&threads[i], NULL, serve, &comms[i]);
+		if ((pin_threads == 1) && (ncpus > 0)) {
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(i % ncpus, &cpus);
+			pthread_setaffinity_np(threads[i], sizeof(cpus), &cpus);
+		}
+	}
+	for (int i = 0; i < num_sockets; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	return 0;
+}
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "shm.h"
+
+#define SPIN_MIN (64)
+#define SPIN_MAX (16384)
+#define SPIN_START (1024)
+
+static int
+futex(unsigned int *word, int op, unsigned int value, struct timespec *timeout)
+{
+    // not FUTEX_PRIVATE: the word lives in memory shared by two processes
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+static void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static Shm_Region_t *
+map_region(char *name, int flags)
+{
+    int fd = shm_open(name, flags, 0600);
+    if (fd == -1) {
+	perror("shm_open");
+	return NULL;
+    }
+    if ((flags & O_CREAT) && ftruncate(fd, sizeof(Shm_Region_t)) == -1) {
+	close(fd);
+	shm_unlink(name);
+	return NULL;
+    }
+    // a region made by someone else, or too small to touch without SIGBUS, is not ours to serve
+    struct stat st;
+    if (!(flags & O_CREAT) && (fstat(fd, &st) == -1 || st.st_uid != geteuid() ||
+			       st.st_size != sizeof(Shm_Region_t))) {
+	close(fd);
+	return NULL;
+    }
+    void *region = mmap(NULL, sizeof(Shm_Region_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED) {
+	perror("mmap");
+	return NULL;
+    }
+    return (Shm_Region_t *) region;
+}
+
+Shm_Region_t *
+Shm_Create(char *name)
+{
+    Shm_Region_t *region = map_region(name, O_RDWR | O_CREAT | O_EXCL);
+    if (region == NULL) {
+	return NULL;
+    }
+    memset(region, 0, sizeof(Shm_Region_t));
+    // on a single CPU a spinning consumer only keeps its producer from running
+    if (sysconf(_SC_NPROCESSORS_ONLN) > 1) {
+	region->sq.spin = SPIN_START;
+	region->cq.spin = SPIN_START;
+    }
+    region->client_pid = getpid();
+    __atomic_store_n(&region->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    return region;
+}
+
+Shm_Region_t *
+Shm_Attach(char *name)
+{
+    Shm_Region_t *region = map_region(name, O_RDWR);
+    if (region != NULL && __atomic_load_n(&region->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC) {
+	Shm_Detach(region);
+	return NULL;
+    }
+    return region;
+}
+
+void
+Shm_Detach(Shm_Region_t *region)
+{
+    munmap(region, sizeof(Shm_Region_t));
+}
+
+int
+Shm_Unlink(char *name)
+{
+    return shm_unlink(name);
+}
+
+int
+Shm_Push(Shm_Ring_t *ring, int slot)
+{
+    unsigned int tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == SHM_SLOTS) {
+	return -1;
+    }
+    ring->entries[tail % SHM_SLOTS] = slot;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&ring->seq, 1, __ATOMIC_SEQ_CST);
+    // the consumer sets waiting before its last look at tail, so either it
+    // sees the new entry or we see it waiting; skip the syscall otherwise
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST) != 0) {
+	futex(&ring->seq, FUTEX_WAKE, 1, NULL);
+    }
+    return 0;
+}
+
+// take the entry at head if there is one
+static int
+try_pop(Shm_Ring_t *ring)
+{
+    unsigned int head = ring->head;
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST)) {
+	return -1;
+    }
+    int slot = ring->entries[head % SHM_SLOTS];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return slot;
+}
+
+int
+Shm_Pop(Shm_Ring_t *ring, int timeout_ms)
+{
+    struct timespec timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    while (1) {
+	// spin first: a reply is usually only microseconds away
+	for (unsigned int i = 0; i < ring->spin; i++) {
+	    int slot = try_pop(ring);
+	    if (slot != -1) {
+		if (ring->spin < SPIN_MAX) {
+		    ring->spin *= 2;
+		}
+		return slot;
+	    }
+	    cpu_relax();
+	}
+	if (ring->spin / 2 >= SPIN_MIN) {
+	    ring->spin /= 2;
+	}
+
+	// then sleep until the producer bumps seq
+	unsigned int seq = __atomic_load_n(&ring->seq, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+	int slot = try_pop(ring);
+	if (slot != -1) {
+	    __atomic_store_n(&ring->waiting, 0, __ATOMIC_SEQ_CST);
+	    return slot;
+	}
+	int rc = futex(&ring->seq, FUTEX_WAIT, seq, (timeout_ms < 0) ? NULL : &timeout);
+	__atomic_store_n(&ring->waiting, 0, __ATOMIC_SEQ_CST);
+	if (rc == -1 && errno == ETIMEDOUT) {
+	    return try_pop(ring);
+	}
+    }
+}
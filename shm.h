@@ -0,0 +1,69 @@
+#ifndef __SHM_h__
+#define __SHM_h__
+
+//
+// Shared-memory ring transport for clients on the server's host
+//
+// The client creates a region holding a submission ring, a completion ring
+// and a pool of message slots, and hands its name to the server, which maps
+// it too. A request is written straight into a slot and the slot index is
+// pushed on the submission ring; the server writes the reply into the same
+// slot and pushes the index on the completion ring. A consumer spins on its
+// ring for a while (longer after spinning paid off, shorter after it did
+// not), then sleeps on a futex the producer only wakes while it sleeps.
+//
+
+#define SHM_SLOTS (16)
+#define SHM_MSG_SIZE (8192)
+#define SHM_REPLY_SIZE (8192 + 64)
+#define SHM_MAGIC (0x4d465352)
+
+typedef struct __Shm_Slot_t {
+    int len;                     // request bytes in msg
+    char msg[SHM_MSG_SIZE];
+    int reply_len;               // reply bytes in reply
+    char reply[SHM_REPLY_SIZE];
+} Shm_Slot_t;
+
+typedef struct __Shm_Ring_t {
+    unsigned int head;           // next entry to pop, moved by the consumer
+    unsigned int tail;           // next entry to push, moved by the producer
+    unsigned int seq;            // futex word, bumped on every push
+    unsigned int waiting;        // consumer is (about to be) asleep on seq
+    unsigned int spin;           // consumer's current spin budget
+    unsigned int entries[SHM_SLOTS];
+} Shm_Ring_t;
+
+typedef struct __Shm_Region_t {
+    unsigned int magic;
+    int client_pid;              // server drops the region once this process is gone
+    unsigned int attached;       // set by the one server thread that serves it
+    Shm_Ring_t sq;               // client -> server
+    Shm_Ring_t cq;               // server -> client
+    Shm_Slot_t slots[SHM_SLOTS];
+} Shm_Region_t;
+
+//
+// prototypes
+// 
+
+// Create (client) or map an existing (server) region called name. Attach only
+// maps a region of the right size owned by the calling user.
+// Returns the mapped region, NULL if failure
+Shm_Region_t *Shm_Create(char *name);
+Shm_Region_t *Shm_Attach(char *name);
+
+void Shm_Detach(Shm_Region_t *region);
+
+// Removes the name; mappings stay valid
+int Shm_Unlink(char *name);
+
+// Push slot on ring and wake its consumer if it sleeps
+// Returns 0 if success, -1 if the ring is full
+int Shm_Push(Shm_Ring_t *ring, int slot);
+
+// Pop a slot from ring, waiting up to timeout_ms (-1 waits forever)
+// Returns slot, -1 if timed out
+int Shm_Pop(Shm_Ring_t *ring, int timeout_ms);
+
+#endif // __SHM_h__
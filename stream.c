@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "stream.h"
+
+// read or write exactly n bytes, riding out short transfers and signals
+// (a peer that went away is an error, not SIGPIPE)
+static int
+full_io(int fd, char *buffer, int n, int writing)
+{
+    int done = 0;
+    while (done < n) {
+	int rc = writing ? send(fd, buffer + done, n - done, MSG_NOSIGNAL) : recv(fd, buffer + done, n - done, 0);
+	if (rc < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (rc <= 0) {
+	    return rc;
+	}
+	done += rc;
+    }
+    return done;
+}
+
+// requests and replies are small and latency bound, don't let Nagle hold them
+static void
+no_delay(int fd)
+{
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+int
+Stream_ListenTCP(int port)
+{
+    int fd;
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+	perror("socket");
+	return -1;
+    }
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in myaddr;
+    memset(&myaddr, 0, sizeof(myaddr));
+    myaddr.sin_family      = AF_INET;
+    myaddr.sin_port        = htons(port);
+    myaddr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(fd, (struct sockaddr *) &myaddr, sizeof(myaddr)) == -1 || listen(fd, 64) == -1) {
+	perror("bind");
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+int
+Stream_ListenUnix(char *path)
+{
+    struct sockaddr_un myaddr;
+    if (strlen(path) >= sizeof(myaddr.sun_path)) {
+	return -1;
+    }
+    int fd;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+	perror("socket");
+	return -1;
+    }
+
+    memset(&myaddr, 0, sizeof(myaddr));
+    myaddr.sun_family = AF_UNIX;
+    strcpy(myaddr.sun_path, path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *) &myaddr, sizeof(myaddr)) == -1 || listen(fd, 64) == -1) {
+	perror("bind");
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+int
+Stream_Accept(int fd)
+{
+    int conn;
+    do {
+	conn = accept(fd, NULL, NULL);
+    } while (conn < 0 && errno == EINTR);
+    if (conn >= 0) {
+	no_delay(conn);
+    }
+    return conn;
+}
+
+int
+Stream_ConnectTCP(char *hostName, int port)
+{
+    struct hostent *hostEntry;
+    if ((hostEntry = gethostbyname(hostName)) == NULL) {
+	perror("gethostbyname");
+	return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons(port);
+    addr.sin_addr   = *(struct in_addr *) hostEntry->h_addr;
+
+    int fd;
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+	perror("socket");
+	return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+	perror("connect");
+	close(fd);
+	return -1;
+    }
+    no_delay(fd);
+    return fd;
+}
+
+int
+Stream_ConnectUnix(char *path)
+{
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+	return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+	perror("socket");
+	return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+	perror("connect");
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+int
+Stream_Read(int fd, char *buffer, int n)
+{
+    unsigned int len;
+    int rc = full_io(fd, (char *) &len, sizeof(len), 0);
+    if (rc <= 0) {
+	return rc;
+    }
+    len = ntohl(len);
+    if (len > STREAM_MAX_FRAME) {
+	return -1;
+    }
+    if (len > (unsigned int) n) {
+	// skip the payload, the next frame is still readable
+	char skip[4096];
+	while (len > 0) {
+	    int chunk = (len < sizeof(skip)) ? len : sizeof(skip);
+	    if (full_io(fd, skip, chunk, 0) != chunk) {
+		return -1;
+	    }
+	    len -= chunk;
+	}
+	return -2;
+    }
+    rc = full_io(fd, buffer, len, 0);
+    if (rc != (int) len) {
+	return -1;
+    }
+    return len;
+}
+
+int
+Stream_Write(int fd, char *buffer, int n)
+{
+    if (n < 0 || n > STREAM_MAX_FRAME) {
+	return -1;
+    }
+    // header and payload in one send so a small frame is one segment
+    char frame[sizeof(unsigned int) + 8192];
+    unsigned int len = htonl(n);
+    if (n <= (int) (sizeof(frame) - sizeof(len))) {
+	memcpy(frame, &len, sizeof(len));
+	memcpy(frame + sizeof(len), buffer, n);
+	return (full_io(fd, frame, sizeof(len) + n, 1) == (int) (sizeof(len) + n)) ? n : -1;
+    }
+    if (full_io(fd, (char *) &len, sizeof(len), 1) != sizeof(len) || full_io(fd, buffer, n, 1) != n) {
+	return -1;
+    }
+    return n;
+}
+
+int
+Stream_Close(int fd)
+{
+    return close(fd);
+}
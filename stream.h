@@ -0,0 +1,42 @@
+#ifndef __STREAM_h__
+#define __STREAM_h__
+
+//
+// Stream transport (TCP and Unix-domain sockets)
+//
+// Each message travels as one frame: its length as a 4-byte big-endian
+// integer, then that many bytes. Frames are not bounded by a datagram.
+//
+
+#define STREAM_MAX_FRAME (1 << 20)
+
+//
+// prototypes
+// 
+
+// Listen on TCP port / Unix-domain socket path (an old socket file at path is replaced)
+// Returns listening descriptor, -1 if failure
+int Stream_ListenTCP(int port);
+int Stream_ListenUnix(char *path);
+
+// Accept a connection on a listening descriptor
+// Returns connected descriptor, -1 if failure
+int Stream_Accept(int fd);
+
+// Connect to hostName:port over TCP / to the Unix-domain socket at path
+// Returns connected descriptor, -1 if failure
+int Stream_ConnectTCP(char *hostName, int port);
+int Stream_ConnectUnix(char *path);
+
+// Read one frame into buffer (at most n bytes)
+// Returns frame length, 0 if the peer closed, -1 if failure, -2 if the frame was
+// larger than n (it is skipped)
+int Stream_Read(int fd, char *buffer, int n);
+
+// Write n bytes of buffer as one frame
+// Returns n, -1 if failure
+int Stream_Write(int fd, char *buffer, int n);
+
+int Stream_Close(int fd);
+
+#endif // __STREAM_h__
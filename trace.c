@@ -0,0 +1,184 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+
+// Commands that are traced: integer arguments, then whether the rest of the
+// request is a payload. Keep in step with the server's parser.
+typedef struct __Trace_Op_t {
+    char *name;
+    int nargs;
+    int payload;
+} Trace_Op_t;
+
+static Trace_Op_t ops[] = {
+    { "lookup",   1, 1 },
+    { "stat",     1, 0 },
+    { "write",    2, 1 },
+    { "read",     2, 0 },
+    { "creat",    2, 1 },
+    { "mknod",    2, 0 },
+    { "link",     2, 1 },
+    { "drop",     1, 0 },
+    { "unlink",   1, 1 },
+    { "snapshot", 0, 0 },
+    { "snapdel",  1, 0 },
+    { "csumerrs", 0, 0 },
+    { "statfs",   1, 0 },
+    { "rename",   2, 1 },
+    { "punch",    3, 0 },
+};
+
+#define NUM_OPS ((int) (sizeof(ops) / sizeof(ops[0])))
+
+static FILE *trace = NULL;
+static uint64_t trace_start = 0;
+
+uint64_t
+Trace_Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int
+Trace_Open(char *path)
+{
+    trace = fopen(path, "w");
+    if (trace == NULL) {
+	perror("trace");
+	return -1;
+    }
+    // records go out in big writes, see Trace_Flush
+    setvbuf(trace, NULL, _IOFBF, 1 << 20);
+
+    Trace_Header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.start_sec = (uint64_t) time(NULL);
+    if (fwrite(&header, sizeof(header), 1, trace) != 1) {
+	fclose(trace);
+	trace = NULL;
+	return -1;
+    }
+    trace_start = Trace_Now();
+    return 0;
+}
+
+int
+Trace_Parse(char *msg, Trace_Record_t *rec, char *payload)
+{
+    memset(rec, 0, sizeof(Trace_Record_t));
+    payload[0] = '\0';
+
+    int n = strcspn(msg, " ");
+    int op;
+    for (op = 0; op < NUM_OPS; op++) {
+	if ((strncmp(msg, ops[op].name, n) == 0) && (ops[op].name[n] == '\0')) {
+	    break;
+	}
+    }
+    if (op == NUM_OPS) {
+	return -1;
+    }
+    rec->op = op;
+
+    char *p = msg + n;
+    for (int i = 0; i < ops[op].nargs; i++) {
+	rec->args[i] = (int32_t) strtol(p, &p, 10);
+    }
+    if (ops[op].payload == 1) {
+	if (*p == ' ') {
+	    p++;
+	}
+	int len = strlen(p);
+	if (len > TRACE_MAX_PAYLOAD) {
+	    len = TRACE_MAX_PAYLOAD;
+	}
+	memcpy(payload, p, len);
+	payload[len] = '\0';
+	rec->payload_len = len;
+    }
+    return 0;
+}
+
+void
+Trace_Log(Trace_Record_t *rec, char *payload)
+{
+    if (trace == NULL) {
+	return;
+    }
+    // arrival is taken as a Trace_Now() stamp, stored relative to the trace start
+    rec->arrival_ns = (rec->arrival_ns > trace_start) ? rec->arrival_ns - trace_start : 0;
+    fwrite(rec, sizeof(Trace_Record_t), 1, trace);
+    if (rec->payload_len > 0) {
+	fwrite(payload, 1, rec->payload_len, trace);
+    }
+}
+
+void
+Trace_Flush(void)
+{
+    if (trace != NULL) {
+	fflush(trace);
+    }
+}
+
+int
+Trace_ReadHeader(FILE *f, Trace_Header_t *header)
+{
+    if (fread(header, sizeof(Trace_Header_t), 1, f) != 1) {
+	return -1;
+    }
+    if ((header->magic != TRACE_MAGIC) || (header->version != TRACE_VERSION)) {
+	return -1;
+    }
+    return 0;
+}
+
+int
+Trace_Next(FILE *f, Trace_Record_t *rec, char *payload)
+{
+    if (fread(rec, sizeof(Trace_Record_t), 1, f) != 1) {
+	return -1;
+    }
+    if ((rec->op >= NUM_OPS) || (rec->payload_len > TRACE_MAX_PAYLOAD)) {
+	return -1;
+    }
+    if ((rec->payload_len > 0) && (fread(payload, 1, rec->payload_len, f) != rec->payload_len)) {
+	return -1;
+    }
+    payload[rec->payload_len] = '\0';
+    return 0;
+}
+
+int
+Trace_Format(Trace_Record_t *rec, char *payload, char *msg)
+{
+    Trace_Op_t *op = &ops[rec->op];
+    int len = sprintf(msg, "%s", op->name);
+    for (int i = 0; i < op->nargs; i++) {
+	len += sprintf(msg + len, " %d", rec->args[i]);
+    }
+    if (op->payload == 1) {
+	len += sprintf(msg + len, " %s", payload);
+    }
+    return len;
+}
+
+char *
+Trace_OpName(int op)
+{
+    if ((op < 0) || (op >= NUM_OPS)) {
+	return "?";
+    }
+    return ops[op].name;
+}
+
+int
+Trace_NumOps(void)
+{
+    return NUM_OPS;
+}
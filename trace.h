@@ -0,0 +1,76 @@
+#ifndef __TRACE_h__
+#define __TRACE_h__
+
+//
+// Request traces
+//
+// A trace file is a Trace_Header_t, then one Trace_Record_t per request
+// followed by its payload_len payload bytes (the name of lookup / creat /
+// unlink / link, the data of write). Records are in execution order; their
+// arrival times are relative to when the trace was opened.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define TRACE_MAGIC (0x5254464d) // "MFTR"
+#define TRACE_VERSION (1)
+#define TRACE_MAX_PAYLOAD (4096)
+#define TRACE_MAX_ARGS (3)
+
+typedef struct __Trace_Header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t start_sec;      // wall clock time the trace was opened
+} Trace_Header_t;
+
+typedef struct __attribute__((packed)) __Trace_Record_t {
+    uint64_t arrival_ns;     // since the trace was opened
+    uint32_t latency_ns;     // arrival to reply, including waiting for the core
+    int32_t result;          // integer reply
+    int32_t args[TRACE_MAX_ARGS];
+    uint16_t payload_len;
+    uint8_t op;              // index into the command table, see Trace_OpName
+    uint8_t pad;
+} Trace_Record_t;
+
+//
+// prototypes
+//
+
+// Monotonic clock in nanoseconds
+uint64_t Trace_Now(void);
+
+// Starts writing a trace to path (replacing it)
+// Returns 0 if success, -1 if failure
+int Trace_Open(char *path);
+
+// Fills op, args and payload (TRACE_MAX_PAYLOAD + 1 bytes) of rec from request msg
+// Returns 0 if success, -1 if msg is not a traced command
+int Trace_Parse(char *msg, Trace_Record_t *rec, char *payload);
+
+// Appends rec and its payload to the open trace (callers serialize)
+void Trace_Log(Trace_Record_t *rec, char *payload);
+
+// Pushes buffered records to the trace file
+void Trace_Flush(void);
+
+// Reads the header of trace f
+// Returns 0 if success, -1 if f is not a trace
+int Trace_ReadHeader(FILE *f, Trace_Header_t *header);
+
+// Reads the next record of trace f and its payload (TRACE_MAX_PAYLOAD + 1 bytes, 0-terminated)
+// Returns 0 if success, -1 at the end of the trace
+int Trace_Next(FILE *f, Trace_Record_t *rec, char *payload);
+
+// Writes the request text for rec into msg
+// Returns its length
+int Trace_Format(Trace_Record_t *rec, char *payload, char *msg);
+
+// Returns the command name of op, "?" if there is none
+char *Trace_OpName(int op);
+
+// Returns the number of commands in the table (ops are 0 .. Trace_NumOps() - 1)
+int Trace_NumOps(void);
+
+#endif // __TRACE_h__
@@ -1,14 +1,24 @@
 #include "udp.h"
 
-// create a socket and bind it to a port on the current machine
-// used to listen for incoming packets
-int
-UDP_Open(int port)
+// create a socket bound to port, shared with other sockets (SO_REUSEPORT) if
+// reuseport is set, with a receive queue of rcvbuf bytes if rcvbuf is not 0
+static int
+open_bound(int port, int reuseport, int rcvbuf)
 {
     int fd;
     if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
 	perror("socket");
-	return 0;
+	return -1;
+    }
+
+    int on = 1;
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+	perror("setsockopt");
+	close(fd);
+	return -1;
+    }
+    if (rcvbuf > 0) {
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
     }
 
     // set socket timeout
@@ -35,6 +45,23 @@ UDP_Open(int port)
     return fd;
 }
 
+// create a socket and bind it to a port on the current machine
+// used to listen for incoming packets
+int
+UDP_Open(int port)
+{
+    return open_bound(port, 0, 0);
+}
+
+// create a socket bound to port that other sockets may share (SO_REUSEPORT):
+// the kernel spreads incoming packets over them by source address, so one client
+// always lands on the same socket. rcvbuf, if not 0, sets the receive queue bytes
+int
+UDP_OpenReusePort(int port, int rcvbuf)
+{
+    return open_bound(port, 1, rcvbuf);
+}
+
 // fill sockaddr_in struct with proper goodies
 int
 UDP_FillSockAddr(struct sockaddr_in *addr, char *hostName, int port)
@@ -28,6 +28,7 @@
 // 
 
 int UDP_Open(int port);
+int UDP_OpenReusePort(int port, int rcvbuf);
 int UDP_Close(int fd);
 
 int UDP_Read(int fd, struct sockaddr_in *addr, char *buffer, int n);